@@ -0,0 +1,169 @@
+// 2026-10-19 15:40:03
+//
+// allocs: how many times does a request hit malloc?
+//
+// Runs requests through the httpserver.h session machinery over a socketpair,
+// with a handler shaped like paste's request_handler (copy out the method,
+// target and host, set a few headers, respond), and counts every malloc,
+// calloc and realloc made while each request is in flight. The first request
+// on the connection warms up the arena, buffer pool and response free list,
+// so it is reported separately.
+//
+// USAGE: bench/allocs [-n requests]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int counting;
+static long allocs;
+
+void *malloc(size_t size)
+{
+	allocs += counting;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	allocs += counting;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs += counting;
+	return __libc_realloc(ptr, size);
+}
+
+#define GET_REQUEST \
+	"GET /0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f HTTP/1.1\r\n" \
+	"Host: localhost:5000\r\n" \
+	"User-Agent: curl/7.88.1\r\n" \
+	"Accept: */*\r\n" \
+	"Accept-Encoding: gzip, deflate\r\n" \
+	"\r\n"
+
+#define POST_REQUEST \
+	"POST /upload HTTP/1.1\r\n" \
+	"Host: localhost:5000\r\n" \
+	"User-Agent: curl/7.88.1\r\n" \
+	"Accept: */*\r\n" \
+	"Content-Length: 12\r\n" \
+	"Content-Type: application/x-www-form-urlencoded\r\n" \
+	"\r\n" \
+	"hello world\n"
+
+static char body[] = "http://localhost:5000/0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f\n";
+
+// handler: does what paste's request_handler does, minus sqlite and libmagic
+void handler(struct http_request_s *req)
+{
+	struct http_response_s *res;
+	char *method, *target, *host;
+
+	method = http_request_strdup(req, http_request_method(req));
+	target = http_request_strdup(req, http_request_target(req));
+	host   = http_request_strdup(req, http_request_header(req, "Host"));
+
+	(void)target;
+	(void)host;
+
+	res = http_response_init();
+	http_response_status(res, 200);
+	http_response_header(res, "Content-Type", "text/plain");
+	if (method[0] == 'G') {
+		http_response_header(res, "Vary", "Accept-Encoding");
+		http_response_header(res, "Access-Control-Allow-Origin", "*");
+	}
+	http_response_body(res, body, sizeof(body) - 1);
+	http_respond(req, res);
+}
+
+// run: pushes one request through the session, returns the allocations it made
+static long run(http_request_t *session, int peer, char *request)
+{
+	char buf[4096];
+	long before;
+
+	if (write(peer, request, strlen(request)) < 0) {
+		perror("write");
+		exit(1);
+	}
+
+	before = allocs;
+	counting = 1;
+
+	http_session(session);
+
+	counting = 0;
+
+	if (read(peer, buf, sizeof buf) <= 0) {
+		fprintf(stderr, "no response\n");
+		exit(1);
+	}
+
+	return allocs - before;
+}
+
+int main(int argc, char **argv)
+{
+	http_server_t *server;
+	http_request_t *session;
+	int sv[2];
+	long first_get, first_post, get, post;
+	int n, i, opt;
+
+	n = 10000;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-n requests]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	server = http_server_init(0, handler);
+
+	session = (http_request_t *)calloc(1, sizeof(http_request_t));
+	session->socket = sv[0];
+	session->server = server;
+	session->handler = hs_session_io_cb;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+	hs_add_events(session);
+
+	first_get = run(session, sv[1], GET_REQUEST);
+	first_post = run(session, sv[1], POST_REQUEST);
+
+	get = post = 0;
+
+	for (i = 0; i < n; i++) {
+		get += run(session, sv[1], GET_REQUEST);
+		post += run(session, sv[1], POST_REQUEST);
+	}
+
+	printf("%-28s %8s\n", "", "mallocs");
+	printf("%-28s %8ld\n", "first GET on connection", first_get);
+	printf("%-28s %8ld\n", "first POST on connection", first_post);
+	printf("%-28s %8.2f\n", "steady state GET", (double)get / n);
+	printf("%-28s %8.2f\n", "steady state POST", (double)post / n);
+
+	return 0;
+}
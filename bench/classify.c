@@ -0,0 +1,265 @@
+// 2026-10-19 23:14:05
+//
+// classify: content_type against libmagic, for speed and for agreement
+//
+// For every file on the command line, or if there are none a built-in set of
+// samples of the types the classifier knows plus a few it doesn't, times
+// content_type (the classifier with libmagic on a prefix behind it) and
+// magic_buffer on the whole buffer as the server used to, and compares the
+// two answers. "same" means the same mime type and charset, "type" the same
+// mime type with a different charset, "differs" anything else. Text that
+// libmagic gives a language to (text/x-c, text/html and so on) is meant to
+// differ: pastes are all served as text/plain.
+//
+// USAGE: bench/classify [-n iterations] [file...]
+
+#define main paste_main
+#include "../src/paste.c"
+#undef main
+
+#include "bench.h"
+
+#define SAMPLE_SIZE (4096)
+
+struct sample {
+	char *name;
+	char *data;
+	size_t len;
+};
+
+static struct sample samples[64];
+static int nsamples;
+
+static volatile int sink;
+
+static char png[] =
+	"\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\x01\0\0\0\x01\x08\x06\0\0\0\x1f\x15\xc4\x89"
+	"\0\0\0\rIDATx\x9c" "c\xf8\x0f\0\x01\x01\x01\0\x1b\xb6\xee\x56\0\0\0\0IEND\xae" "B`\x82";
+
+static char gif[] =
+	"GIF89a\x01\0\x01\0\x80\0\0\xff\xff\xff\0\0\0!\xf9\x04\x01\0\0\0\0,\0\0\0\0\x01\0\x01\0\0\x02\x02" "D\x01\0;";
+
+static char jpeg[] =
+	"\xff\xd8\xff\xe0\0\x10JFIF\0\x01\x01\0\0\x01\0\x01\0\0\xff\xdb\0C\0";
+
+// an empty one, just the end of central directory record
+static char zip[] =
+	"PK\x05\x06\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
+static char pdf[] =
+	"%PDF-1.4\n%\xe2\xe3\xcf\xd3\n1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n"
+	"2 0 obj\n<< /Type /Pages /Kids [] /Count 0 >>\nendobj\ntrailer\n<< /Root 1 0 R >>\n%%EOF\n";
+
+static char prose[] =
+	"The quick brown fox jumps over the lazy dog. Pack my box with five dozen\n"
+	"liquor jugs. How vexingly quick daft zebras jump! Sphinx of black quartz,\n"
+	"judge my vow.\n\n";
+
+static char unicode[] =
+	"Ce naïve café sert des crêpes à l'œuf — très bien. Größe, Übermaß, ß.\n"
+	"Ελληνικά, русский, 日本語のテキスト, emoji 🙂 too.\n";
+
+static char source[] =
+	"#include <stdio.h>\n\n// main: says hello\nint main(int argc, char **argv)\n{\n"
+	"\tint i;\n\n\tfor (i = 0; i < argc; i++) {\n\t\tprintf(\"%s\\n\", argv[i]);\n\t}\n\n\treturn 0;\n}\n\n";
+
+static char html[] =
+	"<!DOCTYPE html>\n<html>\n<head><title>paste</title></head>\n<body>\n"
+	"<p>Hello, <b>world</b>.</p>\n</body>\n</html>\n";
+
+static void add(char *name, void *data, size_t len)
+{
+	samples[nsamples].name = name;
+	samples[nsamples].data = data;
+	samples[nsamples].len = len;
+	nsamples++;
+}
+
+// repeat: SAMPLE_SIZE bytes of s over and over
+static char *repeat(char *s)
+{
+	char *buf;
+	size_t i, n;
+
+	n = strlen(s);
+	buf = malloc(SAMPLE_SIZE);
+	for (i = 0; i < SAMPLE_SIZE; i++) {
+		buf[i] = s[i % n];
+	}
+
+	// don't end in the middle of a utf-8 sequence
+	for (i = SAMPLE_SIZE; 0 < i && (buf[i - 1] & 0xc0) == 0x80; i--)
+		;
+	if (0 < i && (buf[i - 1] & 0x80)) {
+		i--;
+	}
+	memset(buf + i, '\n', SAMPLE_SIZE - i);
+
+	return buf;
+}
+
+// json: an array of small objects, about SAMPLE_SIZE bytes of it
+static char *json(size_t *len)
+{
+	struct strbuf_t sb;
+	int i;
+
+	memset(&sb, 0, sizeof sb);
+	sbprintf(&sb, "[\n");
+	for (i = 0; sb.len < SAMPLE_SIZE - 100; i++) {
+		sbprintf(&sb, "%s  {\"id\": %d, \"name\": \"item %d\", \"price\": %d.5, \"tags\": [\"a\", \"b\"], \"ok\": %s}",
+			i ? ",\n" : "", i, i, i * 3, i % 2 ? "true" : "false");
+	}
+	sbprintf(&sb, "\n]\n");
+
+	*len = sb.len;
+	return sb.buf;
+}
+
+static void builtin(void)
+{
+	char *buf, *text;
+	void *z;
+	size_t len, zlen;
+	int i;
+
+	add("png", png, sizeof png - 1);
+	add("gif", gif, sizeof gif - 1);
+
+	buf = malloc(SAMPLE_SIZE);
+	memcpy(buf, jpeg, sizeof jpeg - 1);
+	for (i = sizeof jpeg - 1; i < SAMPLE_SIZE; i++) {
+		buf[i] = rand();
+	}
+	add("jpeg", buf, SAMPLE_SIZE);
+
+	add("pdf", pdf, sizeof pdf - 1);
+
+	text = repeat(prose);
+	if (compress_buffer(ENC_GZIP, text, SAMPLE_SIZE, &z, &zlen) == 0) {
+		add("gzip", z, zlen);
+	}
+
+	add("zip", zip, sizeof zip - 1);
+
+	buf = sys_readfile("/proc/self/exe", &len);
+	if (buf) {
+		add("elf", buf, len);
+	}
+
+	add("ascii", text, SAMPLE_SIZE);
+	add("utf8", repeat(unicode), SAMPLE_SIZE);
+
+	buf = json(&len);
+	add("json", buf, len);
+
+	add("c", repeat(source), SAMPLE_SIZE);
+	add("html", repeat(html), SAMPLE_SIZE);
+
+	buf = malloc(SAMPLE_SIZE);
+	for (i = 0; i < SAMPLE_SIZE; i++) {
+		buf[i] = rand();
+	}
+	add("random", buf, SAMPLE_SIZE);
+}
+
+// agree: "same", "type" or "differs", see the top
+static char *agree(char *a, char *b)
+{
+	size_t n;
+
+	if (streq(a, b)) {
+		return "same";
+	}
+
+	n = strcspn(a, ";");
+	if (n == strcspn(b, ";") && strncmp(a, b, n) == 0) {
+		return "type";
+	}
+
+	return "differs";
+}
+
+int main(int argc, char **argv)
+{
+	struct sample *s;
+	double start, ours, theirs, ours_total, theirs_total;
+	char ct[BUFSMALL], mt[BUFSMALL];
+	char *verdict;
+	int n, opt, i, j, same;
+
+	n = 1000;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-n iterations] [file...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	MAGIC_COOKIE = magic_open(MAGIC_MIME);
+	if (MAGIC_COOKIE == NULL || magic_load(MAGIC_COOKIE, NULL) != 0) {
+		fprintf(stderr, "cannot load magic database\n");
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		s = samples + nsamples;
+		s->data = sys_readfile(argv[i], &s->len);
+		if (s->data == NULL) {
+			fprintf(stderr, "%s: couldn't read it\n", argv[i]);
+			return 1;
+		}
+		s->name = argv[i];
+		nsamples++;
+	}
+
+	if (nsamples == 0) {
+		builtin();
+	}
+
+	ours_total = theirs_total = 0;
+	same = 0;
+
+	printf("%-10s %8s %12s %12s %8s  %-8s %s\n",
+		"input", "bytes", "classify ns", "libmagic ns", "speedup", "agree", "classify / libmagic");
+
+	for (i = 0; i < nsamples; i++) {
+		s = samples + i;
+
+		start = now_ns();
+		for (j = 0; j < n; j++) {
+			content_type(ct, sizeof ct, s->data, s->len, NULL);
+			sink += ct[0];
+		}
+		ours = (now_ns() - start) / n;
+
+		start = now_ns();
+		for (j = 0; j < n; j++) {
+			snprintf(mt, sizeof mt, "%s", magic_buffer(MAGIC_COOKIE, s->data, s->len));
+			sink += mt[0];
+		}
+		theirs = (now_ns() - start) / n;
+
+		ours_total += ours;
+		theirs_total += theirs;
+
+		verdict = agree(ct, mt);
+		same += streq(verdict, "same");
+
+		printf("%-10.10s %8zu %12.0f %12.0f %7.1fx  %-8s %s", s->name, s->len, ours, theirs, theirs / ours, verdict, ct);
+		if (!streq(verdict, "same")) {
+			printf(" / %s", mt);
+		}
+		printf("\n");
+	}
+
+	printf("%d of %d the same, %.1fx faster over all of them\n",
+		same, nsamples, theirs_total / ours_total);
+
+	return 0;
+}
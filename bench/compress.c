@@ -0,0 +1,146 @@
+// 2026-10-19 09:12:40
+//
+// compress: what does gzip/deflate cost us, and what does it buy us?
+//
+// For every file on the command line, compresses it at every zlib level with
+// the same stream setup the server uses, and reports the bytes saved against
+// the CPU time spent. The server only compresses a body once (see zcache in
+// paste.c), so the per-request cost on a hit is zero; this is the cost of a
+// miss.
+//
+// USAGE: bench/compress [-n iterations] file...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#define SERVER_LEVEL (6) // COMPRESS_LEVEL in paste.c
+
+// cpu_ns: process cpu time in nanoseconds
+static long long cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// deflate_once: compresses src into dst, returns the compressed size or -1
+static long deflate_once(int level, int wbits, void *src, size_t len, void *dst, size_t cap)
+{
+	z_stream zs;
+	int rc;
+
+	memset(&zs, 0, sizeof zs);
+
+	if (deflateInit2(&zs, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return -1;
+	}
+
+	zs.next_in = src;
+	zs.avail_in = len;
+	zs.next_out = dst;
+	zs.avail_out = cap;
+
+	rc = deflate(&zs, Z_FINISH);
+
+	deflateEnd(&zs);
+
+	return rc == Z_STREAM_END ? (long)zs.total_out : -1;
+}
+
+// readfile: reads the whole file
+static char *readfile(char *path, size_t *len)
+{
+	FILE *fp;
+	char *buf;
+	long size;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	buf = malloc(size + 1);
+	*len = fread(buf, 1, size, fp);
+
+	fclose(fp);
+
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	char *src, *dst;
+	size_t len, cap;
+	long out;
+	long long cpu;
+	int iters, level, wbits, i, opt;
+	double us, mbps, saved;
+
+	iters = 100;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-n iterations] file...\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind == argc || iters <= 0) {
+		fprintf(stderr, "USAGE: %s [-n iterations] file...\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-32s %-7s %5s %10s %10s %7s %10s %9s\n",
+		"file", "coding", "level", "in", "out", "saved", "us/op", "MB/s");
+
+	for (; optind < argc; optind++) {
+		src = readfile(argv[optind], &len);
+		if (src == NULL) {
+			perror(argv[optind]);
+			continue;
+		}
+
+		cap = compressBound(len) + 32;
+		dst = malloc(cap);
+
+		for (wbits = 15 + 16; 15 <= wbits; wbits -= 16) {
+			for (level = 1; level <= 9; level++) {
+				out = 0;
+
+				cpu = cpu_ns();
+
+				for (i = 0; i < iters; i++) {
+					out = deflate_once(level, wbits, src, len, dst, cap);
+				}
+
+				cpu = cpu_ns() - cpu;
+
+				us = (double)cpu / iters / 1000.0;
+				mbps = us > 0 ? len / us : 0;
+				saved = len ? 100.0 * (1.0 - (double)out / len) : 0;
+
+				printf("%-32.32s %-7s %4d%c %10zu %10ld %6.1f%% %10.1f %9.1f\n",
+					argv[optind], wbits == 15 ? "deflate" : "gzip", level,
+					level == SERVER_LEVEL ? '*' : ' ', len, out, saved, us, mbps);
+			}
+		}
+
+		free(dst);
+		free(src);
+	}
+
+	return 0;
+}
@@ -0,0 +1,370 @@
+// 2026-10-19 19:24:51
+//
+// h2: multiplexed HTTP/2 GETs vs HTTP/1.1 keep-alive
+//
+// Forks an httpserver.h server whose handler answers every request with a
+// short paste-sized body, so the numbers are the server's and not sqlite's,
+// and fetches from it over and over: first over HTTP/1.1 with one request
+// at a time on each of c keep-alive connections, then over a single
+// cleartext HTTP/2 connection (prior knowledge, no upgrade) with c streams
+// in flight, for c = 1, 8, 32 and 100. Reports requests per second for
+// each. The HTTP/2 side only speaks as much of the protocol as it needs:
+// request headers are sent as HPACK literals and the response headers are
+// skipped over, not decoded.
+//
+// USAGE: bench/h2 [-P port] [-n requests]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MAXCONC 100
+#define BUFSIZE (1 << 20)
+#define BIGWINDOW (1 << 30)
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+#include "bench.h"
+
+static struct sockaddr_in addr;
+static pid_t server;
+static char *path = "/0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f";
+
+static char body[] = "#include <stdio.h>\n\nint main(void)\n{\n\tputs(\"hello\");\n\treturn 0;\n}\n";
+
+// handler: a paste that is always there
+void handler(struct http_request_s *req)
+{
+	struct http_response_s *res;
+
+	res = http_response_init();
+	http_response_status(res, 200);
+	http_response_header(res, "Content-Type", "text/plain; charset=utf-8");
+	http_response_body(res, body, sizeof(body) - 1);
+	http_respond(req, res);
+}
+
+// stop: takes the server down with us, however we exit
+static void stop(void)
+{
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+}
+
+// serve: forks the server and waits until it takes connections
+static void serve(int port)
+{
+	int fd, i;
+
+	server = fork();
+	if (server == 0) {
+		http_server_listen_addr(http_server_init(port, handler), "127.0.0.1");
+		_exit(1);
+	}
+	atexit(stop);
+
+	for (i = 0; i < 100; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+			close(fd);
+			return;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	fprintf(stderr, "server did not start\n");
+	exit(1);
+}
+
+static int dial(void)
+{
+	int fd, one;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	return fd;
+}
+
+static void writeall(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n <= 0) {
+			perror("write");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+// h1 connection: the response being read and how much of it is left
+struct h1conn {
+	int fd;
+	char *buf;
+	size_t len;
+};
+
+// h1_done: whether buf holds a whole response, consuming it if so
+static int h1_done(struct h1conn *c)
+{
+	char *end, *cl;
+	size_t head, body;
+
+	c->buf[c->len] = '\0';
+	end = strstr(c->buf, "\r\n\r\n");
+	if (end == NULL)
+		return 0;
+	head = end - c->buf + 4;
+	cl = strstr(c->buf, "Content-Length: ");
+	body = cl && cl < end ? strtoul(cl + 16, NULL, 10) : 0;
+	if (c->len < head + body)
+		return 0;
+	c->len -= head + body;
+	memmove(c->buf, c->buf + head + body, c->len);
+	return 1;
+}
+
+static double h1_run(int conc, int n)
+{
+	struct h1conn conns[MAXCONC];
+	struct pollfd pfds[MAXCONC];
+	char req[512];
+	int reqlen, sent, done, i;
+	ssize_t r;
+	double start;
+
+	reqlen = snprintf(req, sizeof req,
+		"GET %s HTTP/1.1\r\nHost: bench\r\nAccept: */*\r\n\r\n", path);
+
+	start = now_secs();
+	sent = done = 0;
+	for (i = 0; i < conc; i++) {
+		conns[i].fd = dial();
+		conns[i].buf = malloc(BUFSIZE + 1);
+		conns[i].len = 0;
+		pfds[i].fd = conns[i].fd;
+		pfds[i].events = POLLIN;
+		if (sent < n) {
+			writeall(conns[i].fd, req, reqlen);
+			sent++;
+		}
+	}
+
+	while (done < n) {
+		if (poll(pfds, conc, 5000) <= 0) {
+			fprintf(stderr, "http/1.1: timed out\n");
+			exit(1);
+		}
+		for (i = 0; i < conc; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			r = read(conns[i].fd, conns[i].buf + conns[i].len, BUFSIZE - conns[i].len);
+			if (r <= 0) {
+				fprintf(stderr, "http/1.1: connection closed\n");
+				exit(1);
+			}
+			conns[i].len += r;
+			while (h1_done(&conns[i])) {
+				done++;
+				if (sent < n) {
+					writeall(conns[i].fd, req, reqlen);
+					sent++;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < conc; i++) {
+		close(conns[i].fd);
+		free(conns[i].buf);
+	}
+	return n / (now_secs() - start);
+}
+
+static void put32(unsigned char *p, unsigned v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// frame: appends a frame to out
+static size_t frame(unsigned char *out, int type, int flags, unsigned id, void *payload, size_t len)
+{
+	out[0] = len >> 16;
+	out[1] = len >> 8;
+	out[2] = len;
+	out[3] = type;
+	out[4] = flags;
+	put32(out + 5, id);
+	memcpy(out + 9, payload, len);
+	return 9 + len;
+}
+
+// h2_request: a HEADERS frame for GET path on stream id, ending the stream
+static size_t h2_request(unsigned char *out, unsigned id)
+{
+	unsigned char block[300];
+	size_t plen, len;
+
+	plen = strlen(path);
+	len = 0;
+	block[len++] = 0x82;	// :method GET
+	block[len++] = 0x86;	// :scheme http
+	block[len++] = 0x04;	// :path, literal without indexing
+	block[len++] = plen;
+	memcpy(block + len, path, plen);
+	len += plen;
+	block[len++] = 0x01;	// :authority, literal without indexing
+	block[len++] = 5;
+	memcpy(block + len, "bench", 5);
+	len += 5;
+	return frame(out, 0x1, 0x1 | 0x4, id, block, len);
+}
+
+static double h2_run(int conc, int n)
+{
+	unsigned char *in, *p, out[MAXCONC * 320], payload[8];
+	size_t inlen, outlen, flen, off;
+	unsigned id, consumed;
+	int fd, sent, done, type, flags;
+	ssize_t r;
+	double start;
+
+	in = malloc(BUFSIZE);
+	start = now_secs();
+	fd = dial();
+
+	// preface, SETTINGS with a large stream window and a matching
+	// connection window so flow control stays out of the way
+	outlen = 24;
+	memcpy(out, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+	payload[0] = 0;
+	payload[1] = 0x4;
+	put32(payload + 2, BIGWINDOW);
+	outlen += frame(out + outlen, 0x4, 0, 0, payload, 6);
+	put32(payload, BIGWINDOW - 65535);
+	outlen += frame(out + outlen, 0x8, 0, 0, payload, 4);
+
+	id = 1;
+	sent = done = 0;
+	consumed = 0;
+	while (sent < n && sent < conc) {
+		outlen += h2_request(out + outlen, id);
+		id += 2;
+		sent++;
+	}
+	writeall(fd, (char *)out, outlen);
+
+	inlen = 0;
+	while (done < n) {
+		r = read(fd, in + inlen, BUFSIZE - inlen);
+		if (r <= 0) {
+			fprintf(stderr, "h2: connection closed\n");
+			exit(1);
+		}
+		inlen += r;
+
+		outlen = 0;
+		off = 0;
+		while (inlen - off >= 9) {
+			p = in + off;
+			flen = p[0] << 16 | p[1] << 8 | p[2];
+			if (inlen - off < 9 + flen)
+				break;
+			type = p[3];
+			flags = p[4];
+			if (type == 0x4 && !(flags & 0x1))
+				outlen += frame(out + outlen, 0x4, 0x1, 0, NULL, 0);
+			if (type == 0x7) {
+				fprintf(stderr, "h2: GOAWAY\n");
+				exit(1);
+			}
+			if (type == 0x0)
+				consumed += flen;
+			if ((type == 0x0 || type == 0x1) && (flags & 0x1)) {
+				done++;
+				if (sent < n) {
+					outlen += h2_request(out + outlen, id);
+					id += 2;
+					sent++;
+				}
+			}
+			off += 9 + flen;
+		}
+		inlen -= off;
+		memmove(in, in + off, inlen);
+		if (consumed > BIGWINDOW / 2) {
+			put32(payload, consumed);
+			outlen += frame(out + outlen, 0x8, 0, 0, payload, 4);
+			consumed = 0;
+		}
+		if (outlen > 0)
+			writeall(fd, (char *)out, outlen);
+	}
+
+	close(fd);
+	free(in);
+	return n / (now_secs() - start);
+}
+
+int main(int argc, char **argv)
+{
+	static int levels[] = { 1, 8, 32, 100 };
+	int port, n, opt, i;
+
+	port = 5050;
+	n = 100000;
+
+	while ((opt = getopt(argc, argv, "P:n:")) != -1) {
+		switch (opt) {
+		case 'P':
+			port = atoi(optarg);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-P port] [-n requests]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	serve(port);
+
+	printf("%12s %12s %12s\n", "in flight", "http/1.1", "h2c");
+	for (i = 0; i < sizeof levels / sizeof levels[0]; i++) {
+		printf("%12d", levels[i]);
+		fflush(stdout);
+		printf(" %12.0f", h1_run(levels[i], n));
+		fflush(stdout);
+		printf(" %12.0f\n", h2_run(levels[i], n));
+	}
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+// 2026-10-19 16:12:47
+//
+// headers: linear header scan vs the per-request header index
+//
+// Parses requests carrying 20, 50 and 100 headers with the httpserver.h
+// tokenizer, then times the lookups a handler typically makes (Host,
+// Accept-Encoding, Connection, a header near the end of the block and one
+// that is not present) first with the old linear scan over the token list
+// and then through the index. The one-off cost of building the index and
+// its hash table is reported separately so it can be weighed against the
+// lookups it saves.
+//
+// USAGE: bench/headers [-n iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NLOOKUPS (sizeof(lookups) / sizeof(lookups[0]))
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+#include "bench.h"
+
+static char *lookups[] = {
+	"Host", "Accept-Encoding", "Connection", "X-Filler-Last", "If-None-Match"
+};
+
+static volatile int sink;
+
+// make_request: a GET with the usual headers padded out to nheaders
+static char *make_request(int nheaders)
+{
+	char *s;
+	size_t len;
+	int i;
+
+	s = malloc(nheaders * 64 + 256);
+	len = sprintf(s,
+		"GET /0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f HTTP/1.1\r\n"
+		"Host: localhost:5000\r\n"
+		"Accept-Encoding: gzip, deflate\r\n");
+
+	for (i = 0; i < nheaders - 4; i++)
+		len += sprintf(s + len, "X-Filler-%03d: value number %d\r\n", i, i);
+
+	len += sprintf(s + len, "X-Filler-Last: last\r\nConnection: keep-alive\r\n\r\n");
+
+	return s;
+}
+
+// parse: tokenizes req into session the same way hs_read_and_process_request does
+static void parse(http_request_t *session, char *req)
+{
+	http_token_t token;
+
+	hs_init_session(session);
+	session->stream.buf = req;
+	session->stream.length = strlen(req);
+	session->stream.capacity = session->stream.length;
+
+	do {
+		token = http_parse(&session->parser, &session->stream);
+		if (token.type != HS_TOK_NONE)
+			http_token_dyn_push(&session->tokens, token);
+	} while (token.type != HS_TOK_NONE && token.type != HS_TOK_BODY && token.type != HS_TOK_ERROR);
+
+	if (token.type != HS_TOK_BODY) {
+		fprintf(stderr, "request did not parse\n");
+		exit(1);
+	}
+}
+
+static void run(int nheaders, int n)
+{
+	http_request_t *session;
+	http_string_t str;
+	hs_arena_block_t *mark, *block;
+	int64_t used;
+	double start, scan, indexed, build;
+	char *req;
+	int i, j, total;
+
+	session = calloc(1, sizeof(http_request_t));
+	req = make_request(nheaders);
+	parse(session, req);
+
+	total = 0;
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < NLOOKUPS; j++) {
+			str = hs_request_header_scan(session, lookups[j], strlen(lookups[j]));
+			total += str.len;
+		}
+	}
+	scan = (now_ns() - start) / ((double)n * NLOOKUPS);
+
+	// rewind the arena after each build so every table lands in the same
+	// memory, as it would for successive requests on a connection
+	mark = session->arena.head;
+	used = mark->used;
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		hs_build_header_index(session);
+		hs_build_header_table(session);
+		while (session->arena.head != mark) {
+			block = session->arena.head;
+			session->arena.head = block->next;
+			free(block);
+		}
+		mark->used = used;
+	}
+	build = (now_ns() - start) / n;
+	hs_build_header_index(session);
+	hs_build_header_table(session);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < NLOOKUPS; j++) {
+			str = http_request_header(session, lookups[j]);
+			total -= str.len;
+		}
+	}
+	indexed = (now_ns() - start) / ((double)n * NLOOKUPS);
+
+	if (total != 0) {
+		fprintf(stderr, "index and scan disagree\n");
+		exit(1);
+	}
+	sink = total;
+
+	printf("%8d %12.1f %12.1f %12.1f\n", nheaders, scan, indexed, build);
+
+	hs_arena_free(&session->arena);
+	free(session);
+	free(req);
+}
+
+int main(int argc, char **argv)
+{
+	int n, opt;
+
+	n = 200000;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%8s %12s %12s %12s\n", "headers", "scan ns", "index ns", "build ns");
+	run(20, n);
+	run(50, n);
+	run(100, n);
+
+	return 0;
+}
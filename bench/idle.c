@@ -0,0 +1,187 @@
+// 2026-10-19 11:02:17
+//
+// idle: C10K idle keep-alive connection benchmark
+//
+// Opens a pile of connections to the server, makes one small request on each
+// so they sit in keep-alive, and then holds them open doing nothing. While
+// they're held, we watch the server's file descriptor count and CPU time
+// through /proc, which is what the per connection timers used to cost us.
+//
+// The server's fd limit has to be high enough for the connection count, i.e:
+//   ulimit -n 65536; ./paste paste.db
+//
+// USAGE: bench/idle -p <server pid> [-a addr] [-P port] [-c conns] [-t seconds]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define REQUEST ("GET /idle HTTP/1.1\r\nHost: bench\r\n\r\n")
+
+// proc_fds: number of open file descriptors in the process
+static int proc_fds(int pid)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[64];
+	int n;
+
+	snprintf(path, sizeof path, "/proc/%d/fd", pid);
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	for (n = 0; (ent = readdir(dir)) != NULL;) {
+		if (ent->d_name[0] != '.') {
+			n++;
+		}
+	}
+
+	closedir(dir);
+
+	return n;
+}
+
+// proc_cpu: user + system cpu time of the process, in clock ticks
+static long proc_cpu(int pid)
+{
+	FILE *fp;
+	char path[64];
+	char buf[1024];
+	char *s;
+	long utime, stime;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	s = fgets(buf, sizeof buf, fp);
+	fclose(fp);
+
+	if (s == NULL || (s = strrchr(buf, ')')) == NULL) {
+		return -1;
+	}
+
+	// fields 14 and 15, counting from after the command name (field 2)
+	if (sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2) {
+		return -1;
+	}
+
+	return utime + stime;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	struct rlimit rl;
+	int *socks;
+	char *host;
+	int pid, port, conns, secs, opened, opt, i;
+	int fds_before, fds_held;
+	long cpu_before, cpu_after, hz;
+	char buf[4096];
+
+	host = "127.0.0.1";
+	port = 5000;
+	conns = 10000;
+	secs = 30;
+	pid = 0;
+
+	while ((opt = getopt(argc, argv, "p:a:P:c:t:")) != -1) {
+		switch (opt) {
+		case 'p': pid = atoi(optarg); break;
+		case 'a': host = optarg; break;
+		case 'P': port = atoi(optarg); break;
+		case 'c': conns = atoi(optarg); break;
+		case 't': secs = atoi(optarg); break;
+		default:
+			fprintf(stderr, "USAGE: %s -p <server pid> [-a addr] [-P port] [-c conns] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (pid <= 0 || conns <= 0) {
+		fprintf(stderr, "USAGE: %s -p <server pid> [-a addr] [-P port] [-c conns] [-t seconds]\n", argv[0]);
+		return 1;
+	}
+
+	// we need one fd per connection too
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < (rlim_t)conns + 64) {
+		rl.rlim_cur = (rlim_t)conns + 64 < rl.rlim_max ? (rlim_t)conns + 64 : rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(host);
+
+	socks = calloc(conns, sizeof(*socks));
+
+	fds_before = proc_fds(pid);
+
+	for (opened = 0; opened < conns; opened++) {
+		socks[opened] = socket(AF_INET, SOCK_STREAM, 0);
+		if (socks[opened] < 0) {
+			perror("socket");
+			break;
+		}
+
+		if (connect(socks[opened], (struct sockaddr *)&addr, sizeof addr) < 0) {
+			perror("connect");
+			close(socks[opened]);
+			break;
+		}
+
+		if (write(socks[opened], REQUEST, strlen(REQUEST)) < 0 || read(socks[opened], buf, sizeof buf) <= 0) {
+			fprintf(stderr, "connection %d: no response\n", opened);
+			close(socks[opened]);
+			break;
+		}
+	}
+
+	// let the server settle before we start counting
+	sleep(1);
+
+	fds_held = proc_fds(pid);
+	cpu_before = proc_cpu(pid);
+
+	sleep(secs);
+
+	cpu_after = proc_cpu(pid);
+
+	hz = sysconf(_SC_CLK_TCK);
+
+	printf("connections held   %d\n", opened);
+	printf("server fds idle    %d\n", fds_before);
+	printf("server fds held    %d\n", fds_held);
+	printf("fds per connection %.2f\n", opened ? (double)(fds_held - fds_before) / opened : 0);
+	printf("server cpu         %.2fs over %ds (%.2f%%)\n",
+		(double)(cpu_after - cpu_before) / hz, secs,
+		100.0 * (cpu_after - cpu_before) / hz / secs);
+
+	for (i = 0; i < opened; i++) {
+		close(socks[i]);
+	}
+
+	free(socks);
+
+	return 0;
+}
@@ -0,0 +1,580 @@
+// 2026-10-19 21:32:17
+//
+// load: keep-alive load generator for a running paste server
+//
+// Keeps a request in flight on each of c connections until n have been
+// answered. Each request is either an upload of a random body or a download
+// of a paste uploaded earlier, in the proportion asked for. Every download
+// is checked against what was uploaded, the way test.sh's single_paste
+// does, but without a curl per request. Bodies are generated from a seed
+// kept with the paste's id, so only the seed has to be remembered. Before
+// the timed run w pastes are uploaded so there is something to download.
+// Reports requests per second, plus the p50, p90, p99 and p99.9 latency
+// for uploads, downloads and the two together. Requests the server sheds,
+// with a 429 or 503, are counted apart; the server is working as meant
+// when it does that. Exits non-zero if any other request failed or any
+// paste came back different.
+//
+// -s takes a size or a min-max range to pick sizes from uniformly. -C closes
+// the connection after every request instead of keeping it alive; latency
+// then includes the connect. -U connects to a unix socket instead of addr and
+// port. -X starts every connection with a PROXY protocol header naming
+// 127.0.0.1 as the client, as a proxy would for paste -p.
+//
+// The server has to trust the client, paste -t 127.0.0.1, or most of the
+// requests are refused by its rate limits. That's the address load connects
+// from, or with -X the one the header names; over -U without -X paste has no
+// address for the client and can't trust it.
+//
+// USAGE: bench/load [-a addr] [-P port] [-U socket] [-c connections]
+//                   [-n requests] [-u upload percent] [-s size[-max]]
+//                   [-w pastes] [-C] [-X]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bench.h"
+
+#define MAXCONNS 4096
+#define POOLSIZE 4096
+#define IDLEN    36
+#define HEADMAX  8192
+#define TIMEOUT  10000 // ms without a single event
+
+enum {
+	  KIND_UPLOAD
+	, KIND_DOWNLOAD
+	, KIND_TOTAL
+};
+
+static char *kind_names[KIND_TOTAL] = {
+	  "upload"   // KIND_UPLOAD
+	, "download" // KIND_DOWNLOAD
+};
+
+// paste: one the server has, the body is regenerated from the seed
+struct paste {
+	char id[IDLEN + 1];
+	uint32_t seed;
+	uint32_t len;
+};
+
+struct conn {
+	int fd;
+	int kind;
+	struct paste p;
+	char *out;
+	size_t outlen, outoff;
+	char *in;
+	size_t inlen, incap;
+	double start;
+};
+
+struct run {
+	int n;          // requests to answer
+	int upload;     // percent of them that are uploads
+	int record;     // whether latencies are kept
+	int sent, done;
+};
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static char host[64];
+static int epfd;
+static int closing;
+static int proxy;
+static uint32_t size_min, size_max;
+
+static struct conn conns[MAXCONNS];
+static int nconns;
+
+static struct paste pool[POOLSIZE];
+static int pool_count;
+
+static uint64_t rng = 0x2545f4914f6cdd1d;
+
+static uint32_t *lat[KIND_TOTAL]; // microseconds
+static int lat_count[KIND_TOTAL];
+static int statuses[600];
+static int errors, shed, mismatches;
+static uint64_t bytes_up, bytes_down;
+
+static uint64_t rnd(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 0x2545f4914f6cdd1dULL;
+}
+
+// fill: the body of the paste with this seed
+static void fill(char *buf, uint32_t len, uint32_t seed)
+{
+	uint64_t x;
+	uint32_t i;
+
+	x = (uint64_t)seed * 0x9e3779b97f4a7c15ULL | 1;
+	for (i = 0; i < len; i++) {
+		if (i % 8 == 0) {
+			x ^= x >> 12;
+			x ^= x << 25;
+			x ^= x >> 27;
+		}
+		buf[i] = x >> (i % 8 * 8);
+	}
+}
+
+static void dial(struct conn *c)
+{
+	struct epoll_event ev;
+	int one;
+
+	c->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (addr.ss_family == AF_INET) {
+		one = 1;
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	}
+	if (connect(c->fd, (struct sockaddr *)&addr, addrlen) < 0 && errno != EINPROGRESS) {
+		perror("connect");
+		exit(1);
+	}
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void hangup(struct conn *c)
+{
+	close(c->fd);
+	c->fd = -1;
+}
+
+// request: builds the next request for c, an upload or a download
+static void request(struct run *r, struct conn *c)
+{
+	char head[512];
+	int headlen, proxylen;
+
+	c->kind = (int)(rnd() % 100) < r->upload || pool_count == 0 ? KIND_UPLOAD : KIND_DOWNLOAD;
+
+	// the header goes first on a new connection only
+	proxylen = 0;
+	if (proxy && c->fd < 0) {
+		proxylen = snprintf(head, sizeof head, "PROXY TCP4 127.0.0.1 127.0.0.1 %d 80\r\n", 1024 + (int)(rnd() % 60000));
+	}
+
+	if (c->kind == KIND_UPLOAD) {
+		c->p.id[0] = '\0';
+		c->p.seed = rnd();
+		c->p.len = size_min + rnd() % (size_max - size_min + 1);
+		headlen = proxylen + snprintf(head + proxylen, sizeof head - proxylen,
+			"POST /upload HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\n"
+			"Content-Length: %u\r\n%s\r\n",
+			host, c->p.len, closing ? "Connection: close\r\n" : "");
+		c->out = realloc(c->out, headlen + c->p.len);
+		memcpy(c->out, head, headlen);
+		fill(c->out + headlen, c->p.len, c->p.seed);
+		c->outlen = headlen + c->p.len;
+	} else {
+		c->p = pool[rnd() % pool_count];
+		headlen = proxylen + snprintf(head + proxylen, sizeof head - proxylen,
+			"GET /%s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+			c->p.id, host, closing ? "Connection: close\r\n" : "");
+		c->out = realloc(c->out, headlen);
+		memcpy(c->out, head, headlen);
+		c->outlen = headlen;
+	}
+
+	c->outoff = 0;
+	c->inlen = 0;
+	c->start = now_secs();
+	r->sent++;
+
+	if (c->fd < 0) {
+		dial(c);
+	}
+}
+
+// response: whether c->in holds a whole response; if it does, its status,
+// body and whether the server is closing the connection
+static int response(struct conn *c, int *status, char **body, size_t *len, int *last)
+{
+	char *end, *line, *next;
+	size_t head, clen;
+
+	c->in[c->inlen] = '\0';
+	end = strstr(c->in, "\r\n\r\n");
+	if (end == NULL) {
+		return c->inlen < HEADMAX ? 0 : -1;
+	}
+	head = end - c->in + 4;
+
+	if (strncmp(c->in, "HTTP/1.1 ", 9) != 0) {
+		return -1;
+	}
+	*status = atoi(c->in + 9);
+
+	clen = 0;
+	*last = 0;
+	for (line = strstr(c->in, "\r\n") + 2; line < end; line = next + 2) {
+		next = strstr(line, "\r\n");
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			clen = strtoul(line + 15, NULL, 10);
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			*last = strncasecmp(line + 11, " close", 6) == 0;
+		}
+	}
+
+	if (c->inlen < head + clen) {
+		if (c->incap < head + clen) {
+			c->incap = head + clen;
+			c->in = realloc(c->in, c->incap + 1);
+		}
+		return 0;
+	}
+
+	*body = c->in + head;
+	*len = clen;
+	return 1;
+}
+
+// finish: checks the answered request and records it
+static void finish(struct run *r, struct conn *c, int status, char *body, size_t len)
+{
+	char *expect, *slash;
+	uint32_t us;
+
+	us = (now_secs() - c->start) * 1e6;
+
+	r->done++;
+	if (r->record) {
+		statuses[status < 600 && 0 < status ? status : 0]++;
+	}
+
+	if (status == 429 || status == 503) {
+		shed += r->record;
+		return;
+	}
+	if (status != 200) {
+		errors++;
+		return;
+	}
+
+	if (c->kind == KIND_UPLOAD) {
+		// http://host/<uuid>\n
+		slash = memrchr(body, '/', len);
+		if (slash == NULL || body + len - slash - 1 < IDLEN) {
+			errors++;
+			return;
+		}
+		memcpy(c->p.id, slash + 1, IDLEN);
+		c->p.id[IDLEN] = '\0';
+		if (pool_count < POOLSIZE) {
+			pool[pool_count++] = c->p;
+		} else {
+			pool[rnd() % POOLSIZE] = c->p;
+		}
+		bytes_up += r->record ? c->p.len : 0;
+	} else {
+		expect = malloc(c->p.len + 1);
+		fill(expect, c->p.len, c->p.seed);
+		if (len != c->p.len || memcmp(body, expect, len) != 0) {
+			if (mismatches++ < 10) {
+				fprintf(stderr, "/%s: got %zu bytes back, uploaded %u\n", c->p.id, len, c->p.len);
+			}
+		}
+		free(expect);
+		bytes_down += r->record ? len : 0;
+	}
+
+	if (r->record) {
+		lat[c->kind][lat_count[c->kind]++] = us;
+	}
+}
+
+// drive: does whatever c's socket allows, returns once it would block
+static void drive(struct run *r, struct conn *c)
+{
+	char *body;
+	size_t len;
+	ssize_t n;
+	int status, last, rc;
+
+	while (c->fd >= 0) {
+		if (c->outoff < c->outlen) {
+			// no SIGPIPE, a server that stopped reading may have said why
+			n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+			if (n < 0 && errno == EAGAIN) {
+				return;
+			}
+			if (n <= 0) {
+				goto refused;
+			}
+			c->outoff += n;
+			continue;
+		}
+
+		n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+		if (n < 0 && errno == EAGAIN) {
+			return;
+		}
+		if (n <= 0) {
+			goto broken;
+		}
+		c->inlen += n;
+
+		rc = response(c, &status, &body, &len, &last);
+		if (rc < 0) {
+			goto broken;
+		}
+		if (rc == 0) {
+			continue;
+		}
+
+		finish(r, c, status, body, len);
+
+		if (last || closing) {
+			hangup(c);
+		}
+		if (r->sent < r->n) {
+			request(r, c);
+		} else if (c->fd >= 0) {
+			hangup(c);
+		}
+	}
+	return;
+
+refused:
+	// the server can answer an upload it won't take, a 429 or 503, before
+	// reading all of it and then close; what it sent is still to be read
+	while (c->inlen < c->incap && (n = read(c->fd, c->in + c->inlen, c->incap - c->inlen)) > 0) {
+		c->inlen += n;
+	}
+	if (response(c, &status, &body, &len, &last) == 1) {
+		finish(r, c, status, body, len);
+		hangup(c);
+		if (r->sent < r->n) {
+			request(r, c);
+		}
+		return;
+	}
+
+broken:
+	// the request is answered, with an error, and tried again on a fresh connection
+	r->done++;
+	errors++;
+	hangup(c);
+	if (r->sent < r->n) {
+		request(r, c);
+	}
+}
+
+// run: answers r->n requests over nconns connections, returns the seconds it took
+static double run(struct run *r)
+{
+	struct epoll_event events[256];
+	double start;
+	int i, n;
+
+	start = now_secs();
+
+	for (i = 0; i < nconns && r->sent < r->n; i++) {
+		request(r, conns + i);
+	}
+
+	while (r->done < r->n) {
+		n = epoll_wait(epfd, events, sizeof events / sizeof events[0], TIMEOUT);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			fprintf(stderr, "timed out, %d of %d requests answered\n", r->done, r->n);
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			drive(r, events[i].data.ptr);
+		}
+	}
+
+	return now_secs() - start;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// pct: the p-th quantile of sorted, in milliseconds
+static double pct(uint32_t *sorted, int n, double p)
+{
+	int i;
+
+	if (n == 0) {
+		return 0;
+	}
+	i = p * n;
+	return sorted[i < n ? i : n - 1] / 1e3;
+}
+
+static void report(char *name, uint32_t *v, int n, double secs)
+{
+	qsort(v, n, sizeof *v, cmp);
+	printf("%-8s %10d %10.0f %8.2f %8.2f %8.2f %8.2f %8.2f\n", name, n, n / secs,
+		pct(v, n, 0.5), pct(v, n, 0.9), pct(v, n, 0.99), pct(v, n, 0.999),
+		n ? v[n - 1] / 1e3 : 0);
+}
+
+int main(int argc, char **argv)
+{
+	struct run warm, timed;
+	uint32_t *all;
+	struct sockaddr_in *in;
+	struct sockaddr_un *un;
+	char *ip, *path, *dash;
+	double secs;
+	int port, n, upload, warmup, opt, i;
+
+	ip = "127.0.0.1";
+	path = NULL;
+	port = 5000;
+	nconns = 64;
+	n = 20000;
+	upload = 10;
+	size_min = size_max = 4096;
+	warmup = 1000;
+
+	while ((opt = getopt(argc, argv, "a:P:U:c:n:u:s:w:CX")) != -1) {
+		switch (opt) {
+		case 'a':
+			ip = optarg;
+			break;
+		case 'P':
+			port = atoi(optarg);
+			break;
+		case 'U':
+			path = optarg;
+			break;
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'u':
+			upload = atoi(optarg);
+			break;
+		case 's':
+			size_min = size_max = strtoul(optarg, &dash, 10);
+			if (*dash == '-') {
+				size_max = strtoul(dash + 1, NULL, 10);
+			}
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'C':
+			closing = 1;
+			break;
+		case 'X':
+			proxy = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (nconns < 1 || MAXCONNS < nconns || n < 1 || upload < 0 || 100 < upload || size_max < size_min) {
+		goto usage;
+	}
+
+	if (path) {
+		un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		if (sizeof un->sun_path <= strlen(path)) {
+			goto usage;
+		}
+		strcpy(un->sun_path, path);
+		addrlen = sizeof *un;
+		snprintf(host, sizeof host, "localhost");
+	} else {
+		in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		if (inet_pton(AF_INET, ip, &in->sin_addr) != 1) {
+			goto usage;
+		}
+		addrlen = sizeof *in;
+		snprintf(host, sizeof host, "%s:%d", ip, port);
+	}
+
+	epfd = epoll_create1(0);
+
+	for (i = 0; i < nconns; i++) {
+		conns[i].fd = -1;
+		conns[i].incap = HEADMAX;
+		conns[i].in = malloc(conns[i].incap + 1);
+	}
+	for (i = 0; i < KIND_TOTAL; i++) {
+		lat[i] = malloc(n * sizeof(uint32_t));
+	}
+
+	warm = (struct run){ .n = warmup, .upload = 100 };
+	if (0 < warmup) {
+		run(&warm);
+	}
+
+	timed = (struct run){ .n = n, .upload = upload, .record = 1 };
+	secs = run(&timed);
+
+	all = malloc(n * sizeof(uint32_t));
+	memcpy(all, lat[KIND_UPLOAD], lat_count[KIND_UPLOAD] * sizeof(uint32_t));
+	memcpy(all + lat_count[KIND_UPLOAD], lat[KIND_DOWNLOAD], lat_count[KIND_DOWNLOAD] * sizeof(uint32_t));
+
+	printf("%d connections%s%s over %s, %u-%u byte pastes, %d%% uploads, %.2fs\n",
+		nconns, closing ? " (closed after each request)" : "", proxy ? " (PROXY header)" : "",
+		path ? path : host, size_min, size_max, upload, secs);
+	printf("%-8s %10s %10s %8s %8s %8s %8s %8s\n",
+		"kind", "requests", "req/s", "p50 ms", "p90 ms", "p99 ms", "p999 ms", "max ms");
+	for (i = 0; i < KIND_TOTAL; i++) {
+		report(kind_names[i], lat[i], lat_count[i], secs);
+	}
+	report("all", all, lat_count[KIND_UPLOAD] + lat_count[KIND_DOWNLOAD], secs);
+	printf("%.1f MB/s up, %.1f MB/s down\n",
+		bytes_up / secs / (1024 * 1024), bytes_down / secs / (1024 * 1024));
+
+	for (i = 0; i < 600; i++) {
+		if (i != 200 && statuses[i]) {
+			printf("status %d: %d\n", i, statuses[i]);
+		}
+	}
+	printf("%d shed, %d errors, %d mismatches\n", shed, errors, mismatches);
+
+	return errors || mismatches ? 1 : 0;
+
+usage:
+	fprintf(stderr, "USAGE: %s [-a addr] [-P port] [-U socket] [-c connections]\n"
+		"\t[-n requests] [-u upload percent] [-s size[-max]] [-w pastes] [-C] [-X]\n", argv[0]);
+	return 1;
+}
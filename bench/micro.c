@@ -0,0 +1,383 @@
+// 2026-10-19 22:06:51
+//
+// micro: the server's hot path functions, one at a time, as JSON
+//
+// Times each of the functions a request goes through on its own:
+// - http_parse on a curl GET, a browser GET and an upload POST
+// - uuid_parse, as routing uses it, on an id and on a static file path
+// - the blob/string conversions in uuid.c
+// - route_match on a paste, a static file and a miss
+// - http_respond_headers writing out the headers of an upload's response
+// - magic_buffer on text and on binary from 256 bytes to 1MB
+// - add_paste, get_paste and get_meta against a database in a temporary directory
+//
+// paste.c (and with it uuid.c) is compiled in whole so its functions can be
+// called directly. The database is set up with paste.c's own init, so run
+// this from the top of the tree (make microbench does).
+//
+// The results go to stdout as one JSON object: the date, the iteration
+// count and a list with nanoseconds per call, plus MB/s where the input has
+// a size. Keep those files to compare runs against each other over time. A
+// table goes to stderr for reading as it runs.
+//
+// USAGE: bench/micro [-n iterations] [-d database iterations]
+
+#define main paste_main
+#include "../src/paste.c"
+#undef main
+
+#include <dirent.h>
+
+#include "bench.h"
+
+#define MAXRESULTS 64
+
+struct result {
+	char *name;
+	char *input;
+	long iterations;
+	double ns;    // per call
+	double bytes; // input size, 0 if it doesn't have one
+};
+
+static struct result results[MAXRESULTS];
+static int nresults;
+
+static volatile int sink;
+
+static char source[] =
+	"// sum: adds up the numbers it's given\n"
+	"int sum(int *v, size_t n)\n"
+	"{\n"
+	"\tsize_t i;\n"
+	"\tint s;\n"
+	"\n"
+	"\tfor (s = 0, i = 0; i < n; i++) {\n"
+	"\t\ts += v[i];\n"
+	"\t}\n"
+	"\n"
+	"\treturn s;\n"
+	"}\n"
+	"\n";
+
+static void record(char *name, char *input, long n, double ns, double bytes)
+{
+	struct result *r;
+
+	r = results + nresults++;
+	r->name = name;
+	r->input = input;
+	r->iterations = n;
+	r->ns = ns / n;
+	r->bytes = bytes;
+
+	if (bytes) {
+		fprintf(stderr, "%-16s %-14s %12.1f ns %10.1f MB/s\n",
+			name, input, r->ns, bytes / r->ns * 1e9 / (1024 * 1024));
+	} else {
+		fprintf(stderr, "%-16s %-14s %12.1f ns\n", name, input, r->ns);
+	}
+}
+
+static void bench_parse(char *input, const char *req, long n)
+{
+	http_parser_t parser;
+	hs_stream_t stream;
+	http_token_t token;
+	double start;
+	int len, tokens;
+	long i;
+
+	len = strlen(req);
+	tokens = 0;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		parser = (http_parser_t){ };
+		stream = (hs_stream_t){ };
+		stream.buf = (char *)req;
+		stream.length = len;
+		stream.capacity = len;
+		do {
+			token = http_parse(&parser, &stream);
+			tokens += token.type != HS_TOK_NONE;
+		} while (token.type != HS_TOK_NONE && token.type != HS_TOK_BODY && token.type != HS_TOK_ERROR);
+	}
+	record("http_parse", input, n, now_ns() - start, len);
+	sink = tokens;
+}
+
+static void bench_uuid_parse(char *input, char *id, long n)
+{
+	unsigned char uuid[UUID_BLOB_LEN];
+	double start;
+	size_t len;
+	int hits;
+	long i;
+
+	hits = 0;
+	len = strlen(id);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		hits += uuid_parse(id, len, uuid) == 0;
+	}
+	record("uuid_parse", input, n, now_ns() - start, len);
+	sink = hits;
+}
+
+static void bench_route(char *input, char *method, char *target, long n)
+{
+	struct http_string_s m, t;
+	struct route_args_t args;
+	double start;
+	long i;
+	int hits;
+
+	m.buf = method;
+	m.len = strlen(method);
+	t.buf = target;
+	t.len = strlen(target);
+
+	hits = 0;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		hits += route_match(m, t, &args) != NULL;
+	}
+	record("route_match", input, n, now_ns() - start, 0);
+	sink = hits;
+}
+
+static void bench_uuid(long n)
+{
+	unsigned char blob[16], str[37];
+	double start;
+	long i;
+
+	memcpy(str, "0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f", 37);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		str[0] = "0123456789abcdef"[i & 15];
+		sink += sqlite3UuidStrToBlob(str, blob);
+	}
+	record("uuid_str_to_blob", "uuid", n, now_ns() - start, 36);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		blob[0] = i;
+		sqlite3UuidBlobToStr(blob, str);
+		sink += str[1];
+	}
+	record("uuid_blob_to_str", "uuid", n, now_ns() - start, 16);
+}
+
+static void bench_headers(long n)
+{
+	http_request_t *request;
+	http_response_t *res;
+	grwprintf_t printctx;
+	double total, start;
+	long i;
+
+	request = (http_request_t *)calloc(1, sizeof(http_request_t));
+	request->server = server;
+	request->flags = HTTP_KEEP_ALIVE;
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		res = http_response_init();
+		http_response_status(res, 200);
+		http_response_header(res, "Content-Type", "text/plain");
+		http_response_body(res, "http://localhost:5000/0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f\n", 59);
+		grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &server->pool, &server->memused);
+
+		start = now_ns();
+		http_respond_headers(request, res, &printctx);
+		total += now_ns() - start;
+
+		sink += printctx.size;
+		server->memused -= printctx.capacity;
+		hs_pool_put(&server->pool, printctx.buf, printctx.capacity);
+		hs_response_free(res);
+	}
+	record("respond_headers", "upload", n, total, 0);
+
+	free(request);
+}
+
+static void bench_magic(char *input, char *buf, size_t len, long n)
+{
+	double start;
+	long i;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		sink += magic_buffer(MAGIC_COOKIE, buf, len)[0];
+	}
+	record("magic_buffer", input, n, now_ns() - start, len);
+}
+
+static void bench_db(long n)
+{
+	unsigned char (*ids)[UUID_BLOB_LEN];
+	struct paste_meta_t meta;
+	void *blob;
+	size_t len;
+	double start;
+	long i;
+
+	ids = calloc(n, sizeof *ids);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (add_paste(ids[i], (void *)upload_req, sizeof upload_req - 1, "127.0.0.1") < 0) {
+			fprintf(stderr, "add_paste failed\n");
+			exit(1);
+		}
+	}
+	record("add_paste", "upload", n, now_ns() - start, sizeof upload_req - 1);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (get_paste(ids[(i * 7919) % n], &blob, &len) != 0) {
+			fprintf(stderr, "get_paste failed\n");
+			exit(1);
+		}
+		sink += len;
+		free(blob);
+	}
+	record("get_paste", "upload", n, now_ns() - start, sizeof upload_req - 1);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (get_meta(ids[(i * 7919) % n], &meta) != 0) {
+			fprintf(stderr, "get_meta failed\n");
+			exit(1);
+		}
+		sink += meta.size;
+	}
+	record("get_meta", "upload", n, now_ns() - start, 0);
+
+	free(ids);
+}
+
+// rmtree: removes the temporary directory and the database files in it
+static void rmtree(char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *d;
+
+	d = opendir(dir);
+	while (d && (ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] != '.') {
+			snprintf(path, sizeof path, "%s/%s", dir, ent->d_name);
+			unlink(path);
+		}
+	}
+	if (d) {
+		closedir(d);
+	}
+	rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+	static size_t sizes[] = { 256, 4096, 65536, 1 << 20 };
+	static char *text_names[] = { "text_256", "text_4k", "text_64k", "text_1m" };
+	static char *binary_names[] = { "binary_256", "binary_4k", "binary_64k", "binary_1m" };
+	char dir[] = "/tmp/paste-micro-XXXXXX";
+	char dbpath[PATH_MAX];
+	char date[BUFSMALL];
+	char *text, *binary;
+	struct tm tm;
+	time_t t;
+	long n, dbn, mn;
+	int opt, i;
+
+	n = 1000000;
+	dbn = 200;
+
+	while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 'd':
+			dbn = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-n iterations] [-d database iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(dbpath, sizeof dbpath, "%s/paste.db", dir);
+
+	init(dbpath, "schema.sql");
+
+	server = http_server_init(0, request_handler);
+
+	bench_parse("curl", curl_req, n);
+	bench_parse("browser", browser_req, n);
+	bench_parse("upload", upload_req, n);
+
+	bench_uuid_parse("uuid", "0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f", n);
+	bench_uuid_parse("path", "index.html", n);
+
+	bench_uuid(n);
+
+	bench_route("paste", "GET", "/0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f", n);
+	bench_route("static", "GET", "/css/style.css?v=2", n);
+	bench_route("miss", "POST", "/nope", n);
+
+	bench_headers(n);
+
+	text = malloc(sizes[3]);
+	binary = malloc(sizes[3]);
+	for (i = 0; i < (int)sizes[3]; i++) {
+		text[i] = source[i % (sizeof source - 1)];
+		binary[i] = rand();
+	}
+
+	for (i = 0; i < 4; i++) {
+		// NOTE (Brian) libmagic is slow, so it gets about as many bytes as
+		// a 4KB input would in n / 1000 calls, and at least 10 calls
+		mn = n / 1000 * 4096 / sizes[i];
+		mn = mn < 10 ? 10 : mn;
+		bench_magic(text_names[i], text, sizes[i], mn);
+		bench_magic(binary_names[i], binary, sizes[i], mn);
+	}
+
+	bench_db(dbn);
+
+	cleanup();
+	rmtree(dir);
+
+	t = time(NULL);
+	gmtime_r(&t, &tm);
+	strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	printf("{\n\t\"date\": \"%s\",\n\t\"iterations\": %ld,\n\t\"results\": [\n", date, n);
+	for (i = 0; i < nresults; i++) {
+		printf("\t\t{\"name\": \"%s\", \"input\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f",
+			results[i].name, results[i].input, results[i].iterations, results[i].ns);
+		if (results[i].bytes) {
+			printf(", \"bytes\": %.0f, \"mb_per_s\": %.1f", results[i].bytes,
+				results[i].bytes / results[i].ns * 1e9 / (1024 * 1024));
+		}
+		printf("}%s\n", i < nresults - 1 ? "," : "");
+	}
+	printf("\t]\n}\n");
+
+	free(text);
+	free(binary);
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+// 2026-10-19 16:58:20
+//
+// parser: request parser throughput in bytes per second
+//
+// Runs http_parse over a few request shapes seen in practice, a bare curl
+// GET, a browser GET dragging a long cookie and user agent along, and an API
+// POST with a long query string and bearer token, and reports how fast the
+// tokenizer gets through each. Only the parse is timed; the requests are
+// already in the stream buffer, as they would be after a read.
+//
+// USAGE: bench/parser [-n iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+#include "bench.h"
+
+static volatile int sink;
+
+static void run(char *name, const char *req, int n)
+{
+	http_parser_t parser;
+	hs_stream_t stream;
+	http_token_t token;
+	double start, secs;
+	int len, i, tokens;
+
+	len = strlen(req);
+	tokens = 0;
+
+	start = now_secs();
+	for (i = 0; i < n; i++) {
+		parser = (http_parser_t){ };
+		stream = (hs_stream_t){ };
+		stream.buf = (char *)req;
+		stream.length = len;
+		stream.capacity = len;
+		do {
+			token = http_parse(&parser, &stream);
+			tokens += token.type != HS_TOK_NONE;
+		} while (token.type != HS_TOK_NONE && token.type != HS_TOK_BODY && token.type != HS_TOK_ERROR);
+		if (token.type != HS_TOK_BODY) {
+			fprintf(stderr, "%s: request did not parse\n", name);
+			exit(1);
+		}
+	}
+	secs = now_secs() - start;
+	sink = tokens;
+
+	printf("%-8s %6d %10.1f %10.0f\n", name, len,
+		(double)len * n / secs / (1024 * 1024), n / secs);
+}
+
+int main(int argc, char **argv)
+{
+	int n, opt;
+
+	n = 200000;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%-8s %6s %10s %10s\n", "corpus", "bytes", "MB/s", "req/s");
+	run("curl", curl_req, n);
+	run("browser", browser_req, n);
+	run("api", api_req, n);
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+// 2026-10-19 20:41:06
+//
+// respond: what it costs to serialize a response's status line and headers
+//
+// Builds the three kinds of response paste sends most, a bare 404, the
+// text/plain reply to an upload and a compressed static file, and times
+// turning each into its header block three ways: with the old printf per
+// line, with the per header copies http_respond makes now, and from a
+// response template where only Date, Connection, Content-Length and the
+// per response headers are written. Only the serialization is timed, the
+// response setup and buffer are the same for all three.
+//
+// USAGE: bench/respond [-n iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+#include "bench.h"
+
+enum {
+	  SHAPE_NOT_FOUND
+	, SHAPE_UPLOAD
+	, SHAPE_ASSET
+	, SHAPE_TOTAL
+};
+
+static char *shape_names[SHAPE_TOTAL] = {
+	  "404"
+	, "upload"
+	, "asset"
+};
+
+static struct http_template_s *templates[SHAPE_TOTAL];
+
+static volatile int sink;
+
+void handler(struct http_request_s *req)
+{
+	(void)req;
+}
+
+// printf_headers: http_respond_headers as it was, one printf per line
+static void printf_headers(http_request_t *request, http_response_t *response, grwprintf_t *printctx)
+{
+	http_header_t *header;
+
+	http_response_header(response, "Connection", "keep-alive");
+	grwprintf(printctx, "HTTP/1.1 %d %s\r\nDate: %s\r\n",
+		response->status, hs_status_text[response->status], request->server->date);
+	for (header = response->headers; header; header = header->next)
+		grwprintf(printctx, "%s: %s\r\n", header->key, header->value);
+	grwprintf(printctx, "Content-Length: %d\r\n", response->content_length);
+	grwprintf(printctx, "\r\n");
+}
+
+// make_response: sets up a response the way paste does, with or without its template
+static http_response_t *make_response(int shape, int templated)
+{
+	http_response_t *res;
+
+	res = http_response_init();
+
+	switch (shape) {
+	case SHAPE_NOT_FOUND:
+		if (templated) {
+			http_response_template(res, templates[shape]);
+		} else {
+			http_response_status(res, 404);
+		}
+		break;
+	case SHAPE_UPLOAD:
+		if (templated) {
+			http_response_template(res, templates[shape]);
+		} else {
+			http_response_status(res, 200);
+			http_response_header(res, "Content-Type", "text/plain");
+		}
+		http_response_body(res, "http://localhost:5000/0a1b2c3d-0a1b-4c3d-8e9f-0a1b2c3d4e5f\n", 59);
+		break;
+	case SHAPE_ASSET:
+		if (templated) {
+			http_response_template(res, templates[shape]);
+		} else {
+			http_response_status(res, 200);
+			http_response_header(res, "Access-Control-Allow-Origin", "*");
+			http_response_header(res, "Vary", "Accept-Encoding");
+		}
+		http_response_header(res, "Content-Type", "text/html; charset=us-ascii");
+		http_response_header(res, "Content-Encoding", "gzip");
+		http_response_body(res, "", 12345);
+		break;
+	}
+
+	return res;
+}
+
+// run: serializes n responses of the given shape, returns ns per response
+static double run(http_request_t *request, int shape, int how, int n, int *size)
+{
+	http_response_t *res;
+	grwprintf_t printctx;
+	double start, total;
+	int i;
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		res = make_response(shape, how == 2);
+		grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->pool, &request->server->memused);
+
+		start = now_ns();
+		if (how == 0) {
+			printf_headers(request, res, &printctx);
+		} else {
+			http_respond_headers(request, res, &printctx);
+		}
+		total += now_ns() - start;
+
+		*size = printctx.size;
+		sink += printctx.buf[printctx.size - 1];
+		request->server->memused -= printctx.capacity;
+		hs_pool_put(&request->server->pool, printctx.buf, printctx.capacity);
+		hs_response_free(res);
+	}
+
+	return total / n;
+}
+
+int main(int argc, char **argv)
+{
+	http_server_t *server;
+	http_request_t *request;
+	double ns[3];
+	int size[3];
+	int n, opt, i, j;
+
+	n = 1000000;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "USAGE: %s [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	server = http_server_init(0, handler);
+
+	request = (http_request_t *)calloc(1, sizeof(http_request_t));
+	request->server = server;
+	request->flags = HTTP_KEEP_ALIVE;
+
+	templates[SHAPE_NOT_FOUND] = http_template_init(404);
+	templates[SHAPE_UPLOAD] = http_template_init(200);
+	http_template_header(templates[SHAPE_UPLOAD], "Content-Type", "text/plain");
+	templates[SHAPE_ASSET] = http_template_init(200);
+	http_template_header(templates[SHAPE_ASSET], "Access-Control-Allow-Origin", "*");
+	http_template_header(templates[SHAPE_ASSET], "Vary", "Accept-Encoding");
+
+	printf("%-8s %6s %12s %12s %12s\n", "shape", "bytes", "printf ns", "copy ns", "template ns");
+	for (i = 0; i < SHAPE_TOTAL; i++) {
+		for (j = 0; j < 3; j++) {
+			ns[j] = run(request, i, j, n, &size[j]);
+		}
+		// the lines come out in a different order, but there are as many bytes
+		if (size[0] != size[1] || size[0] != size[2]) {
+			fprintf(stderr, "%s: header blocks differ in size\n", shape_names[i]);
+			return 1;
+		}
+		printf("%-8s %6d %12.1f %12.1f %12.1f\n", shape_names[i], size[0], ns[0], ns[1], ns[2]);
+	}
+
+	for (i = 0; i < SHAPE_TOTAL; i++) {
+		http_template_free(templates[i]);
+	}
+	free(request);
+
+	return 0;
+}
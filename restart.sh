@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+# Brian Chrzanowski
+# 2026-10-19 15:52:08
+#
+# Hot restart test.
+#
+# Starts paste and puts load on it with `make bench`, closing the connection
+# after every request so there's a steady stream of new ones that could be
+# refused. A second paste is started partway through, takes the listening
+# socket over, and the first drains and exits. Passes if the load saw no
+# errors at all, refused or reset connections included, the first paste
+# exited cleanly and the second is still answering.
+#
+# Run it from the top of the tree, with paste and bench/load built.
+
+ADDR="http://localhost"
+PORT=5000
+
+LOADFLAGS="-C -n 20000"
+RESTART_AFTER=5000 # lines in the access log, warm up included
+
+DATADIR=$(mktemp -d -t paste-XXXXXXXX)
+
+function fail
+{
+	echo "FAIL: $1"
+	kill $OLD $NEW &> /dev/null
+	exit 1
+}
+
+# wait_up: waits for something to answer on the port
+function wait_up
+{
+	for i in $(seq 50); do
+		curl --silent --output /dev/null "$ADDR:$PORT/" && return 0
+		sleep 0.1
+	done
+
+	return 1
+}
+
+./paste -t 127.0.0.1 "$DATADIR/db" "$DATADIR/access.log" > "$DATADIR/old.log" 2>&1 &
+OLD=$!
+
+wait_up || fail "paste didn't start"
+
+make --no-print-directory bench PORT=$PORT LOADFLAGS="$LOADFLAGS" > "$DATADIR/bench.log" 2>&1 &
+BENCH=$!
+
+while [ $(wc -l < "$DATADIR/access.log") -lt $RESTART_AFTER ]; do
+	kill -0 $BENCH &> /dev/null || fail "the load finished before the restart"
+	sleep 0.1
+done
+
+./paste -t 127.0.0.1 "$DATADIR/db" "$DATADIR/access.log" > "$DATADIR/new.log" 2>&1 &
+NEW=$!
+
+wait $BENCH
+BENCH_RC=$?
+
+cat "$DATADIR/bench.log"
+
+[ $BENCH_RC -eq 0 ] || fail "the load saw errors"
+
+grep -q "handed over" "$DATADIR/old.log" || fail "the first paste never handed over"
+
+wait $OLD
+[ $? -eq 0 ] || fail "the first paste didn't exit cleanly"
+
+kill -0 $NEW &> /dev/null || fail "the second paste isn't running"
+curl --silent --fail --output /dev/null "$ADDR:$PORT/" || fail "the second paste isn't answering"
+
+kill $NEW
+wait $NEW
+
+rm -rf "$DATADIR"
+
+echo "OK: restarted under load without a refused connection"
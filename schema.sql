@@ -16,3 +16,13 @@ create table if not exists pastes
 -- idx_pastes_id: ensure the uuid we generate is unique
 create unique index if not exists idx_pastes_id on pastes (id);
 
+
+-- paste_meta: the size, type and hash of each paste's data, kept apart from
+-- pastes so they can be read without touching the pages the data is on
+create table if not exists paste_meta
+(
+      id         text primary key
+    , size       integer not null
+    , mime_type  text not null
+    , sha256     text not null
+) without rowid;
@@ -49,14 +49,32 @@
 *   same file that you define HTTPSERVER_IMPL These defines have default values
 *   and will need to be #undef'd and redefined to configure them.
 *
-*     HTTP_REQUEST_BUF_SIZE - default 1024 - The initial size in bytes of the
+*     HTTP_REQUEST_BUF_SIZE - default 4096 - The initial size in bytes of the
 *       read buffer for the request. This buffer grows automatically if it's
 *       capacity is reached but it certain environments it may be optimal to
-*       change this value.
+*       change this value. Once a Content-Length has been read the buffer is
+*       grown straight to the size the body needs.
 *
 *     HTTP_RESPONSE_BUF_SIZE - default 1024 - Same as above except for the
 *       response buffer.
 *
+*     HTTP_PIPELINE_MAX - default 16 - How many responses to pipelined requests
+*       may be queued on a connection before they are written out. Complete
+*       requests already in the read buffer are answered back to back and
+*       their responses go out together in one write.
+*
+*     HTTP_H2_MAX_STREAMS - default 100 - The most HTTP/2 streams a client may
+*       have open on one connection at a time, advertised to it as
+*       SETTINGS_MAX_CONCURRENT_STREAMS. Cleartext HTTP/2 is spoken to clients
+*       that send the connection preface straight away or ask for it with
+*       Upgrade: h2c.
+*
+*     HTTP_H2_CONN_BUFFER - default 33554432 (32MB) - The most request body
+*       bytes an HTTP/2 client may have buffered on one connection, across all
+*       its streams. It is the connection's flow control window: the credit
+*       for a stream's DATA is only handed back once the stream has been
+*       answered or reset. A client that sends more than that gets a GOAWAY.
+*
 *     HTTP_REQUEST_TIMEOUT - default 20 - The amount of seconds the request will
 *       wait for activity on the socket before closing. This only applies mid
 *       request. For the amount of time to hold onto keep-alive connections see
@@ -69,14 +87,77 @@
 *       amount of read/write buffer space that is allowed to be allocated across
 *       all requests before new requests will get 503 responses.
 *
+*     HTTP_ADMIT_TARGET_MS - default 20 - How long a ready connection may wait
+*       behind others in the event loop before the server counts as behind.
+*       The wait is measured by posting a probe event to the loop every few
+*       milliseconds while it is busy and timing how long it takes to come
+*       round.
+*
+*     HTTP_ADMIT_INTERVAL_MS - default 100 - How long the wait has to stay above
+*       the target before the server sheds load. While it does, new requests
+*       with a body are answered with 503 and Retry-After, and requests without
+*       one only once they would wait longer than the interval itself. Load
+*       shedding stops with the first probe that comes back under the target.
+*
+*     HTTP_ADMIT_MAX_UPLOADS - default 64 - The most requests with a body that
+*       may be in flight at once. Past this, or past HTTP_ADMIT_MAX_UPLOAD_BYTES
+*       (default 268435456, 256MB) of declared body bytes, new ones get a 503
+*       before their body is read.
+*
+*     HTTP_RATE_TABLE_SIZE - default 16384 - How many clients and subnets the
+*       rate limiter keeps token buckets for. It is off until
+*       http_server_rate_limit is called. When the table is full the bucket
+*       used least recently is dropped to make room; a client that comes back
+*       starts over with a full bucket. Must be a power of two.
+*
+*     HTTP_TRUST_MAX - default 8 - How many address ranges can be given to
+*       http_server_trust.
+*
+*     HTTP_RATE_SUBNET_FACTOR - default 8 - Each /24 subnet, /48 for IPv6,
+*       gets its own pair of buckets, this many times the size and refill rate
+*       of a single address's (a /64 for IPv6), so a client can't get round its
+*       limits by spreading its requests over neighbouring addresses. Clients
+*       with no address share one pair of buckets of this size.
+*
+*     HTTP_TRACE_SPANS - default 8 - How many spans the application can add to
+*       a request's trace with http_request_trace_span. Tracing is off until
+*       http_server_trace or http_server_access_log is called.
+*
 *     HTTP_MAX_TOKEN_LENGTH - default 8192 (8KB) - This is the max size of any
 *       non body http tokens. i.e: header names, header values, url length, etc.
 *
+*     HTTP_NO_SIMD - undefined by default - Define it to keep the parser from
+*       using SSE2/AVX2 to skip over request targets and header values. The
+*       scalar loop it falls back to gives the same results.
+*
+*     HTTP_HEADER_INDEX_MIN - default 16 - Requests with more headers than this
+*       get a hash table for http_request_header lookups. Below it a linear
+*       scan is cheaper than building the table.
+*
 *     HTTP_MAX_REQUEST_BUF_SIZE - default 8388608 (8MB) - This is the maximum
 *       amount of bytes that the request buffer will grow to. If the body of the
 *       request + headers cannot fit in this size the request body will be
 *       streamed in.
 *
+*     HTTP_SPILL_BUF_SIZE - default 65536 (64KB) - The size the read buffer is
+*       grown to while a request body is being written to a file, see
+*       http_server_spill_bodies. Each read off the socket is at most this big.
+*
+*     HTTP_ARENA_BLOCK_SIZE - default 4096 - Size of the blocks the per request
+*       arena is carved from. The first block is kept for the life of the
+*       connection, so requests that fit in it don't call malloc at all.
+*
+*     HTTP_RESPONSE_INLINE_HEADERS - default 16 - Response headers stored in the
+*       response itself before falling back to malloc.
+*
+*     HTTP_POOL_CLASS_MAX - default 64 - Request and response buffers come from
+*       a pool of power of four size classes, starting at 4KB. This is the most
+*       free buffers kept around per size class.
+*
+*     HTTP_POOL_MAX_CLASS_BYTES - default 33554432 (32MB) - The most bytes of
+*       free buffers kept around per size class. Buffers returned to a full
+*       class are freed.
+*
 *   For more details see the documentation of the interface and the example
 *   below.
 *
@@ -85,6 +166,8 @@
 #ifndef HTTPSERVER_H
 #define HTTPSERVER_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -99,6 +182,7 @@ struct http_string_s {
 struct http_server_s;
 struct http_request_s;
 struct http_response_s;
+struct http_template_s;
 
 // Returns the event loop id that the server is running on. This will be an
 // epoll fd when running on Linux or a kqueue on BSD. This can be used to
@@ -135,12 +219,37 @@ struct http_server_s* http_server_init(int port, void (*handler)(struct http_req
 void http_server_set_userdata(struct http_server_s* server, void* data);
 
 // Starts the event loop and the server listening. During normal operation this
-// function will not return. Return value is the error code if the server fails
+// function will not return, it returns 0 once the server has been drained
+// (see http_server_drain). Return value is the error code if the server fails
 // to start. By default it will listen on all interface. For the second variant
 // provide the IP address of the interface to listen on, or NULL for any.
 int http_server_listen(struct http_server_s* server);
 int http_server_listen_addr(struct http_server_s* server, const char* ipaddr);
 
+// Same as above but listens on a Unix domain socket at path, for a reverse
+// proxy on the same host. Whatever is at path already is removed first. The
+// socket is given mode, the proxy has to be able to write to it. Clients
+// connecting over it have no address unless the proxy gives theirs (see
+// http_server_proxy_protocol).
+int http_server_listen_unix(struct http_server_s* server, const char* path, int mode);
+
+// Same as above but listens on a socket that is already bound and listening
+// instead of making one. This is how a new process takes over from an old one
+// without refusing a connection: the old one passes its listening socket over
+// (SCM_RIGHTS on a Unix socket, say) and then drains.
+int http_server_listen_socket(struct http_server_s* server, int socket);
+
+// The listening socket, or -1 if the server isn't listening.
+int http_server_socket(struct http_server_s* server);
+
+// Stops accepting connections and closes the listening socket. Requests in
+// flight are answered with Connection: close, HTTP/2 connections get a GOAWAY
+// and close once their open streams are answered, and idle keep-alive
+// connections are closed after a second or two, in case a request is already
+// on its way. http_server_listen returns once every connection has closed, or
+// after the given number of seconds, closing whatever is left.
+void http_server_drain(struct http_server_s* server, int seconds);
+
 // Use this listen call in place of the one above when you want to integrate
 // an http server into an existing application that has a loop already and you
 // want to use the polling functionality instead. This works well for
@@ -156,6 +265,153 @@ int http_server_listen_addr_poll(struct http_server_s* server, const char* ipadd
 // 0.
 int http_server_poll(struct http_server_s* server);
 
+// Connection and request counts.
+struct http_server_stats_s {
+  int64_t connections;    // connections open now
+  int64_t accepted;       // connections accepted
+  int64_t requests;       // requests handed to the request handler
+  int64_t memused;        // request and response buffer bytes in use
+};
+
+// Fills in stats with the server's connection and request counts.
+void http_server_stats(struct http_server_s* server, struct http_server_stats_s* stats);
+
+// Occupancy of the server's request/response buffer pool.
+struct http_pool_stats_s {
+  int64_t free_buffers;   // buffers sitting in the pool
+  int64_t free_bytes;     // bytes sitting in the pool
+  int64_t used_buffers;   // buffers currently handed out
+  int64_t used_bytes;     // bytes currently handed out
+  int64_t hits;           // requests served from the pool
+  int64_t misses;         // requests that had to malloc
+};
+
+// Fills in stats with the current buffer pool occupancy.
+void http_server_pool_stats(struct http_server_s* server, struct http_pool_stats_s* stats);
+
+// What the admission controller has measured and decided. Times are in
+// microseconds. See HTTP_ADMIT_TARGET_MS above for the policy.
+struct http_admission_stats_s {
+  int64_t lag;            // event loop lag at the last probe
+  int64_t lag_max;        // highest event loop lag seen
+  int64_t overloaded;     // 1 while load is being shed
+  int64_t overloads;      // times load shedding has started
+  int64_t uploads;        // requests with a body in flight
+  int64_t upload_bytes;   // declared body bytes of those
+  int64_t admitted;       // requests let through
+  int64_t shed_requests;  // requests without a body turned away for lag
+  int64_t shed_uploads;   // requests with a body turned away for lag
+  int64_t shed_capped;    // requests with a body turned away by the caps
+  int64_t shed_rate;      // requests turned away by the per client limits
+};
+
+// Fills in stats with the admission controller's counters.
+void http_server_admission_stats(struct http_server_s* server, struct http_admission_stats_s* stats);
+
+// Limits each client address to requests per second with bursts of up to
+// request_burst, and to bytes per second of declared request body with
+// bursts of up to byte_burst. A limit of 0 leaves that dimension unlimited.
+// Requests over the limit get a 429 with Retry-After before their body is
+// read. Bodies of unknown length, sent chunked, are only counted as a
+// request. Addresses given to http_server_trust aren't limited, clients whose
+// address isn't known are limited as one. See HTTP_RATE_TABLE_SIZE above.
+void http_server_rate_limit(
+  struct http_server_s* server,
+  int64_t requests,
+  int64_t request_burst,
+  int64_t bytes,
+  int64_t byte_burst
+);
+
+// Trusts an address, IPv4 or IPv6, or a range of them, "a.b.c.d/n": requests
+// from it aren't rate limited, and http_request_trusted is true for them so
+// the application can open up more to them as well. Nothing is trusted until
+// this is called, not even loopback, which behind a reverse proxy is every
+// client, and a client whose address isn't known never is. Up to
+// HTTP_TRUST_MAX ranges can be given. Returns -1 if cidr isn't an address or
+// range or there's no room left for it, 0 otherwise.
+int http_server_trust(struct http_server_s* server, char const * cidr);
+
+// Has request bodies of threshold bytes or more written to an unlinked
+// temporary file in dir as they arrive, rather than gathered in the read
+// buffer, so an upload takes HTTP_SPILL_BUF_SIZE of memory whatever its size.
+// The request handler gets the file from http_request_body_file. Only bodies
+// with a Content-Length that fit in HTTP_MAX_REQUEST_BUF_SIZE are spilled;
+// larger and chunked ones are streamed as before, and HTTP/2 request bodies
+// are always kept in memory. A threshold of 0, the default, turns it off.
+void http_server_spill_bodies(struct http_server_s* server, int64_t threshold, char const * dir);
+
+// Has every connection start with a PROXY protocol header, version 1 (text)
+// or 2 (binary), the way HAProxy, nginx and most load balancers can send
+// one. The client address in it replaces the proxy's own, for the rate
+// limiter and http_request_peer. Connections that don't start with a valid
+// header are closed. TCP over IPv4 or IPv6 gives the client's address;
+// UNKNOWN, or anything but TCP in version 2, leaves the client without one,
+// and LOCAL, the proxy's own health checks, keeps the connection's. Only
+// turn this on if nothing but the proxy can connect, anyone else could claim
+// to be anyone.
+void http_server_proxy_protocol(struct http_server_s* server, int on);
+
+// Where a request's time went. Times are microseconds on CLOCK_MONOTONIC, 0
+// for the points the request never reached. Spans are added by the
+// application with http_request_trace_span.
+#define HTTP_TRACE_SPANS 8
+
+struct http_trace_span_s {
+  char const * name;
+  int64_t start;
+  int64_t end;
+};
+
+struct http_trace_s {
+  int64_t start;          // the request's first bytes were read
+  int64_t headers;        // its header block was parsed
+  int64_t handler;        // its body was in and the handler was called
+  int64_t respond;        // the handler responded
+  int64_t written;        // the last byte of the response was written
+  int64_t bytes;          // response body bytes sent
+  int64_t received;       // request body length, 0 if it was streamed
+  int status;
+  int reset;              // the HTTP/2 error code the stream was reset with
+  int sampled;            // one of every sample_every requests
+  int span_count;
+  char method[16];
+  char target[64];        // truncated to fit
+  char peer[46];          // the client's address, as http_request_peer
+  struct http_trace_span_s spans[HTTP_TRACE_SPANS];
+};
+
+// Turns on request tracing. Once a request's response has been written cb is
+// called with its trace if it took longer than threshold microseconds from
+// start to written, or if it is one of every sample_every requests. Either can
+// be 0 to leave it out. The trace is only valid for the duration of the call.
+// For HTTP/2 written is when the last of the response was handed to the
+// connection, it may still be in its output buffer.
+void http_server_trace(
+  struct http_server_s* server,
+  int64_t threshold,
+  int sample_every,
+  void (*cb)(struct http_trace_s* trace)
+);
+
+// Has cb called with the trace of every request once the server is done with
+// it, whatever became of it: answered by the handler, turned away by the
+// server itself (400, 413, 429, 503, a spill that failed), or for HTTP/2
+// reset by the server, on its own or along with the connection. written is
+// 0 when the response never made it out in full. Requests the client gave up
+// on before they were answered aren't reported. Like http_server_trace's cb
+// it is called on the event loop and the trace is only valid for the call.
+void http_server_access_log(struct http_server_s* server, void (*cb)(struct http_trace_s* trace));
+
+// Adds a span to the request's trace if it is being traced. The name has to
+// outlive the request, a string literal is best. Times are as above.
+void http_request_trace_span(
+  struct http_request_s* request,
+  char const * name,
+  int64_t start,
+  int64_t end
+);
+
 // Returns 1 if the flag is set and false otherwise. The flags that can be
 // queried are listed below
 int http_request_has_flag(struct http_request_s* request, int flag);
@@ -163,7 +419,17 @@ int http_request_has_flag(struct http_request_s* request, int flag);
 // This flag will be set when the request body is chunked or the body is too
 // large to fit in memory are once. This means that the http_request_read_chunk
 // function must be used to read the body piece by piece.
-#define HTTP_FLG_STREAMED 0x1
+#define HTTP_FLG_STREAMED 0x10
+
+// Writes the address of the client that sent the request into buf as a null
+// terminated string, IPv4 or IPv6, or "unknown" if it has none: it came over
+// a unix socket, or through a proxy that didn't say. Returns its length, or
+// -1 if it doesn't fit in size; INET6_ADDRSTRLEN always does.
+int http_request_peer(struct http_request_s* request, char* buf, int size);
+
+// Returns 1 if the client that sent the request is in one of the ranges given
+// to http_server_trust, 0 otherwise.
+int http_request_trusted(struct http_request_s* request);
 
 // Returns the request method as it was read from the HTTP request line.
 struct http_string_s http_request_method(struct http_request_s* request);
@@ -172,14 +438,34 @@ struct http_string_s http_request_method(struct http_request_s* request);
 // line.
 struct http_string_s http_request_target(struct http_request_s* request);
 
-// Returns the request body. If no request body was sent buf and len of the
-// string will be set to 0.
+// Returns the request body. If no request body was sent, or it was written to
+// a file (see below), buf and len of the string will be set to 0.
 struct http_string_s http_request_body(struct http_request_s* request);
 
+// Returns the file the request body was written to by http_server_spill_bodies
+// and sets length to its size, or returns -1 if the body is in memory and
+// http_request_body has it. Read it with pread or mmap it, but don't close
+// it; it's closed after the response has been sent.
+int http_request_body_file(struct http_request_s* request, int64_t* length);
+
 // Returns the request header value for the given header key. The key is case
 // insensitive.
 struct http_string_s http_request_header(struct http_request_s* request, char const * key);
 
+// Well known request headers. Their values are captured while the request is
+// indexed so they can be fetched without hashing or comparing the name.
+#define HTTP_HDR_HOST 0
+#define HTTP_HDR_CONTENT_LENGTH 1
+#define HTTP_HDR_ACCEPT_ENCODING 2
+#define HTTP_HDR_IF_NONE_MATCH 3
+#define HTTP_HDR_RANGE 4
+#define HTTP_HDR_CONNECTION 5
+#define HTTP_HDR_KNOWN_COUNT 6
+
+// Returns the value of one of the HTTP_HDR_* headers. Equivalent to calling
+// http_request_header with the header's name.
+struct http_string_s http_request_known_header(struct http_request_s* request, int header);
+
 // Procedure used to iterate over all the request headers. iter should be
 // initialized to zero before calling. Each call will set key and val to the
 // key and value of the next header. Returns 0 when there are no more headers.
@@ -190,6 +476,15 @@ int http_request_iterate_headers(
   int* iter
 );
 
+// Allocates memory from the request's arena. The memory does not need to be
+// freed; it stays valid until the next request on the connection begins or
+// the connection is closed, so it is safe to use after http_respond.
+void* http_request_alloc(struct http_request_s* request, int size);
+
+// Copies the string into the request's arena and null terminates it. Same
+// lifetime as http_request_alloc.
+char* http_request_strdup(struct http_request_s* request, struct http_string_s str);
+
 // Retrieve the opaque data pointer that was set with http_request_set_userdata.
 void* http_request_userdata(struct http_request_s* request);
 
@@ -237,8 +532,44 @@ void http_response_header(struct http_response_s* response, char const * key, ch
 // http_respond has been called.
 void http_response_body(struct http_response_s* response, char const * body, int length);
 
+// Set the response body and hand ownership of it to the server. The body is
+// never copied; release is called with the body pointer once the last byte has
+// been written or the connection has closed. Pass NULL for release if the
+// memory outlives the server, i.e: static buffers.
+void http_response_body_owned(
+  struct http_response_s* response,
+  char const * body,
+  int length,
+  void (*release)(void*)
+);
+
+// Sets the Content-Length of a response without setting a body, for answering
+// a HEAD request without having the body at hand. A response to a HEAD request
+// never carries a body in any case: if one was set it is dropped, and released
+// if it was owned, and only its length is sent.
+void http_response_length(struct http_response_s* response, int length);
+
+// Response templates hold a status line and a set of headers serialized once
+// up front, for responses that go out the same way over and over, i.e: error
+// pages or static files. Only the Date, Connection and Content-Length headers
+// and whatever headers are set on the response itself are written per
+// response. Templates are meant to be made at startup and kept around.
+struct http_template_s* http_template_init(int status);
+
+// Adds a fixed header to the template. Both strings are copied.
+void http_template_header(struct http_template_s* tmpl, char const * key, char const * value);
+
+// Starts the response off from the template, taking its status and headers.
+// The template only has to outlive the call to http_respond.
+void http_response_template(struct http_response_s* response, struct http_template_s* tmpl);
+
+void http_template_free(struct http_template_s* tmpl);
+
 // Starts writing the response to the client. Any memory allocated for the
-// response body or response headers is safe to free after this call.
+// response body or response headers is safe to free after this call. The
+// headers and body are written with a single writev; a body that was not
+// handed over with http_response_body_owned is only copied if the socket
+// won't take all of it right away.
 void http_respond(struct http_request_s* request, struct http_response_s* response);
 
 // Writes a chunk to the client. The notify_done callback will be called when
@@ -330,29 +661,65 @@ int main() {
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
+#include <stddef.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#if defined(__SSE2__) && !defined(HTTP_NO_SIMD)
+#include <immintrin.h>
+#endif
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #ifdef KQUEUE
 #include <sys/event.h>
 #else
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #endif
 
 // *** macro definitions
 
 // Application configurable
-#define HTTP_REQUEST_BUF_SIZE (1024 * 1024)
+#define HTTP_REQUEST_BUF_SIZE 4096
 #define HTTP_RESPONSE_BUF_SIZE 1024
+#define HTTP_PIPELINE_MAX 16
+#define HTTP_H2_MAX_STREAMS 100
+#define HTTP_H2_CONN_BUFFER (32 * 1024 * 1024) // 32mb
 #define HTTP_REQUEST_TIMEOUT 20
 #define HTTP_KEEP_ALIVE_TIMEOUT 120
 #define HTTP_MAX_TOKEN_LENGTH 8192 // 8kb
 #define HTTP_MAX_TOTAL_EST_MEM_USAGE 4294967296 // 4gb
+#define HTTP_ADMIT_TARGET_MS 20
+#define HTTP_ADMIT_INTERVAL_MS 100
+#define HTTP_ADMIT_MAX_UPLOADS 64
+#define HTTP_ADMIT_MAX_UPLOAD_BYTES (256 * 1024 * 1024) // 256MB
+#define HTTP_RATE_TABLE_SIZE 16384
+#define HTTP_RATE_SUBNET_FACTOR 8
+#define HTTP_TRUST_MAX 8
 #define HTTP_MAX_REQUEST_BUF_SIZE (16 * 1024 * 1024) // 16MB - Brian, updated for doom wads
+#define HTTP_SPILL_BUF_SIZE (64 * 1024) // 64kb
 
 #define HTTP_MAX_HEADER_COUNT 127
+#define HTTP_HEADER_INDEX_MIN 16
+
+#define HTTP_ARENA_BLOCK_SIZE 4096
+#define HTTP_RESPONSE_INLINE_HEADERS 16
+#define HTTP_RESPONSE_FREE_MAX 64
+
+#define HTTP_POOL_CLASS_MAX 64
+#define HTTP_POOL_MAX_CLASS_BYTES (32 * 1024 * 1024)
+#define HS_POOL_MIN_SHIFT 12 // 4KB
+#define HS_POOL_CLASSES 7    // 4KB, 16KB, 64KB, 256KB, 1MB, 4MB, 16MB
+
+#if defined(__cplusplus)
+#define HS_THREAD_LOCAL thread_local
+#else
+#define HS_THREAD_LOCAL _Thread_local
+#endif
 
 #define HTTP_FLAG_SET(var, flag) var |= flag
 #define HTTP_FLAG_CLEAR(var, flag) var &= ~flag
@@ -373,11 +740,102 @@ int main() {
 #define HTTP_SESSION_READ 1
 #define HTTP_SESSION_WRITE 2
 #define HTTP_SESSION_NOP 3
+#define HTTP_SESSION_H2 4
+#define HTTP_SESSION_PROXY 5
 
 // http session flags
 #define HTTP_END_SESSION 0x2
+#define HTTP_WRITE_ARMED 0x4
 #define HTTP_AUTOMATIC 0x8
 #define HTTP_CHUNKED_RESPONSE 0x20
+#define HTTP_RESPONDED 0x40
+#define HTTP_IN_READ 0x80
+#define HTTP_ADMITTED 0x100
+#define HTTP_UPLOAD 0x200
+#define HTTP_SPILLED 0x400
+
+// admission control
+#define HS_ADMIT_PROBE_US 5000
+
+// rate limiting, tokens are kept in millionths
+#define HS_RATE_UNIT 1000000
+#define HS_RATE_ADDR 1
+#define HS_RATE_SUBNET 2
+#define HS_RATE_UNKNOWN 3
+#define HS_RATE_SUBNET6 4
+
+// draining, the ticks an idle keep-alive connection is given
+#define HS_DRAIN_IDLE 2
+
+// connections accepted per event on the listening socket
+#define HS_ACCEPT_BATCH 64
+
+// PROXY protocol
+#define HS_PROXY_V1_MAX 107 // the longest v1 header, "PROXY TCP6 ...\r\n"
+#define HS_PROXY_V2_SIG "\r\n\r\n\0\r\nQUIT\n"
+#define HS_PROXY_V2_SIG_LEN 12
+#define HS_PROXY_V2_HEADER 16
+
+// http/2
+#define HS_H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HS_H2_PREFACE_LEN 24
+#define HS_H2_FRAME_HEADER 9
+#define HS_H2_DEFAULT_WINDOW 65535
+#define HS_H2_DEFAULT_FRAME 16384
+#define HS_H2_MAX_WINDOW 0x7fffffff
+#define HS_H2_MAX_HEADER_BLOCK (64 * 1024)
+#define HS_H2_OUT_HIGH (256 * 1024)
+#define HS_HPACK_TABLE_SIZE 4096
+#define HS_HPACK_MAX_ENTRIES (HS_HPACK_TABLE_SIZE / 32)
+
+// http/2 frame types
+#define HS_H2_DATA 0x0
+#define HS_H2_HEADERS 0x1
+#define HS_H2_PRIORITY 0x2
+#define HS_H2_RST_STREAM 0x3
+#define HS_H2_SETTINGS 0x4
+#define HS_H2_PUSH_PROMISE 0x5
+#define HS_H2_PING 0x6
+#define HS_H2_GOAWAY 0x7
+#define HS_H2_WINDOW_UPDATE 0x8
+#define HS_H2_CONTINUATION 0x9
+
+// http/2 frame flags
+#define HS_H2_END_STREAM 0x1
+#define HS_H2_ACK 0x1
+#define HS_H2_END_HEADERS 0x4
+#define HS_H2_PADDED 0x8
+#define HS_H2_PRIORITY_FLAG 0x20
+
+// http/2 error codes
+#define HS_H2_PROTOCOL_ERROR 0x1
+#define HS_H2_FLOW_CONTROL_ERROR 0x3
+#define HS_H2_STREAM_CLOSED 0x5
+#define HS_H2_FRAME_SIZE_ERROR 0x6
+#define HS_H2_REFUSED_STREAM 0x7
+#define HS_H2_COMPRESSION_ERROR 0x9
+#define HS_H2_ENHANCE_YOUR_CALM 0xb
+
+// http/2 settings
+#define HS_H2_SETTINGS_ENABLE_PUSH 0x2
+#define HS_H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define HS_H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define HS_H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// http/2 stream flags
+#define HS_H2_DISPATCHED 0x1
+#define HS_H2_ANSWERED 0x2
+#define HS_H2_RESET 0x4
+#define HS_H2_END_SENT 0x8
+#define HS_H2_CHUNK_WAIT 0x10
+#define HS_H2_MALFORMED 0x20
+#define HS_H2_HAS_METHOD 0x40
+#define HS_H2_HAS_PATH 0x80
+#define HS_H2_DONE 0x100
+
+// http/2 connection shutdown
+#define HS_H2_DRAIN 1 // close once the open streams are answered
+#define HS_H2_ABORT 2 // close once the output is flushed
 
 // http version indicators
 #define HTTP_1_0 0
@@ -393,10 +851,24 @@ typedef struct {
   int type;
 } http_token_t;
 
+// Bump allocator for per request allocations. Blocks are chained newest
+// first; resetting keeps the oldest block around for the next request.
+typedef struct hs_arena_block_s {
+  struct hs_arena_block_s* next;
+  int64_t capacity;
+  int64_t used;
+  char data[];
+} hs_arena_block_t;
+
+typedef struct {
+  hs_arena_block_t* head;
+} hs_arena_t;
+
 typedef struct {
   http_token_t* buf;
   int capacity;
   int size;
+  hs_arena_t* arena;
 } http_token_dyn_t;
 
 #ifdef EPOLL
@@ -411,6 +883,20 @@ typedef struct http_ev_cb_s {
 #endif
 } ev_cb_t;
 
+// Free buffers are chained through their first bytes.
+typedef struct hs_pool_buf_s {
+  struct hs_pool_buf_s* next;
+} hs_pool_buf_t;
+
+typedef struct {
+  hs_pool_buf_t* free[HS_POOL_CLASSES];
+  int32_t free_count[HS_POOL_CLASSES];
+  int64_t used_buffers;
+  int64_t used_bytes;
+  int64_t hits;
+  int64_t misses;
+} hs_pool_t;
+
 typedef struct {
   char* buf;
   int64_t total_bytes;
@@ -431,38 +917,253 @@ typedef struct {
   int8_t meta;
 } http_parser_t;
 
+// Intrusive node for the server's timing wheel. Lives inside the request so
+// arming, re-arming and cancelling a timeout never allocates.
+typedef struct hs_timer_s {
+  struct hs_timer_s* next;
+  struct hs_timer_s* prev;
+  int64_t expires;
+} hs_timer_t;
+
+#define HS_WHEEL_BITS 6
+#define HS_WHEEL_SLOTS (1 << HS_WHEEL_BITS)
+#define HS_WHEEL_MASK (HS_WHEEL_SLOTS - 1)
+#define HS_WHEEL_LEVELS 2
+#define HS_WHEEL_MAX_TICKS (HS_WHEEL_SLOTS * (HS_WHEEL_SLOTS - 1))
+
+// Two level hierarchical timing wheel with one second ticks. Level 0 holds
+// timers due in the next 64 seconds, level 1 everything up to ~67 minutes out
+// and is cascaded down into level 0 each time level 0 wraps. The slot heads
+// are sentinels of circular doubly linked lists.
+typedef struct {
+  hs_timer_t slots[HS_WHEEL_LEVELS][HS_WHEEL_SLOTS];
+  int64_t now;
+} hs_wheel_t;
+
+// The client's address, in network byte order, the first 4 bytes for IPv4.
+// The family is AF_UNSPEC, all zeros, when it isn't known.
+typedef struct {
+  int family;
+  uint8_t addr[16];
+} hs_peer_t;
+
+// A request's trace, on the free list once the request is done with it.
+typedef struct hs_trace_s {
+  struct http_trace_s trace;
+  struct hs_trace_s* next;
+} hs_trace_t;
+
+// A response waiting to be written: the status line and headers in a pool
+// buffer followed by the body, which lives wherever the application put it.
+typedef struct {
+  char* head;
+  int32_t head_length;
+  int32_t head_capacity;
+  char const * body;
+  int64_t body_length;
+  int64_t body_charged;
+  void (*body_release)(void*);
+  hs_trace_t* trace;
+} hs_out_t;
+
+typedef struct {
+  uint32_t hash;
+  int32_t token;
+} hs_header_slot_t;
+
+// Built once the header block has been parsed. The request line tokens and
+// the well known headers are recorded directly. Requests with more than
+// HTTP_HEADER_INDEX_MIN headers also get an open addressing table, allocated
+// from the request arena on the first lookup by name, keyed by a case folded
+// hash of the name; the slot stores the index of the key token and the value
+// is always the token after it. The first occurrence of a header wins, which
+// matches the linear scan used otherwise.
+typedef struct {
+  hs_header_slot_t* slots;
+  int32_t mask;
+  int32_t headers;
+  int32_t known[HTTP_HDR_KNOWN_COUNT];
+  int32_t method;
+  int32_t target;
+  int32_t version;
+  int32_t body;
+  int8_t built;
+} hs_header_index_t;
+
+// HPACK dynamic table entry, the name and value share one allocation.
+typedef struct {
+  char* data;
+  int32_t name_len;
+  int32_t value_len;
+} hs_hpack_entry_t;
+
+// Ring of dynamic table entries, newest at head. The table size we advertise
+// bounds how many entries fit so the ring never has to grow.
+typedef struct {
+  hs_hpack_entry_t entries[HS_HPACK_MAX_ENTRIES];
+  int32_t head;
+  int32_t count;
+  int32_t size;
+  int32_t max_size;
+} hs_hpack_table_t;
+
+// Connection level HTTP/2 state. Each stream is a request of its own, linked
+// off the connection, so the handler and the http_request_* accessors work on
+// it unchanged. Frames for the client are serialized into out and written
+// from there.
+typedef struct hs_h2_s {
+  hs_hpack_table_t decoder;
+  struct http_request_s* streams;
+  struct http_request_s* spare;
+  char* out;
+  int64_t out_length;
+  int64_t out_written;
+  int64_t out_capacity;
+  char* block;
+  int32_t block_length;
+  int32_t block_capacity;
+  int32_t block_stream;
+  int32_t block_flags;
+  int64_t send_window;
+  int64_t recv_window;    // credit the client has left to send DATA with
+  int32_t peer_window;
+  int32_t peer_frame;
+  int32_t last_stream;
+  int32_t active;
+  int32_t spare_count;
+  int32_t need;
+  int8_t preface;
+  int8_t scheduling;
+  int8_t closing;
+} hs_h2_t;
+
 typedef struct http_request_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent* ev);
 #else
   epoll_cb_t handler;
-  epoll_cb_t timer_handler;
-  int timerfd;
 #endif
   void (*chunk_cb)(struct http_request_s*);
   void* data;
   hs_stream_t stream;
   http_parser_t parser;
+  hs_timer_t timer;
   int state;
   int socket;
-  int timeout;
   struct http_server_s* server;
+  hs_arena_t arena;
   http_token_dyn_t tokens;
-  char flags;
+  hs_header_index_t index;
+  hs_out_t out[HTTP_PIPELINE_MAX];
+  int64_t out_written;
+  int out_count;
+  int flags;
+  hs_h2_t* h2;
+  struct http_request_s* h2_conn;
+  struct http_request_s* h2_next;
+  int64_t h2_window;
+  int64_t h2_held;        // DATA bytes buffered, owed back to the connection
+  int32_t h2_id;
+  int32_t h2_flags;
+  int64_t admit_bytes;
+  hs_peer_t peer;
+  hs_trace_t* trace;
+  int spill_fd;           // the body's file while HTTP_SPILLED is set
+  int64_t spill_size;     // its length
+  int64_t spill_left;     // body bytes still to come off the socket
 } http_request_t;
 
+// Admission control state. A probe is outstanding while probe_sent is set.
+typedef struct {
+  int64_t probe_sent;
+  int64_t sampled_at;
+  int64_t above_since;
+  int64_t lag;
+  int64_t lag_max;
+  int64_t overloaded;
+  int64_t overloads;
+  int64_t uploads;
+  int64_t upload_bytes;
+  int64_t admitted;
+  int64_t shed_requests;
+  int64_t shed_uploads;
+  int64_t shed_capped;
+  int64_t shed_rate;
+} hs_admit_t;
+
+// A client address or /24 subnet's buckets. Entries sit on a hash chain and
+// on the LRU list, both linked by index, -1 ends either.
+typedef struct {
+  uint64_t key;
+  int64_t requests;
+  int64_t bytes;
+  int64_t updated;
+  int32_t next;
+  int32_t newer;
+  int32_t older;
+} hs_rate_entry_t;
+
+// An address range given to http_server_trust, network byte order.
+typedef struct {
+  int family;
+  int bits;
+  uint8_t addr[16];
+} hs_trust_t;
+
+// Per client token buckets. Rates are per second, bursts in whole requests
+// and bytes, 0 means no limit. entries is NULL until a limit is set.
+typedef struct {
+  hs_rate_entry_t* entries;
+  int32_t* chains;
+  int32_t count;
+  int32_t newest;
+  int32_t oldest;
+  int64_t requests;
+  int64_t request_burst;
+  int64_t bytes;
+  int64_t byte_burst;
+} hs_rate_t;
+
+// Request tracing, off while cb and access are NULL. Finished traces are
+// kept on a free list for the next requests.
+typedef struct {
+  void (*cb)(struct http_trace_s*);
+  void (*access)(struct http_trace_s*);
+  int64_t threshold;
+  int64_t sample_every;
+  int64_t count;
+  hs_trace_t* free;
+  int free_count;
+} hs_tracer_t;
+
 typedef struct http_server_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent* ev);
 #else
   epoll_cb_t handler;
   epoll_cb_t timer_handler;
+  epoll_cb_t probe_handler;
 #endif
   int64_t memused;
+  int64_t connections;
+  int64_t accepted;
+  int64_t requests;
+  hs_pool_t pool;
+  hs_wheel_t wheel;
+  hs_admit_t admit;
+  hs_rate_t rate;
+  hs_trust_t trust[HTTP_TRUST_MAX];
+  int trust_count;
+  hs_tracer_t tracer;
   int socket;
   int port;
   int loop;
+  int64_t drain_until;    // wheel tick to give up draining at, 0 until draining
+  int proxy;              // connections start with a PROXY protocol header
+  int64_t spill_threshold; // bodies this big go to a file, 0 for never
+  char const * spill_dir;
   int timerfd;
+  int probefd;
   socklen_t len;
   void (*request_handler)(http_request_t*);
   struct sockaddr_in addr;
@@ -476,11 +1177,30 @@ typedef struct http_header_s {
   struct http_header_s* next;
 } http_header_t;
 
+// The serialized block runs from the status line up to the Date value, then
+// picks up again with the line break after it and the fixed headers. The
+// headers are also kept as a list for HTTP/2, which has to encode them.
+typedef struct http_template_s {
+  char* block;
+  int length;
+  int capacity;
+  int date_at;
+  int status;
+  http_header_t* headers;
+  http_header_t** tail;
+} http_template_t;
+
 typedef struct http_response_s {
+  http_header_t inline_headers[HTTP_RESPONSE_INLINE_HEADERS];
+  int header_count;
+  struct http_response_s* next_free;
+  http_template_t* tmpl;
   http_header_t* headers;
   char const * body;
+  void (*release)(void*);
   int content_length;
   int status;
+  int owned;
 } http_response_t;
 
 typedef struct http_string_s http_string_t;
@@ -523,11 +1243,33 @@ enum hs_meta_type {
 // prototypes
 
 void hs_add_server_sock_events(struct http_server_s* serv);
+void hs_delete_server_sock_events(struct http_server_s* serv);
 void hs_server_init(struct http_server_s* serv);
 void hs_delete_events(struct http_request_s* request);
 void hs_add_events(struct http_request_s* request);
 void hs_add_write_event(struct http_request_s* request);
+void hs_add_read_event(struct http_request_s* request);
 void hs_process_tokens(http_request_t* request);
+void hs_generate_date_time(char* datetime);
+void hs_wheel_remove(hs_timer_t* timer);
+void hs_build_header_index(http_request_t* request);
+void hs_build_header_table(http_request_t* request);
+int hs_h2_preface(http_request_t* request);
+int hs_h2_wants_upgrade(http_request_t* request);
+void hs_h2_start(http_request_t* request);
+void hs_h2_upgrade(http_request_t* request);
+void hs_h2_read(http_request_t* conn);
+void hs_h2_io(http_request_t* conn);
+void hs_h2_free(http_request_t* conn);
+void hs_h2_drain(http_request_t* conn);
+void hs_admit_release(http_request_t* request);
+void hs_spill_close(http_request_t* request);
+void hs_trace_end(http_server_t* server, hs_trace_t* trace, int written);
+void hs_trace_reset(http_request_t* request, uint32_t code);
+void hs_admit_post_probe(struct http_server_s* server);
+void hs_h2_respond(http_request_t* stream, http_response_t* response);
+void hs_h2_respond_chunk(http_request_t* stream, http_response_t* response, void (*cb)(http_request_t*));
+void hs_h2_respond_chunk_end(http_request_t* stream, http_response_t* response);
 
 #ifdef KQUEUE
 
@@ -539,7 +1281,7 @@ void hs_session_io_cb(struct kevent* ev);
 void hs_server_listen_cb(struct epoll_event* ev);
 void hs_session_io_cb(struct epoll_event* ev);
 void hs_server_timer_cb(struct epoll_event* ev);
-void hs_request_timer_cb(struct epoll_event* ev);
+void hs_server_probe_cb(struct epoll_event* ev);
 
 #endif
 
@@ -604,7 +1346,7 @@ char const * hs_status_text[] = {
 
   "Gone", "Length Required", "", "Payload Too Large", "", "", "", "", "", "",
 
-  "", "", "", "", "", "", "", "", "", "",
+  "", "", "", "", "", "", "", "", "", "Too Many Requests",
   "", "", "", "", "", "", "", "", "", "",
   "", "", "", "", "", "", "", "", "", "",
   "", "", "", "", "", "", "", "", "", "",
@@ -718,22 +1460,98 @@ static int const hs_token_start_states[] = {
   0, HS_TOK_METHOD, 0, HS_TOK_TARGET, 0, HS_TOK_VERSION, 0, 0, HS_TOK_HEADER_KEY,
 //HS HV                 HR HE ER HN BD           CS CB                 CE CR CN
   0, HS_TOK_HEADER_VAL, 0, 0, 0, 0, HS_TOK_BODY, 0, HS_TOK_CHUNK_BODY, 0, 0, 0,
-//CD C1 C2
-  0, 0, 0,
+//CD C1 C2 BR
+  0, 0, 0, 0,
 };
 
+// *** buffer pool ***
+
+int hs_pool_class(int64_t size) {
+  for (int i = 0; i < HS_POOL_CLASSES; i++) {
+    if (size <= (int64_t)1 << (HS_POOL_MIN_SHIFT + 2 * i)) return i;
+  }
+  return -1;
+}
+
+int32_t hs_pool_class_size(int cls) {
+  return (int32_t)1 << (HS_POOL_MIN_SHIFT + 2 * cls);
+}
+
+// Hands out a buffer of at least size bytes, rounded up to its size class.
+// The memory is not zeroed. Sizes beyond the largest class are malloc'd
+// exactly and will be freed rather than pooled when returned.
+char* hs_pool_get(hs_pool_t* pool, int64_t size, int32_t* capacity) {
+  char* buf;
+  int cls = hs_pool_class(size);
+  if (cls >= 0 && pool->free[cls]) {
+    hs_pool_buf_t* node = pool->free[cls];
+    pool->free[cls] = node->next;
+    pool->free_count[cls]--;
+    pool->hits++;
+    buf = (char*)node;
+    *capacity = hs_pool_class_size(cls);
+  } else {
+    *capacity = cls >= 0 ? hs_pool_class_size(cls) : size;
+    buf = (char*)malloc(*capacity);
+    assert(buf != NULL);
+    pool->misses++;
+  }
+  pool->used_buffers++;
+  pool->used_bytes += *capacity;
+  return buf;
+}
+
+void hs_pool_put(hs_pool_t* pool, char* buf, int32_t capacity) {
+  pool->used_buffers--;
+  pool->used_bytes -= capacity;
+  int cls = hs_pool_class(capacity);
+  if (
+    cls < 0 ||
+    hs_pool_class_size(cls) != capacity ||
+    pool->free_count[cls] >= HTTP_POOL_CLASS_MAX ||
+    (int64_t)(pool->free_count[cls] + 1) * capacity > HTTP_POOL_MAX_CLASS_BYTES
+  ) {
+    free(buf);
+    return;
+  }
+  hs_pool_buf_t* node = (hs_pool_buf_t*)buf;
+  node->next = pool->free[cls];
+  pool->free[cls] = node;
+  pool->free_count[cls]++;
+}
+
 // *** input stream ***
 
-int hs_stream_read_socket(hs_stream_t* stream, int socket, int64_t* memused) {
-  if (stream->index < stream->length) return 1;
+#define HS_READ_EOF 0
+#define HS_READ_AGAIN 1
+#define HS_READ_FULL 2
+#define HS_READ_PENDING 3
+#define HS_READ_ERR 4
+
+// What a read that came back with bytes <= 0 means: the client closed its
+// end, there's nothing more for now, or the connection failed.
+int hs_read_end(int bytes) {
+  if (bytes == 0) return HS_READ_EOF;
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return HS_READ_AGAIN;
+  return HS_READ_ERR;
+}
+
+// Reads until the socket would block, returning HS_READ_AGAIN, or the buffer
+// is full, returning HS_READ_FULL. Growing the buffer is left to the caller,
+// who knows how big the request says it is. If there is still unparsed data
+// in the buffer, from a pipelined request, nothing is read and
+// HS_READ_PENDING is returned so the caller comes back once it's parsed.
+// HS_READ_EOF and HS_READ_ERR are the client closing and the connection
+// failing.
+int hs_stream_read_socket(hs_stream_t* stream, int socket, hs_pool_t* pool, int64_t* memused) {
+  if (stream->index < stream->length) return HS_READ_PENDING;
   if (!stream->buf) {
-    *memused += HTTP_REQUEST_BUF_SIZE;
-    stream->buf = (char*)calloc(1, HTTP_REQUEST_BUF_SIZE);
-    assert(stream->buf != NULL);
-    stream->capacity = HTTP_REQUEST_BUF_SIZE;
+    stream->buf = hs_pool_get(pool, HTTP_REQUEST_BUF_SIZE, &stream->capacity);
+    *memused += stream->capacity;
   }
   int bytes;
   do {
+    if (stream->length == stream->capacity) return HS_READ_FULL;
     bytes = read(
       socket,
       stream->buf + stream->length,
@@ -743,21 +1561,32 @@ int hs_stream_read_socket(hs_stream_t* stream, int socket, int64_t* memused) {
       stream->length += bytes;
       stream->total_bytes += bytes;
     }
-    if (
-      stream->length == stream->capacity &&
-      stream->capacity != HTTP_MAX_REQUEST_BUF_SIZE
-    ) {
-      *memused -= stream->capacity;
-      stream->capacity *= 2;
-      if (stream->capacity > HTTP_MAX_REQUEST_BUF_SIZE) {
-        stream->capacity = HTTP_MAX_REQUEST_BUF_SIZE;
-      }
-      *memused += stream->capacity;
-      stream->buf = (char*)realloc(stream->buf, stream->capacity);
-      assert(stream->buf != NULL);
-    }
-  } while (bytes > 0 && stream->capacity < HTTP_MAX_REQUEST_BUF_SIZE);
-  return bytes == 0 ? 0 : 1;
+  } while (bytes > 0);
+  return hs_read_end(bytes);
+}
+
+// Moves the buffer's contents into one from the pool of at least size bytes.
+void hs_stream_resize(hs_stream_t* stream, int64_t size, hs_pool_t* pool, int64_t* memused) {
+  int32_t capacity;
+  char* buf = hs_pool_get(pool, size, &capacity);
+  memcpy(buf, stream->buf, stream->length);
+  hs_pool_put(pool, stream->buf, stream->capacity);
+  *memused += capacity - stream->capacity;
+  stream->buf = buf;
+  stream->capacity = capacity;
+}
+
+// Makes sure there is room for at least one more byte, growing the buffer to
+// hold need bytes if we know how many that is, or to the next size class if
+// we don't. Returns 0 if the buffer is already as large as it's allowed to be.
+int hs_stream_make_room(hs_stream_t* stream, int64_t need, hs_pool_t* pool, int64_t* memused) {
+  if (stream->length < stream->capacity) return 1;
+  if (stream->capacity >= HTTP_MAX_REQUEST_BUF_SIZE) return 0;
+  int64_t size = (int64_t)stream->capacity * 4;
+  if (need > stream->capacity) size = need;
+  if (size > HTTP_MAX_REQUEST_BUF_SIZE) size = HTTP_MAX_REQUEST_BUF_SIZE;
+  hs_stream_resize(stream, size, pool, memused);
+  return 1;
 }
 
 int hs_stream_next(hs_stream_t* stream, char* c) {
@@ -966,11 +1795,73 @@ http_token_t hs_meta_emit(http_parser_t* parser) {
   return token;
 }
 
+// Length of the run of bytes at the start of buf that lie in [lo, 0x7e],
+// also counting tabs when tab is set. Bytes >= 0x80 are negative as signed
+// chars so the single signed range test rejects them along with controls.
+int hs_scan_run(char const * buf, int len, char lo, int tab) {
+  int i = 0;
+#if defined(__AVX2__) && !defined(HTTP_NO_SIMD)
+  __m256i lo32 = _mm256_set1_epi8(lo - 1);
+  __m256i hi32 = _mm256_set1_epi8(0x7f);
+  __m256i tab32 = _mm256_set1_epi8(tab ? '\t' : lo);
+  for ( ; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i const *)(buf + i));
+    __m256i ok = _mm256_and_si256(
+      _mm256_cmpgt_epi8(v, lo32), _mm256_cmpgt_epi8(hi32, v)
+    );
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, tab32));
+    uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(ok);
+    if (stop) return i + __builtin_ctz(stop);
+  }
+#endif
+#if defined(__SSE2__) && !defined(HTTP_NO_SIMD)
+  __m128i lo16 = _mm_set1_epi8(lo - 1);
+  __m128i hi16 = _mm_set1_epi8(0x7f);
+  __m128i tab16 = _mm_set1_epi8(tab ? '\t' : lo);
+  for ( ; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i const *)(buf + i));
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo16), _mm_cmplt_epi8(v, hi16));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, tab16));
+    uint32_t stop = ~(uint32_t)_mm_movemask_epi8(ok) & 0xffff;
+    if (stop) return i + __builtin_ctz(stop);
+  }
+#endif
+  for ( ; i < len; i++) {
+    char c = buf[i];
+    if ((c < lo || c > 0x7e) && !(tab && c == '\t')) break;
+  }
+  return i;
+}
+
+// Inside a request target or a header value every printable byte (plus
+// space and tab for values) just extends the token, so rather than walking
+// them through the state machine one at a time we skip straight to the next
+// delimiter and let the state machine take it from there. Header values are
+// left alone while the meta machine is reading them, i.e. Content-Length
+// digits and the Transfer-Encoding match.
+int hs_parse_fast_path(http_parser_t* parser, hs_stream_t* stream) {
+  int n;
+  char const * buf = stream->buf + stream->index;
+  int len = stream->length - stream->index;
+  if (parser->state == TR) {
+    n = hs_scan_run(buf, len, '!', 0);
+  } else if (
+    parser->state == HV && parser->meta != M_MCK && parser->meta != M_CLV
+  ) {
+    n = hs_scan_run(buf, len, ' ', 1);
+  } else {
+    return 0;
+  }
+  if (n > 0) hs_stream_jump(stream, n);
+  return n;
+}
+
 http_token_t http_parse(http_parser_t* parser, hs_stream_t* stream) {
   char c = 0;
   http_token_t token = hs_meta_emit(parser);
   if (token.type != HS_TOK_NONE) return token;
   while (hs_stream_next(stream, &c)) {
+    if (hs_parse_fast_path(parser, stream)) continue;
     int type = c < 0 ? HS_ETC : hs_ctype[(int)c];
     int to = hs_transitions[parser->state * HS_CHAR_TYPE_LEN + type];
     if (parser->meta == M_ZER && parser->state == HN && to == BD) {
@@ -997,19 +1888,67 @@ http_token_t http_parse(http_parser_t* parser, hs_stream_t* stream) {
 
 // *** http server ***
 
+// *** request arena ***
+
+void* hs_arena_alloc(hs_arena_t* arena, int64_t size) {
+  size = (size + 15) & ~(int64_t)15;
+  hs_arena_block_t* block = arena->head;
+  if (block == NULL || block->used + size > block->capacity) {
+    int64_t capacity = HTTP_ARENA_BLOCK_SIZE - (int64_t)sizeof(hs_arena_block_t);
+    if (size > capacity) capacity = size;
+    block = (hs_arena_block_t*)malloc(sizeof(hs_arena_block_t) + capacity);
+    assert(block != NULL);
+    block->capacity = capacity;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+  }
+  void* ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+// Frees every block but the first one allocated, which is kept (empty) if it
+// is the default size.
+void hs_arena_reset(hs_arena_t* arena) {
+  hs_arena_block_t* block = arena->head;
+  while (block && block->next) {
+    hs_arena_block_t* next = block->next;
+    free(block);
+    block = next;
+  }
+  if (block && block->capacity + (int64_t)sizeof(hs_arena_block_t) != HTTP_ARENA_BLOCK_SIZE) {
+    free(block);
+    block = NULL;
+  }
+  if (block) block->used = 0;
+  arena->head = block;
+}
+
+void hs_arena_free(hs_arena_t* arena) {
+  hs_arena_reset(arena);
+  free(arena->head);
+  arena->head = NULL;
+}
+
+// The token list lives in the arena. Growing it copies into a fresh chunk and
+// abandons the old one until the arena is reset.
 void http_token_dyn_push(http_token_dyn_t* dyn, http_token_t a) {
   if (dyn->size == dyn->capacity) {
+    http_token_t* buf = (http_token_t*)hs_arena_alloc(
+      dyn->arena, (int64_t)dyn->capacity * 2 * sizeof(http_token_t)
+    );
+    memcpy(buf, dyn->buf, dyn->size * sizeof(http_token_t));
+    dyn->buf = buf;
     dyn->capacity *= 2;
-    dyn->buf = (http_token_t*)realloc(dyn->buf, dyn->capacity * sizeof(http_token_t));
-    assert(dyn->buf != NULL);
   }
   dyn->buf[dyn->size] = a;
   dyn->size++;
 }
 
-void http_token_dyn_init(http_token_dyn_t* dyn, int capacity) {
-  dyn->buf = (http_token_t*)malloc(sizeof(http_token_t) * capacity);
-  assert(dyn->buf != NULL);
+void http_token_dyn_init(http_token_dyn_t* dyn, hs_arena_t* arena, int capacity) {
+  dyn->arena = arena;
+  dyn->buf = (http_token_t*)hs_arena_alloc(arena, sizeof(http_token_t) * capacity);
   dyn->size = 0;
   dyn->capacity = capacity;
 }
@@ -1028,46 +1967,295 @@ void hs_bind_localhost(int s, struct sockaddr_in* addr, const char* ipaddr, int
   }
 }
 
+int64_t hs_out_length(hs_out_t* out) {
+  return out->head_length + out->body_length;
+}
+
+void hs_out_release(http_request_t* session, hs_out_t* out) {
+  if (out->head) {
+    hs_pool_put(&session->server->pool, out->head, out->head_capacity);
+    session->server->memused -= out->head_capacity;
+  }
+  if (out->body && out->body_release) {
+    out->body_release((void*)out->body);
+  }
+  session->server->memused -= out->body_charged;
+  if (out->trace) hs_trace_end(session->server, out->trace, 0);
+  *out = (hs_out_t){ };
+}
+
+// Drops the responses at the front of the queue that have been written out
+// completely. out_written counts the bytes written since the first one left
+// in the queue started.
+void hs_out_pop(http_request_t* session) {
+  int done = 0;
+  while (
+    done < session->out_count &&
+    session->out_written >= hs_out_length(&session->out[done])
+  ) {
+    hs_out_t* out = &session->out[done];
+    session->out_written -= hs_out_length(out);
+    if (out->trace) {
+      hs_trace_end(session->server, out->trace, 1);
+      out->trace = NULL;
+    }
+    hs_out_release(session, out);
+    done++;
+  }
+  if (done == 0) return;
+  session->out_count -= done;
+  memmove(session->out, session->out + done, session->out_count * sizeof(hs_out_t));
+}
+
+// Writes as much of the queued responses as the socket will take in a single
+// writev.
 int hs_write_client_socket(http_request_t* session) {
-  int bytes = write(
-    session->socket,
-    session->stream.buf + session->stream.total_bytes,
-    session->stream.length - session->stream.total_bytes
-  );
-  if (bytes > 0) session->stream.total_bytes += bytes;
-  return errno == EPIPE ? 0 : 1;
+  struct iovec iov[HTTP_PIPELINE_MAX * 2];
+  int iovcnt = 0;
+  int64_t skip = session->out_written;
+  for (int i = 0; i < session->out_count; i++) {
+    hs_out_t* out = &session->out[i];
+    if (skip < out->head_length) {
+      iov[iovcnt].iov_base = out->head + skip;
+      iov[iovcnt].iov_len = out->head_length - skip;
+      iovcnt++;
+      skip = 0;
+    } else {
+      skip -= out->head_length;
+    }
+    if (skip < out->body_length) {
+      iov[iovcnt].iov_base = (char*)out->body + skip;
+      iov[iovcnt].iov_len = out->body_length - skip;
+      iovcnt++;
+      skip = 0;
+    } else {
+      skip -= out->body_length;
+    }
+  }
+  if (iovcnt == 0) return 1;
+  ssize_t bytes = writev(session->socket, iov, iovcnt);
+  if (bytes > 0) {
+    session->out_written += bytes;
+    hs_out_pop(session);
+  }
+  return bytes < 0 && errno == EPIPE ? 0 : 1;
 }
 
 void hs_free_buffer(http_request_t* session) {
   if (session->stream.buf) {
-    free(session->stream.buf);
+    hs_pool_put(&session->server->pool, session->stream.buf, session->stream.capacity);
     session->server->memused -= session->stream.capacity;
     session->stream.buf = NULL;
   }
 }
 
+void hs_release_output(http_request_t* session) {
+  for (int i = 0; i < session->out_count; i++) {
+    hs_out_release(session, &session->out[i]);
+  }
+  session->out_count = 0;
+  session->out_written = 0;
+}
+
+// Called once a response has been queued and, if it was flushed, had its
+// first write attempt. Any body we don't own that hasn't been fully written
+// is copied so the caller can free theirs.
+void hs_retain_bodies(http_request_t* session) {
+  if (HTTP_FLAG_CHECK(session->flags, HTTP_END_SESSION)) return;
+  for (int i = 0; i < session->out_count; i++) {
+    hs_out_t* out = &session->out[i];
+    if (out->body == NULL || out->body_release) continue;
+    int64_t written = 0;
+    if (i == 0) {
+      written = session->out_written - out->head_length;
+      if (written < 0) written = 0;
+    }
+    int64_t left = out->body_length - written;
+    char* copy = (char*)malloc(left);
+    assert(copy != NULL);
+    memcpy(copy, out->body + written, left);
+    // Shift the body so that offsets computed from out_written still land on
+    // the copied remainder.
+    if (i == 0) session->out_written -= written;
+    out->body = copy;
+    out->body_length = left;
+    out->body_release = free;
+    out->body_charged = left;
+    session->server->memused += left;
+  }
+}
+
+// Whether the read buffer holds (the start of) a request still to be
+// answered. Until hs_next_request runs the answered request is still at the
+// front of the buffer, so only what follows it counts. A streamed body may
+// have been left partly unread, so nothing after one is trusted.
+int hs_stream_pending(http_request_t* session) {
+  hs_stream_t* stream = &session->stream;
+  if (stream->buf == NULL) return 0;
+  if (HTTP_FLAG_CHECK(session->flags, HTTP_FLG_STREAMED)) return 0;
+  if (HTTP_FLAG_CHECK(session->flags, HTTP_RESPONDED)) {
+    return stream->index < stream->length;
+  }
+  return stream->length > 0;
+}
+
 void hs_init_session(http_request_t* session) {
+  hs_spill_close(session);
   session->flags = HTTP_AUTOMATIC;
   session->parser = (http_parser_t){ };
   session->stream = (hs_stream_t){ };
-  if (session->tokens.buf) {
-    free(session->tokens.buf);
-    session->tokens.buf = NULL;
-  }
-  http_token_dyn_init(&session->tokens, 32);
+  session->index.built = 0;
+  hs_arena_reset(&session->arena);
+  http_token_dyn_init(&session->tokens, &session->arena, 32);
+}
+
+// Moves on to the next pipelined request once the current one has been
+// answered. Whatever followed the current request in the read buffer is
+// moved to the front; responses still queued are left alone.
+void hs_next_request(http_request_t* session) {
+  hs_stream_t* stream = &session->stream;
+  int left = stream->length - stream->index;
+  if (left > 0) memmove(stream->buf, stream->buf + stream->index, left);
+  char* buf = stream->buf;
+  int32_t capacity = stream->capacity;
+  // Keep-alive carries over so the queued responses still go out on an open
+  // connection if the next request never completes.
+  int keep = session->flags & (HTTP_WRITE_ARMED | HTTP_IN_READ | HTTP_KEEP_ALIVE);
+  hs_init_session(session);
+  session->flags |= keep;
+  stream->buf = buf;
+  stream->capacity = capacity;
+  stream->length = left;
 }
 
 void hs_end_session(http_request_t* session) {
+  session->server->connections--;
+  hs_admit_release(session);
+  hs_wheel_remove(&session->timer);
   hs_delete_events(session);
   close(session->socket);
+  hs_release_output(session);
   hs_free_buffer(session);
-  free(session->tokens.buf);
+  hs_spill_close(session);
+  if (session->trace) hs_trace_end(session->server, session->trace, 0);
+  if (session->h2) hs_h2_free(session);
+  hs_arena_free(&session->arena);
   session->tokens.buf = NULL;
   free(session);
 }
 
+// *** timing wheel ***
+
+void hs_wheel_init(hs_wheel_t* wheel) {
+  for (int l = 0; l < HS_WHEEL_LEVELS; l++) {
+    for (int i = 0; i < HS_WHEEL_SLOTS; i++) {
+      wheel->slots[l][i].next = &wheel->slots[l][i];
+      wheel->slots[l][i].prev = &wheel->slots[l][i];
+    }
+  }
+  wheel->now = 0;
+}
+
+void hs_wheel_remove(hs_timer_t* timer) {
+  if (timer->next == NULL) return;
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+void hs_wheel_insert(hs_wheel_t* wheel, hs_timer_t* timer) {
+  hs_timer_t* head;
+  int64_t delta = timer->expires - wheel->now;
+  if (delta < HS_WHEEL_SLOTS) {
+    head = &wheel->slots[0][timer->expires & HS_WHEEL_MASK];
+  } else {
+    head = &wheel->slots[1][(timer->expires >> HS_WHEEL_BITS) & HS_WHEEL_MASK];
+  }
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+// (Re)arms the timer to fire after the given number of ticks.
+void hs_wheel_add(hs_wheel_t* wheel, hs_timer_t* timer, int ticks) {
+  hs_wheel_remove(timer);
+  if (ticks < 1) ticks = 1;
+  if (ticks > HS_WHEEL_MAX_TICKS) ticks = HS_WHEEL_MAX_TICKS;
+  timer->expires = wheel->now + ticks;
+  hs_wheel_insert(wheel, timer);
+}
+
+// Advances the wheel one tick and calls expire on every timer that came due.
+// Timers are unlinked before expire is called so it is free to re-arm or
+// release them.
+void hs_wheel_tick(hs_wheel_t* wheel, void (*expire)(hs_timer_t*)) {
+  wheel->now++;
+  if ((wheel->now & HS_WHEEL_MASK) == 0) {
+    hs_timer_t* head = &wheel->slots[1][(wheel->now >> HS_WHEEL_BITS) & HS_WHEEL_MASK];
+    while (head->next != head) {
+      hs_timer_t* timer = head->next;
+      hs_wheel_remove(timer);
+      hs_wheel_insert(wheel, timer);
+    }
+  }
+  hs_timer_t* head = &wheel->slots[0][wheel->now & HS_WHEEL_MASK];
+  while (head->next != head) {
+    hs_timer_t* timer = head->next;
+    hs_wheel_remove(timer);
+    expire(timer);
+  }
+}
+
 void hs_reset_timeout(http_request_t* request, int time) {
-  request->timeout = time;
+  hs_wheel_add(&request->server->wheel, &request->timer, time);
+}
+
+void hs_request_expire(hs_timer_t* timer) {
+  http_request_t* request = (http_request_t*)(
+    (char*)timer - offsetof(http_request_t, timer)
+  );
+  hs_end_session(request);
+}
+
+void hs_server_tick(http_server_t* server) {
+  hs_generate_date_time(server->date);
+  hs_wheel_tick(&server->wheel, hs_request_expire);
+}
+
+// Calls fn on every open connection. Each has its timer on the wheel, so
+// that's where they are found. The timers are moved off onto a list of their
+// own first and put back one at a time, so fn is free to re-arm the timer or
+// end the connection.
+void hs_server_each(http_server_t* server, void (*fn)(http_request_t*)) {
+  hs_wheel_t* wheel = &server->wheel;
+  hs_timer_t all;
+  all.next = all.prev = &all;
+  for (int l = 0; l < HS_WHEEL_LEVELS; l++) {
+    for (int i = 0; i < HS_WHEEL_SLOTS; i++) {
+      hs_timer_t* head = &wheel->slots[l][i];
+      if (head->next == head) continue;
+      head->next->prev = all.prev;
+      all.prev->next = head->next;
+      head->prev->next = &all;
+      all.prev = head->prev;
+      head->next = head->prev = head;
+    }
+  }
+  while (all.next != &all) {
+    hs_timer_t* timer = all.next;
+    hs_wheel_remove(timer);
+    hs_wheel_insert(wheel, timer);
+    fn((http_request_t*)((char*)timer - offsetof(http_request_t, timer)));
+  }
+}
+
+// Whether a draining server is done, with every connection closed or out of
+// time.
+int hs_server_drained(http_server_t* server) {
+  return
+    server->drain_until &&
+    (server->connections == 0 || server->wheel.now >= server->drain_until);
 }
 
 void hs_read_and_process_request(http_request_t* request);
@@ -1077,10 +2265,13 @@ void hs_write_response(http_request_t* request) {
     HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
     return;
   }
-  if (request->stream.total_bytes != request->stream.length) {
-    // All bytes of the body were not written and we need to wait until the
-    // socket is writable again to complete the write
-    hs_add_write_event(request);
+  if (request->out_count > 0) {
+    // All bytes of the queued responses were not written and we need to
+    // wait until the socket is writable again to complete the write
+    if (!HTTP_FLAG_CHECK(request->flags, HTTP_WRITE_ARMED)) {
+      HTTP_FLAG_SET(request->flags, HTTP_WRITE_ARMED);
+      hs_add_write_event(request);
+    }
     request->state = HTTP_SESSION_WRITE;
     hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
   } else if (HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
@@ -1088,109 +2279,959 @@ void hs_write_response(http_request_t* request) {
     // from the application.
     request->state = HTTP_SESSION_WRITE;
     hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
-    hs_free_buffer(request);
     request->chunk_cb(request);
   } else {
-    if (HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE)) {
+    if (HTTP_FLAG_CHECK(request->flags, HTTP_WRITE_ARMED)) {
+      // We swapped the read interest for write interest to finish a partial
+      // write. Without swapping back the next request on this connection
+      // would never be seen.
+      HTTP_FLAG_CLEAR(request->flags, HTTP_WRITE_ARMED);
+      hs_add_read_event(request);
+    }
+    if (!HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE)) {
+      HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
+    } else if (hs_stream_pending(request)) {
+      // The start of the next request is already buffered. The caller picks
+      // it up from here.
+      request->state = HTTP_SESSION_READ;
+      hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
+    } else {
       request->state = HTTP_SESSION_INIT;
       hs_free_buffer(request);
-      hs_reset_timeout(request, HTTP_KEEP_ALIVE_TIMEOUT);
-    } else {
-      HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
+      hs_reset_timeout(
+        request,
+        request->server->drain_until ? HS_DRAIN_IDLE : HTTP_KEEP_ALIVE_TIMEOUT
+      );
     }
   }
 }
 
+// Errors leave the parser somewhere in the middle of the request, so the
+// connection is closed rather than trying to find the next one.
 void hs_error_response(http_request_t* request, int code, char const * message) {
+  HTTP_FLAG_CLEAR(request->flags, HTTP_AUTOMATIC);
+  HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
   struct http_response_s* response = http_response_init();
   http_response_status(response, code);
   http_response_header(response, "Content-Type", "text/plain");
   http_response_body(response, message, strlen(message));
   http_respond(request, response);
-  hs_write_response(request);
 }
 
-void hs_read_and_process_request(http_request_t* request) {
-  request->state = HTTP_SESSION_READ;
-  http_token_t token = {0, 0, 0};
-  hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
-  int rc = hs_stream_read_socket(&request->stream, request->socket, &request->server->memused);
-  if (rc == 0) {
-    HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
-    return;
-  }
-  do {
-    token = http_parse(&request->parser, &request->stream);
-    if (token.type != HS_TOK_NONE) http_token_dyn_push(&request->tokens, token);
-    switch (token.type) {
-      case HS_TOK_ERROR:
-        hs_error_response(request, 400, "Bad Request");
-        break;
-      case HS_TOK_BODY:
-      case HS_TOK_BODY_STREAM:
-        if (token.type == HS_TOK_BODY_STREAM) {
-          HTTP_FLAG_SET(request->flags, HTTP_FLG_STREAMED);
-        }
-        request->state = HTTP_SESSION_NOP;
-        request->server->request_handler(request);
-        break;
-      case HS_TOK_CHUNK_BODY:
-        request->state = HTTP_SESSION_NOP;
-        request->chunk_cb(request);
-        break;
-    }
-  } while (token.type != HS_TOK_NONE && request->state == HTTP_SESSION_READ);
-}
+// *** admission control ***
 
-// Application requesting next chunk of request body.
-void http_request_read_chunk(
-  struct http_request_s* request,
-  void (*chunk_cb)(struct http_request_s*)
-) {
-  request->chunk_cb = chunk_cb;
-  hs_read_and_process_request(request);
+// The controller watches one number, how long a ready connection waits in
+// the event loop behind the others, and acts CoDel fashion on it: a wait that
+// stays above HTTP_ADMIT_TARGET_MS for a whole HTTP_ADMIT_INTERVAL_MS means
+// the server is overloaded and not just hit by a burst. Requests with a body
+// are the expensive ones so they go first; requests without one are only
+// turned away when they would wait more than an interval. Requests with a
+// body are also capped in number and bytes whatever the lag.
+
+int64_t hs_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-// This is the heart of the request logic. This is the state machine that
-// controls what happens when an IO event is received.
-void http_session(http_request_t* request) {
-  switch (request->state) {
-    case HTTP_SESSION_INIT:
-      hs_init_session(request);
-      request->state = HTTP_SESSION_READ;
-      if (request->server->memused > HTTP_MAX_TOTAL_EST_MEM_USAGE) {
-        return hs_error_response(request, 503, "Service Unavailable");
-      }
-      // fallthrough
-    case HTTP_SESSION_READ:
-      hs_read_and_process_request(request);
-      break;
-    case HTTP_SESSION_WRITE:
-      hs_write_response(request);
-      break;
-  }
-  if (HTTP_FLAG_CHECK(request->flags, HTTP_END_SESSION)) {
-    hs_end_session(request);
+// Called for every connection event. Posts a probe to the back of the event
+// queue unless one is already on its way round.
+void hs_admit_probe(http_server_t* server) {
+  hs_admit_t* admit = &server->admit;
+  if (admit->probe_sent) return;
+  int64_t now = hs_now_us();
+  if (now - admit->sampled_at < HS_ADMIT_PROBE_US) return;
+  if (now - admit->sampled_at > HTTP_ADMIT_INTERVAL_MS * 1000) {
+    // Nothing has been probed for a while, so the loop was idle and whatever
+    // was measured last no longer holds.
+    admit->lag = 0;
+    admit->above_since = 0;
+    admit->overloaded = 0;
   }
+  admit->probe_sent = now;
+  hs_admit_post_probe(server);
 }
 
-void hs_accept_connections(http_server_t* server) {
+// The probe came round, it waited behind everything that was ready when it
+// was posted.
+void hs_admit_sample(http_server_t* server) {
+  hs_admit_t* admit = &server->admit;
+  int64_t now = hs_now_us();
+  admit->lag = now - admit->probe_sent;
+  admit->probe_sent = 0;
+  admit->sampled_at = now;
+  if (admit->lag > admit->lag_max) admit->lag_max = admit->lag;
+  if (admit->lag < HTTP_ADMIT_TARGET_MS * 1000) {
+    admit->above_since = 0;
+    admit->overloaded = 0;
+  } else if (admit->above_since == 0) {
+    admit->above_since = now;
+  } else if (
+    !admit->overloaded &&
+    now - admit->above_since >= HTTP_ADMIT_INTERVAL_MS * 1000
+  ) {
+    admit->overloaded = 1;
+    admit->overloads++;
+  }
+}
+
+// *** rate limiting ***
+
+// Each client address and each /24 has a token bucket for requests and one
+// for body bytes, refilled continuously from the time since it was last
+// touched. A request has to find enough in all four to go through; if it
+// doesn't nothing is taken. The buckets live in a fixed table, the least
+// recently used entry is recycled when it fills up.
+
+uint32_t hs_rate_hash(uint64_t key) {
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (HTTP_RATE_TABLE_SIZE - 1);
+}
+
+void hs_rate_unlink(hs_rate_t* rate, int32_t i) {
+  hs_rate_entry_t* entry = &rate->entries[i];
+  if (entry->newer >= 0) rate->entries[entry->newer].older = entry->older;
+  else rate->newest = entry->older;
+  if (entry->older >= 0) rate->entries[entry->older].newer = entry->newer;
+  else rate->oldest = entry->newer;
+}
+
+void hs_rate_push(hs_rate_t* rate, int32_t i) {
+  hs_rate_entry_t* entry = &rate->entries[i];
+  entry->newer = -1;
+  entry->older = rate->newest;
+  if (rate->newest >= 0) rate->entries[rate->newest].newer = i;
+  else rate->oldest = i;
+  rate->newest = i;
+}
+
+// Finds the entry for key, making one with full buckets if there is none.
+hs_rate_entry_t* hs_rate_entry(hs_rate_t* rate, uint64_t key, int64_t now, int factor) {
+  int32_t* chain = &rate->chains[hs_rate_hash(key)];
+  for (int32_t i = *chain; i >= 0; i = rate->entries[i].next) {
+    if (rate->entries[i].key != key) continue;
+    if (rate->newest != i) {
+      hs_rate_unlink(rate, i);
+      hs_rate_push(rate, i);
+    }
+    return &rate->entries[i];
+  }
+  int32_t i;
+  if (rate->count < HTTP_RATE_TABLE_SIZE) {
+    i = rate->count++;
+  } else {
+    i = rate->oldest;
+    hs_rate_unlink(rate, i);
+    int32_t* link = &rate->chains[hs_rate_hash(rate->entries[i].key)];
+    while (*link != i) link = &rate->entries[*link].next;
+    *link = rate->entries[i].next;
+  }
+  hs_rate_entry_t* entry = &rate->entries[i];
+  entry->key = key;
+  entry->requests = rate->request_burst * factor * HS_RATE_UNIT;
+  entry->bytes = rate->byte_burst * factor * HS_RATE_UNIT;
+  entry->updated = now;
+  entry->next = *chain;
+  *chain = i;
+  hs_rate_push(rate, i);
+  return entry;
+}
+
+// Tops a bucket up for elapsed microseconds at per second, without passing
+// burst.
+void hs_rate_refill(int64_t* tokens, int64_t elapsed, int64_t per_second, int64_t burst) {
+  if (per_second == 0 || *tokens >= burst) return;
+  // A token a second is a millionth of one a microsecond.
+  if (elapsed >= (burst - *tokens) / per_second) *tokens = burst;
+  else *tokens += elapsed * per_second;
+}
+
+// Whether the entry's buckets hold a request and bytes of body, after
+// catching up on what they've earned since they were last looked at.
+int hs_rate_ready(hs_rate_t* rate, hs_rate_entry_t* entry, int64_t now, int factor, int64_t bytes) {
+  int64_t elapsed = now - entry->updated;
+  entry->updated = now;
+  hs_rate_refill(
+    &entry->requests, elapsed,
+    rate->requests * factor, rate->request_burst * factor * HS_RATE_UNIT
+  );
+  hs_rate_refill(
+    &entry->bytes, elapsed,
+    rate->bytes * factor, rate->byte_burst * factor * HS_RATE_UNIT
+  );
+  if (rate->requests > 0 && entry->requests < HS_RATE_UNIT) return 0;
+  if (rate->bytes > 0 && bytes > 0) {
+    if (bytes > rate->byte_burst * factor) return 0;
+    if (entry->bytes < bytes * HS_RATE_UNIT) return 0;
+  }
+  return 1;
+}
+
+void hs_rate_take(hs_rate_t* rate, hs_rate_entry_t* entry, int64_t bytes) {
+  if (rate->requests > 0) entry->requests -= HS_RATE_UNIT;
+  if (rate->bytes > 0) entry->bytes -= bytes * HS_RATE_UNIT;
+}
+
+// The big endian number in the first n bytes of p.
+uint64_t hs_get_be(uint8_t const * p, int n) {
+  uint64_t v = 0;
+  for (int i = 0; i < n; i++) v = v << 8 | p[i];
+  return v;
+}
+
+// Unknown clients have no family of their own, so they never match.
+int http_request_trusted(http_request_t* request) {
+  http_server_t* server = request->server;
+  hs_peer_t* peer = &request->peer;
+  for (int i = 0; i < server->trust_count; i++) {
+    hs_trust_t* trust = &server->trust[i];
+    if (trust->family != peer->family) continue;
+    int whole = trust->bits / 8;
+    int rest = trust->bits % 8;
+    if (memcmp(peer->addr, trust->addr, whole) != 0) continue;
+    if (rest && ((peer->addr[whole] ^ trust->addr[whole]) & (0xff << (8 - rest)) & 0xff)) continue;
+    return 1;
+  }
+  return 0;
+}
+
+int http_server_trust(http_server_t* serv, char const * cidr) {
+  if (serv->trust_count == HTTP_TRUST_MAX) return -1;
+  char buf[INET6_ADDRSTRLEN];
+  char const * slash = strchr(cidr, '/');
+  int len = slash ? slash - cidr : (int)strlen(cidr);
+  if (len >= (int)sizeof(buf)) return -1;
+  memcpy(buf, cidr, len);
+  buf[len] = '\0';
+  hs_trust_t trust = { .family = AF_INET, .bits = 32 };
+  if (inet_pton(AF_INET, buf, trust.addr) != 1) {
+    trust = (hs_trust_t){ .family = AF_INET6, .bits = 128 };
+    if (inet_pton(AF_INET6, buf, trust.addr) != 1) return -1;
+  }
+  if (slash) {
+    char* end;
+    long n = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || n < 0 || n > trust.bits) return -1;
+    trust.bits = n;
+  }
+  serv->trust[serv->trust_count++] = trust;
+  return 0;
+}
+
+// Charges the request to its client, returns 0 if it is over the limit.
+int hs_rate_admit(http_request_t* request, int64_t bytes) {
+  hs_rate_t* rate = &request->server->rate;
+  if (rate->entries == NULL) return 1;
+  if (http_request_trusted(request)) return 1;
+  int64_t now = hs_now_us();
+  hs_peer_t* peer = &request->peer;
+  if (peer->family == AF_UNSPEC) {
+    hs_rate_entry_t* unknown = hs_rate_entry(
+      rate, (uint64_t)HS_RATE_UNKNOWN << 32, now, HTTP_RATE_SUBNET_FACTOR
+    );
+    if (!hs_rate_ready(rate, unknown, now, HTTP_RATE_SUBNET_FACTOR, bytes)) return 0;
+    hs_rate_take(rate, unknown, bytes);
+    return 1;
+  }
+  // An IPv6 /64 is its own key. It could only collide with the tagged ones
+  // if it were in ::/8, which is reserved and never a client's.
+  uint64_t key, subnet_key;
+  if (peer->family == AF_INET) {
+    uint32_t addr = hs_get_be(peer->addr, 4);
+    key = (uint64_t)HS_RATE_ADDR << 32 | addr;
+    subnet_key = (uint64_t)HS_RATE_SUBNET << 32 | (addr & 0xffffff00);
+  } else {
+    key = hs_get_be(peer->addr, 8);
+    subnet_key = (uint64_t)HS_RATE_SUBNET6 << 48 | hs_get_be(peer->addr, 6);
+  }
+  hs_rate_entry_t* client = hs_rate_entry(rate, key, now, 1);
+  hs_rate_entry_t* subnet = hs_rate_entry(rate, subnet_key, now, HTTP_RATE_SUBNET_FACTOR);
+  if (
+    !hs_rate_ready(rate, client, now, 1, bytes) ||
+    !hs_rate_ready(rate, subnet, now, HTTP_RATE_SUBNET_FACTOR, bytes)
+  ) {
+    return 0;
+  }
+  hs_rate_take(rate, client, bytes);
+  hs_rate_take(rate, subnet, bytes);
+  return 1;
+}
+
+void http_server_rate_limit(
+  struct http_server_s* serv,
+  int64_t requests,
+  int64_t request_burst,
+  int64_t bytes,
+  int64_t byte_burst
+) {
+  hs_rate_t* rate = &serv->rate;
+  free(rate->entries);
+  free(rate->chains);
+  *rate = (hs_rate_t){ };
+  if (requests <= 0 && bytes <= 0) return;
+  rate->requests = requests > 0 ? requests : 0;
+  rate->request_burst = requests > 0 ? (request_burst > 0 ? request_burst : 1) : 0;
+  rate->bytes = bytes > 0 ? bytes : 0;
+  rate->byte_burst = bytes > 0 ? (byte_burst > bytes ? byte_burst : bytes) : 0;
+  rate->entries = (hs_rate_entry_t*)malloc(HTTP_RATE_TABLE_SIZE * sizeof(hs_rate_entry_t));
+  rate->chains = (int32_t*)malloc(HTTP_RATE_TABLE_SIZE * sizeof(int32_t));
+  assert(rate->entries != NULL && rate->chains != NULL);
+  for (int i = 0; i < HTTP_RATE_TABLE_SIZE; i++) rate->chains[i] = -1;
+  rate->newest = rate->oldest = -1;
+}
+
+// Decides whether the request is taken on, once its headers are in. bytes is
+// the declared size of its body, if it has one. Returns 0 to take it or the
+// status to turn it away with.
+int hs_admit(http_request_t* request, int upload, int64_t bytes) {
+  hs_admit_t* admit = &request->server->admit;
+  HTTP_FLAG_SET(request->flags, HTTP_ADMITTED);
+  if (!hs_rate_admit(request, upload ? bytes : 0)) {
+    admit->shed_rate++;
+    return 429;
+  }
+  if (upload) {
+    if (admit->overloaded) {
+      admit->shed_uploads++;
+      return 503;
+    }
+    if (
+      admit->uploads >= HTTP_ADMIT_MAX_UPLOADS ||
+      admit->upload_bytes + bytes > HTTP_ADMIT_MAX_UPLOAD_BYTES
+    ) {
+      admit->shed_capped++;
+      return 503;
+    }
+    admit->uploads++;
+    admit->upload_bytes += bytes;
+    request->admit_bytes = bytes;
+    HTTP_FLAG_SET(request->flags, HTTP_UPLOAD);
+  } else if (admit->overloaded && admit->lag > HTTP_ADMIT_INTERVAL_MS * 1000) {
+    admit->shed_requests++;
+    return 503;
+  }
+  admit->admitted++;
+  return 0;
+}
+
+// The request has been answered or abandoned, its body no longer counts.
+void hs_admit_release(http_request_t* request) {
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_UPLOAD)) return;
+  HTTP_FLAG_CLEAR(request->flags, HTTP_UPLOAD);
+  hs_admit_t* admit = &request->server->admit;
+  admit->uploads--;
+  admit->upload_bytes -= request->admit_bytes;
+  request->admit_bytes = 0;
+}
+
+// Turns a request away with status. If its body hasn't been read the
+// connection has to go too.
+void hs_shed_response(http_request_t* request, int status, int complete) {
+  if (!complete) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_AUTOMATIC);
+    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+  }
+  char const * text = hs_status_text[status];
+  struct http_response_s* response = http_response_init();
+  http_response_status(response, status);
+  http_response_header(response, "Content-Type", "text/plain");
+  http_response_header(response, "Retry-After", "1");
+  http_response_body(response, text, strlen(text));
+  http_respond(request, response);
+}
+
+void http_server_admission_stats(struct http_server_s* serv, struct http_admission_stats_s* stats) {
+  hs_admit_t* admit = &serv->admit;
+  stats->lag = admit->lag;
+  stats->lag_max = admit->lag_max;
+  stats->overloaded = admit->overloaded;
+  stats->overloads = admit->overloads;
+  stats->uploads = admit->uploads;
+  stats->upload_bytes = admit->upload_bytes;
+  stats->admitted = admit->admitted;
+  stats->shed_requests = admit->shed_requests;
+  stats->shed_uploads = admit->shed_uploads;
+  stats->shed_capped = admit->shed_capped;
+  stats->shed_rate = admit->shed_rate;
+}
+
+// *** tracing ***
+
+// A request's trace follows it from the first read to the last write. Once
+// answered it moves to the response on the output queue, so pipelined
+// requests each keep their own until theirs is written. For HTTP/2 it stays
+// on the stream.
+
+void http_server_trace(
+  struct http_server_s* server,
+  int64_t threshold,
+  int sample_every,
+  void (*cb)(struct http_trace_s* trace)
+) {
+  server->tracer.cb = cb;
+  server->tracer.threshold = threshold;
+  server->tracer.sample_every = sample_every;
+}
+
+void http_server_access_log(struct http_server_s* server, void (*cb)(struct http_trace_s* trace)) {
+  server->tracer.access = cb;
+}
+
+void hs_trace_begin(http_request_t* request) {
+  hs_tracer_t* tracer = &request->server->tracer;
+  if ((tracer->cb == NULL && tracer->access == NULL) || request->trace) return;
+  hs_trace_t* trace = tracer->free;
+  if (trace) {
+    tracer->free = trace->next;
+    tracer->free_count--;
+  } else {
+    trace = (hs_trace_t*)malloc(sizeof(hs_trace_t));
+    assert(trace != NULL);
+  }
+  *trace = (hs_trace_t){ };
+  trace->trace.start = hs_now_us();
+  tracer->count++;
+  trace->trace.sampled =
+    tracer->sample_every > 0 && tracer->count % tracer->sample_every == 0;
+  http_request_peer(request, trace->trace.peer, sizeof(trace->trace.peer));
+  request->trace = trace;
+}
+
+void hs_trace_headers(http_request_t* request) {
+  if (request->trace && request->trace->trace.headers == 0) {
+    request->trace->trace.headers = hs_now_us();
+  }
+}
+
+void hs_trace_line(http_request_t* request, struct http_trace_s* trace) {
+  if (trace->method[0] || request->stream.buf == NULL) return;
+  http_string_t method = http_request_method(request);
+  http_string_t target = http_request_target(request);
+  snprintf(trace->method, sizeof(trace->method), "%.*s", method.len, method.buf);
+  snprintf(trace->target, sizeof(trace->target), "%.*s", target.len, target.buf);
+}
+
+void hs_trace_handler(http_request_t* request) {
+  if (request->trace == NULL) return;
+  struct http_trace_s* trace = &request->trace->trace;
+  trace->handler = hs_now_us();
+  if (trace->headers == 0) trace->headers = trace->handler;
+  hs_trace_line(request, trace);
+  int64_t length;
+  if (http_request_body_file(request, &length) < 0) length = http_request_body(request).len;
+  trace->received = length;
+}
+
+// The server reset the HTTP/2 stream, the access log wants to know why.
+void hs_trace_reset(http_request_t* request, uint32_t code) {
+  if (request->trace == NULL || request->trace->trace.reset) return;
+  request->trace->trace.reset = code;
+  hs_trace_line(request, &request->trace->trace);
+}
+
+// Called for every response and chunk, the time is the first one's. Only
+// body bytes that go out count, not a HEAD's or a bare Content-Length.
+void hs_trace_respond(http_request_t* request, http_response_t* response) {
+  if (request->trace == NULL) return;
+  struct http_trace_s* trace = &request->trace->trace;
+  if (trace->respond == 0) {
+    trace->respond = hs_now_us();
+    trace->status = response->status;
+    hs_trace_line(request, trace);
+  }
+  if (response->body) trace->bytes += response->content_length;
+}
+
+// The trace is done with. Only a response that was written all the way out
+// goes to the tracer, the access log also gets those that weren't and
+// streams that were reset.
+void hs_trace_end(http_server_t* server, hs_trace_t* trace, int written) {
+  hs_tracer_t* tracer = &server->tracer;
+  struct http_trace_s* t = &trace->trace;
+  if (written && t->respond) {
+    t->written = hs_now_us();
+    if (
+      tracer->cb && (t->sampled ||
+      (tracer->threshold > 0 && t->written - t->start > tracer->threshold))
+    ) {
+      tracer->cb(t);
+    }
+  }
+  if (tracer->access && (t->respond || t->reset)) tracer->access(t);
+  if (tracer->free_count >= HTTP_RESPONSE_FREE_MAX) {
+    free(trace);
+    return;
+  }
+  trace->next = tracer->free;
+  tracer->free = trace;
+  tracer->free_count++;
+}
+
+void http_request_trace_span(
+  struct http_request_s* request,
+  char const * name,
+  int64_t start,
+  int64_t end
+) {
+  if (request->trace == NULL) return;
+  struct http_trace_s* trace = &request->trace->trace;
+  if (trace->span_count == HTTP_TRACE_SPANS) return;
+  trace->spans[trace->span_count++] = (struct http_trace_span_s){ name, start, end };
+}
+
+// *** request body spilling ***
+
+// Opens an unlinked file in dir to hold a request body. Without O_TMPFILE,
+// or on a filesystem that doesn't support it, the file is made and unlinked
+// straight away.
+int hs_spill_open(char const * dir) {
+  int fd = -1;
+#ifdef O_TMPFILE
+  fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0) return fd;
+#endif
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/httpserver-XXXXXX", dir) >= (int)sizeof(path)) return -1;
+  fd = mkstemp(path);
+  if (fd < 0) return -1;
+  unlink(path);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+void hs_spill_close(http_request_t* request) {
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_SPILLED)) return;
+  HTTP_FLAG_CLEAR(request->flags, HTTP_SPILLED);
+  close(request->spill_fd);
+  request->spill_fd = -1;
+  request->spill_left = 0;
+}
+
+// The headers are in and the body has a length over the threshold. Bodies
+// too big for the buffer are streamed to the application instead.
+int hs_spill_wanted(http_request_t* request) {
+  http_parser_t* parser = &request->parser;
+  return
+    request->server->spill_threshold > 0 &&
+    parser->meta == M_BDY &&
+    parser->content_length >= request->server->spill_threshold &&
+    request->state == HTTP_SESSION_READ &&
+    !(request->flags & (HTTP_RESPONDED | HTTP_SPILLED));
+}
+
+// Writes the body bytes in the buffer from stream.index on to the file and
+// drops them, leaving anything after the body, a pipelined request, where
+// they were. Returns -1 if the write fails.
+int hs_spill_write(http_request_t* request) {
+  hs_stream_t* stream = &request->stream;
+  int64_t n = stream->length - stream->index;
+  if (n > request->spill_left) n = request->spill_left;
+  char* buf = stream->buf + stream->index;
+  for (int64_t done = 0; done < n; ) {
+    ssize_t bytes = write(request->spill_fd, buf + done, n - done);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    done += bytes;
+  }
+  memmove(buf, buf + n, stream->length - stream->index - n);
+  stream->length -= n;
+  request->spill_left -= n;
+  return 0;
+}
+
+// The server couldn't keep the body, the rest of it is never read so the
+// connection goes after the response.
+void hs_spill_fail(http_request_t* request) {
+  hs_spill_close(request);
+  hs_error_response(request, 500, "Internal Server Error");
+}
+
+// Starts writing the body to a file. The parser has already stepped over
+// whatever part of it was in the buffer, which goes in first. Returns what
+// hs_stream_read_socket would, so the read loop carries on.
+int hs_spill_begin(http_request_t* request) {
+  http_server_t* server = request->server;
+  hs_stream_t* stream = &request->stream;
+  http_parser_t* parser = &request->parser;
+  request->spill_fd = hs_spill_open(server->spill_dir);
+  if (request->spill_fd < 0) {
+    hs_spill_fail(request);
+    return HS_READ_AGAIN;
+  }
+  HTTP_FLAG_SET(request->flags, HTTP_SPILLED);
+  stream->index -= parser->body_consumed;
+  request->spill_size = parser->content_length;
+  request->spill_left = parser->content_length;
+  if (hs_spill_write(request) < 0) {
+    hs_spill_fail(request);
+    return HS_READ_AGAIN;
+  }
+  if (stream->capacity < HTTP_SPILL_BUF_SIZE) {
+    hs_stream_resize(stream, HTTP_SPILL_BUF_SIZE, &server->pool, &server->memused);
+  }
+  return request->spill_left > 0 ? HS_READ_PENDING : HS_READ_AGAIN;
+}
+
+// Reads the rest of the body off the socket and into the file a buffer at a
+// time, then whatever follows it into the buffer as usual. Returns what
+// hs_stream_read_socket would.
+int hs_spill_read(http_request_t* request) {
+  hs_stream_t* stream = &request->stream;
+  int bytes;
+  do {
+    // The header block can take up the whole buffer, the read loop makes
+    // room for more.
+    if (stream->length == stream->capacity) return HS_READ_FULL;
+    bytes = read(
+      request->socket,
+      stream->buf + stream->length,
+      stream->capacity - stream->length
+    );
+    if (bytes > 0) {
+      stream->length += bytes;
+      stream->total_bytes += bytes;
+      if (hs_spill_write(request) < 0) {
+        hs_spill_fail(request);
+        return HS_READ_AGAIN;
+      }
+    }
+  } while (bytes > 0 && request->spill_left > 0);
+  int rc = bytes <= 0 ? hs_read_end(bytes) : HS_READ_AGAIN;
+  if (rc != HS_READ_AGAIN) return rc;
+  return stream->index < stream->length ? HS_READ_PENDING : HS_READ_AGAIN;
+}
+
+// Whether the whole body is in the file and the parser still has to be told.
+int hs_spill_done(http_request_t* request) {
+  return
+    HTTP_FLAG_CHECK(request->flags, HTTP_SPILLED) &&
+    request->spill_left == 0 &&
+    request->parser.meta == M_BDY;
+}
+
+// Stands in for the body token the parser would have emitted, an empty one,
+// and moves the parser on to the end of the request.
+http_token_t hs_spill_token(http_request_t* request) {
+  http_parser_t* parser = &request->parser;
+  hs_stream_emit(&request->stream);
+  http_token_t token = { request->stream.index, 0, HS_TOK_BODY };
+  hs_trigger_meta(parser, HS_META_NEXT);
+  parser->content_length = 0;
+  parser->body_consumed = 0;
+  return token;
+}
+
+void http_server_spill_bodies(http_server_t* serv, int64_t threshold, char const * dir) {
+  serv->spill_threshold = threshold;
+  serv->spill_dir = dir;
+}
+
+int http_request_body_file(http_request_t* request, int64_t* length) {
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_SPILLED)) return -1;
+  *length = request->spill_size;
+  return request->spill_fd;
+}
+
+// How big the read buffer needs to be to hold the whole request, or 0 if we
+// don't know yet.
+int64_t hs_request_need(http_request_t* request) {
+  http_parser_t* parser = &request->parser;
+  if (parser->meta != M_BDY) return 0;
+  // A body going to a file only needs a buffer's worth past the headers.
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_SPILLED)) {
+    return request->stream.index + HTTP_SPILL_BUF_SIZE;
+  }
+  return request->stream.index + parser->content_length - parser->body_consumed;
+}
+
+void hs_read_and_process_request(http_request_t* request) {
+  request->state = HTTP_SESSION_READ;
+  HTTP_FLAG_SET(request->flags, HTTP_IN_READ);
+  http_token_t token = {0, 0, 0};
+  http_server_t* server = request->server;
+  hs_reset_timeout(request, HTTP_REQUEST_TIMEOUT);
+  int rc, status, eof = 0;
+  do {
+    if (HTTP_FLAG_CHECK(request->flags, HTTP_RESPONDED)) {
+      hs_next_request(request);
+    }
+    rc = request->spill_left > 0
+      ? hs_spill_read(request)
+      : hs_stream_read_socket(&request->stream, request->socket, &server->pool, &server->memused);
+    if (rc == HS_READ_ERR) {
+      // The connection is gone, there's no one left to answer.
+      HTTP_FLAG_CLEAR(request->flags, HTTP_IN_READ);
+      HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
+      return;
+    }
+    if (request->stream.index < request->stream.length) hs_trace_begin(request);
+    if (rc == HS_READ_EOF) {
+      // The client may have sent its last requests along with the FIN.
+      // Answer whatever is complete before closing.
+      eof = 1;
+      if (request->stream.index >= request->stream.length) break;
+    }
+    do {
+      token = hs_spill_done(request)
+        ? hs_spill_token(request)
+        : http_parse(&request->parser, &request->stream);
+      if (token.type != HS_TOK_NONE) http_token_dyn_push(&request->tokens, token);
+      switch (token.type) {
+        case HS_TOK_ERROR:
+          hs_error_response(request, 400, "Bad Request");
+          break;
+        case HS_TOK_VERSION:
+          // A request line of PRI * HTTP/2.0 is the start of the HTTP/2
+          // connection preface.
+          if (hs_h2_preface(request)) {
+            hs_h2_start(request);
+            hs_h2_read(request);
+          }
+          break;
+        case HS_TOK_BODY:
+        case HS_TOK_BODY_STREAM:
+          if (token.type == HS_TOK_BODY_STREAM) {
+            HTTP_FLAG_SET(request->flags, HTTP_FLG_STREAMED);
+          }
+          hs_trace_headers(request);
+          hs_build_header_index(request);
+          if (hs_h2_wants_upgrade(request)) {
+            hs_h2_upgrade(request);
+            break;
+          }
+          request->state = HTTP_SESSION_NOP;
+          if (
+            !HTTP_FLAG_CHECK(request->flags, HTTP_ADMITTED) && (status = hs_admit(
+              request,
+              token.type == HS_TOK_BODY_STREAM || token.len > 0,
+              token.type == HS_TOK_BODY ? token.len : request->parser.content_length
+            ))
+          ) {
+            hs_shed_response(request, status, token.type == HS_TOK_BODY);
+            break;
+          }
+          hs_trace_handler(request);
+          server->requests++;
+          server->request_handler(request);
+          break;
+        case HS_TOK_CHUNK_BODY:
+          request->state = HTTP_SESSION_NOP;
+          request->chunk_cb(request);
+          break;
+      }
+    } while (
+      token.type != HS_TOK_NONE &&
+      request->state == HTTP_SESSION_READ &&
+      !HTTP_FLAG_CHECK(request->flags, HTTP_RESPONDED)
+    );
+    // The headers are in and the body is still on its way. Decide now,
+    // before the buffer is grown to hold it.
+    if (request->parser.meta == M_BDY) hs_trace_headers(request);
+    if (
+      request->parser.meta == M_BDY &&
+      request->state == HTTP_SESSION_READ &&
+      !(request->flags & (HTTP_ADMITTED | HTTP_RESPONDED)) &&
+      (status = hs_admit(request, 1, request->parser.content_length))
+    ) {
+      hs_shed_response(request, status, 0);
+    }
+    // Admitted, so rather than grow the buffer to hold it the body goes to
+    // a file.
+    if (hs_spill_wanted(request)) {
+      rc = hs_spill_begin(request);
+    }
+  } while (
+    request->state == HTTP_SESSION_READ && (
+      HTTP_FLAG_CHECK(request->flags, HTTP_RESPONDED) ||
+      rc == HS_READ_PENDING ||
+      (rc == HS_READ_FULL && hs_stream_make_room(&request->stream, hs_request_need(request), &server->pool, &server->memused))
+    )
+  );
+  HTTP_FLAG_CLEAR(request->flags, HTTP_IN_READ);
+  if (request->state != HTTP_SESSION_READ) return;
+  if (eof) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+    if (request->out_count == 0) {
+      HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
+      return;
+    }
+  }
+  if (request->out_count > 0) {
+    // Every complete request in the buffer has been answered, send the
+    // responses off together.
+    request->state = HTTP_SESSION_WRITE;
+    hs_write_response(request);
+  }
+}
+
+// Application requesting next chunk of request body.
+void http_request_read_chunk(
+  struct http_request_s* request,
+  void (*chunk_cb)(struct http_request_s*)
+) {
+  request->chunk_cb = chunk_cb;
+  hs_read_and_process_request(request);
+}
+
+// *** PROXY protocol ***
+
+// Records the client's address, addr being 4 or 16 bytes as family says. An
+// IPv4 address mapped into IPv6 is recorded as the IPv4 address it is.
+void hs_peer_set(hs_peer_t* peer, int family, void const * addr) {
+  *peer = (hs_peer_t){ };
+  if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED((struct in6_addr const *)addr)) {
+    family = AF_INET;
+    addr = (uint8_t const *)addr + 12;
+  }
+  if (family != AF_INET && family != AF_INET6) return;
+  peer->family = family;
+  memcpy(peer->addr, addr, family == AF_INET ? 4 : 16);
+}
+
+// Parses a PROXY protocol header at the start of buf, setting peer to the
+// client it names. Returns the length of the header, 0 if it isn't all there
+// yet or -1 if it isn't one.
+int hs_proxy_parse(char const * buf, int len, hs_peer_t* peer) {
+  if (len >= HS_PROXY_V2_SIG_LEN && memcmp(buf, HS_PROXY_V2_SIG, HS_PROXY_V2_SIG_LEN) == 0) {
+    if (len < HS_PROXY_V2_HEADER) return 0;
+    uint8_t const * p = (uint8_t const *)buf;
+    int size = HS_PROXY_V2_HEADER + (p[14] << 8 | p[15]);
+    if ((p[12] >> 4) != 2) return -1;
+    if (len < size) return 0;
+    // PROXY rather than LOCAL. TCP over IPv4 or IPv6 is followed by the
+    // source address, destination address and ports, anything else leaves
+    // the client unknown.
+    if ((p[12] & 0xf) == 1) {
+      int family = p[13] == 0x11 ? AF_INET : p[13] == 0x21 ? AF_INET6 : AF_UNSPEC;
+      int need = family == AF_INET ? 12 : family == AF_INET6 ? 36 : 0;
+      if (size < HS_PROXY_V2_HEADER + need) return -1;
+      hs_peer_set(peer, family, p + HS_PROXY_V2_HEADER);
+    }
+    return size;
+  }
+  if (len < HS_PROXY_V2_SIG_LEN && memcmp(buf, HS_PROXY_V2_SIG, len) == 0) return 0;
+  if (memcmp(buf, "PROXY ", len < 6 ? len : 6) != 0) return -1;
+  char const * end = (char const *)memchr(buf, '\n', len);
+  if (end == NULL) return len < HS_PROXY_V1_MAX ? 0 : -1;
+  int size = end - buf + 1;
+  if (size > HS_PROXY_V1_MAX || size < 8 || end[-1] != '\r') return -1;
+  // TCP4 or TCP6, anything else is UNKNOWN.
+  int family = AF_UNSPEC;
+  if (size > 11 && memcmp(buf + 6, "TCP4 ", 5) == 0) family = AF_INET;
+  if (size > 11 && memcmp(buf + 6, "TCP6 ", 5) == 0) family = AF_INET6;
+  uint8_t addr[16];
+  if (family != AF_UNSPEC) {
+    char src[INET6_ADDRSTRLEN];
+    char const * sp = (char const *)memchr(buf + 11, ' ', size - 11);
+    if (sp == NULL || sp - (buf + 11) >= (int)sizeof(src)) return -1;
+    memcpy(src, buf + 11, sp - (buf + 11));
+    src[sp - (buf + 11)] = '\0';
+    if (inet_pton(family, src, addr) != 1) return -1;
+  }
+  hs_peer_set(peer, family, addr);
+  return size;
+}
+
+// Reads the PROXY protocol header the connection starts with, then hands
+// whatever came in after it to the HTTP parser.
+void hs_read_proxy_header(http_request_t* request) {
+  http_server_t* server = request->server;
+  hs_stream_t* stream = &request->stream;
+  if (stream->buf == NULL) hs_init_session(request);
+  // The index is kept at the end of what's been read so the read below
+  // doesn't take the bytes already there for a request to parse.
+  int rc = hs_stream_read_socket(stream, request->socket, &server->pool, &server->memused);
+  int size = hs_proxy_parse(stream->buf, stream->length, &request->peer);
+  if (size == 0 && rc == HS_READ_AGAIN) {
+    stream->index = stream->length;
+    return;
+  }
+  if (size <= 0) {
+    HTTP_FLAG_SET(request->flags, HTTP_END_SESSION);
+    return;
+  }
+  stream->length -= size;
+  memmove(stream->buf, stream->buf + size, stream->length);
+  stream->index = 0;
+  request->state = HTTP_SESSION_READ;
+  hs_read_and_process_request(request);
+}
+
+void http_server_proxy_protocol(http_server_t* serv, int on) {
+  serv->proxy = on;
+}
+
+// This is the heart of the request logic. This is the state machine that
+// controls what happens when an IO event is received.
+void http_session(http_request_t* request) {
+  switch (request->state) {
+    case HTTP_SESSION_INIT:
+      hs_init_session(request);
+      request->state = HTTP_SESSION_READ;
+      if (request->server->memused > HTTP_MAX_TOTAL_EST_MEM_USAGE) {
+        hs_error_response(request, 503, "Service Unavailable");
+        break;
+      }
+      // fallthrough
+    case HTTP_SESSION_READ:
+      hs_read_and_process_request(request);
+      break;
+    case HTTP_SESSION_WRITE:
+      hs_write_response(request);
+      if (request->state == HTTP_SESSION_READ) {
+        hs_read_and_process_request(request);
+      }
+      break;
+    case HTTP_SESSION_H2:
+      hs_h2_io(request);
+      break;
+    case HTTP_SESSION_PROXY:
+      hs_read_proxy_header(request);
+      break;
+  }
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_END_SESSION)) {
+    hs_end_session(request);
+  }
+}
+
+// Accepts up to HS_ACCEPT_BATCH connections. The listening socket is level
+// triggered, so any more waiting are picked up the next time round the loop,
+// after the events that were ready before them. Accepting until the queue ran
+// dry let clients that reconnect as soon as they're answered keep the loop
+// here for good.
+void hs_accept_connections(http_server_t* server) {
   int sock = 0;
+  int count = 0;
   do {
-    sock = accept(server->socket, (struct sockaddr *)&server->addr, &server->len);
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    sock = accept(server->socket, (struct sockaddr *)&addr, &len);
     if (sock > 0) {
       http_request_t* session = (http_request_t*)calloc(1, sizeof(http_request_t));
       assert(session != NULL);
       session->socket = sock;
+      server->connections++;
+      server->accepted++;
       session->server = server;
-      session->timeout = HTTP_REQUEST_TIMEOUT;
       session->handler = hs_session_io_cb;
+      hs_reset_timeout(session, HTTP_REQUEST_TIMEOUT);
       int flags = fcntl(sock, F_GETFL, 0);
       fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+      // Over a unix socket there's no address, the client stays unknown.
+      if (addr.ss_family == AF_INET || addr.ss_family == AF_INET6) {
+        hs_peer_set(&session->peer, addr.ss_family, addr.ss_family == AF_INET
+          ? (void const *)&((struct sockaddr_in*)&addr)->sin_addr
+          : (void const *)&((struct sockaddr_in6*)&addr)->sin6_addr);
+        // Responses go out in as few writes as we can manage already. Nagle
+        // would only hold back the tail of a pipelined batch that didn't fit
+        // in one write until the client ACKs the first part.
+        int nodelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+      }
+      if (server->proxy) session->state = HTTP_SESSION_PROXY;
       hs_add_events(session);
       http_session(session);
     }
-  } while (sock > 0);
+  } while (sock > 0 && ++count < HS_ACCEPT_BATCH);
 }
 
 void hs_generate_date_time(char* datetime) {
@@ -1205,39 +3246,114 @@ http_server_t* http_server_init(int port, void (*handler)(http_request_t*)) {
   http_server_t* serv = (http_server_t*)malloc(sizeof(http_server_t));
   assert(serv != NULL);
   serv->port = port;
+  serv->socket = -1;
+  serv->drain_until = 0;
+  serv->proxy = 0;
+  serv->spill_threshold = 0;
+  serv->spill_dir = NULL;
   serv->memused = 0;
+  serv->connections = 0;
+  serv->accepted = 0;
+  serv->requests = 0;
+  serv->pool = (hs_pool_t){ };
+  serv->rate = (hs_rate_t){ };
+  serv->trust_count = 0;
+  serv->tracer = (hs_tracer_t){ };
   serv->handler = hs_server_listen_cb;
+  hs_wheel_init(&serv->wheel);
   hs_server_init(serv);
   hs_generate_date_time(serv->date);
   serv->request_handler = handler;
   return serv;
 }
 
+void http_server_stats(struct http_server_s* serv, struct http_server_stats_s* stats) {
+  stats->connections = serv->connections;
+  stats->accepted = serv->accepted;
+  stats->requests = serv->requests;
+  stats->memused = serv->memused;
+}
+
+void http_server_pool_stats(struct http_server_s* serv, struct http_pool_stats_s* stats) {
+  hs_pool_t* pool = &serv->pool;
+  *stats = (struct http_pool_stats_s){ };
+  for (int i = 0; i < HS_POOL_CLASSES; i++) {
+    stats->free_buffers += pool->free_count[i];
+    stats->free_bytes += (int64_t)pool->free_count[i] * hs_pool_class_size(i);
+  }
+  stats->used_buffers = pool->used_buffers;
+  stats->used_bytes = pool->used_bytes;
+  stats->hits = pool->hits;
+  stats->misses = pool->misses;
+}
+
 void http_server_set_userdata(struct http_server_s* serv, void* data) {
   serv->data = data;
 }
 
-void http_listen(http_server_t* serv, const char* ipaddr) {
+// Starts accepting on serv->socket, which is bound already.
+void hs_listen_socket(http_server_t* serv) {
   // Ignore SIGPIPE. We handle these errors at the call site.
   signal(SIGPIPE, SIG_IGN);
+  int flags = fcntl(serv->socket, F_GETFL, 0);
+  fcntl(serv->socket, F_SETFL, flags | O_NONBLOCK);
+  listen(serv->socket, 128);
+  hs_add_server_sock_events(serv);
+}
+
+void http_listen(http_server_t* serv, const char* ipaddr) {
   serv->socket = socket(AF_INET, SOCK_STREAM, 0);
   int flag = 1;
   setsockopt(serv->socket, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
   hs_bind_localhost(serv->socket, &serv->addr, ipaddr, serv->port);
   serv->len = sizeof(serv->addr);
-  int flags = fcntl(serv->socket, F_GETFL, 0);
-  fcntl(serv->socket, F_SETFL, flags | O_NONBLOCK);
-  listen(serv->socket, 128);
-  hs_add_server_sock_events(serv);
+  hs_listen_socket(serv);
 }
 
-int http_server_listen_addr_poll(http_server_t* serv, const char* ipaddr) {
-  http_listen(serv, ipaddr);
-  return 0;
+void http_listen_unix(http_server_t* serv, const char* path, int mode) {
+  struct sockaddr_un addr = { };
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) exit(1);
+  strcpy(addr.sun_path, path);
+  serv->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (bind(serv->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) exit(1);
+  chmod(path, mode);
+  hs_listen_socket(serv);
 }
 
-int http_server_listen_poll(http_server_t* serv) {
-  return http_server_listen_addr_poll(serv, NULL);
+int http_server_socket(http_server_t* serv) {
+  return serv->socket;
+}
+
+void hs_drain_session(http_request_t* session) {
+  if (session->state == HTTP_SESSION_H2) {
+    hs_h2_drain(session);
+  } else if (session->state == HTTP_SESSION_INIT) {
+    hs_reset_timeout(session, HS_DRAIN_IDLE);
+  }
+}
+
+void http_server_drain(http_server_t* serv, int seconds) {
+  if (serv->drain_until) return;
+  serv->drain_until = serv->wheel.now + (seconds < 1 ? 1 : seconds);
+  if (serv->socket >= 0) {
+    // Another process may hold the socket too, so it has to come out of the
+    // loop before it's closed.
+    hs_delete_server_sock_events(serv);
+    close(serv->socket);
+    serv->socket = -1;
+  }
+  hs_server_each(serv, hs_drain_session);
+}
+
+int http_server_listen_addr_poll(http_server_t* serv, const char* ipaddr) {
+  http_listen(serv, ipaddr);
+  return 0;
+}
+
+int http_server_listen_poll(http_server_t* serv) {
+  return http_server_listen_addr_poll(serv, NULL);
 }
 
 int http_server_loop(http_server_t* server) {
@@ -1246,9 +3362,26 @@ int http_server_loop(http_server_t* server) {
 
 // *** http request ***
 
+http_string_t hs_token_string(http_request_t* request, int i) {
+  if (i < 0) return (http_string_t) { };
+  http_token_t token = request->tokens.buf[i];
+  return (http_string_t) {
+    .buf = &request->stream.buf[token.index],
+    .len = token.len
+  };
+}
+
 http_string_t http_get_token_string(http_request_t* request, int token_type) {
   http_string_t str = {0, 0};
   if (request->tokens.buf == NULL) return str;
+  if (request->index.built) {
+    switch (token_type) {
+      case HS_TOK_METHOD: return hs_token_string(request, request->index.method);
+      case HS_TOK_TARGET: return hs_token_string(request, request->index.target);
+      case HS_TOK_VERSION: return hs_token_string(request, request->index.version);
+      case HS_TOK_BODY: return hs_token_string(request, request->index.body);
+    }
+  }
   for (int i = 0; i < request->tokens.size; i++) {
     http_token_t token = request->tokens.buf[i];
     if (token.type == token_type) {
@@ -1326,8 +3459,103 @@ int http_request_iterate_headers(
   }
 }
 
-http_string_t http_request_header(http_request_t* request, char const * key) {
-  int len = strlen(key);
+#define HS_LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+
+// Cheap hash of a header name: the length and a handful of case folded bytes
+// from the start, middle and end, mixed with a multiplicative step. Names are
+// short and the table is compared on every hit, so spreading the names out
+// matters more than hashing every byte.
+uint32_t hs_header_hash(char const * s, int len) {
+  if (len == 0) return 0;
+  uint32_t h = len;
+  h = h * 31 + HS_LOWER(s[0]);
+  h = h * 31 + HS_LOWER(s[len >> 1]);
+  h = h * 31 + HS_LOWER(s[len - 1]);
+  if (len > 1) h = h * 31 + HS_LOWER(s[len - 2]);
+  h *= 2654435761u;
+  return h ^ (h >> 16);
+}
+
+static char const * hs_known_headers[HTTP_HDR_KNOWN_COUNT] = {
+  "Host", "Content-Length", "Accept-Encoding", "If-None-Match", "Range",
+  "Connection"
+};
+
+// The well known header names all have different lengths so the length alone
+// picks the one candidate to compare against.
+int hs_known_header_id(char const * key, int len) {
+  int id;
+  switch (len) {
+    case 4: id = HTTP_HDR_HOST; break;
+    case 14: id = HTTP_HDR_CONTENT_LENGTH; break;
+    case 15: id = HTTP_HDR_ACCEPT_ENCODING; break;
+    case 13: id = HTTP_HDR_IF_NONE_MATCH; break;
+    case 5: id = HTTP_HDR_RANGE; break;
+    case 10: id = HTTP_HDR_CONNECTION; break;
+    default: return -1;
+  }
+  return hs_case_insensitive_cmp(key, hs_known_headers[id], len) ? id : -1;
+}
+
+// Single pass over the tokens once the header block is complete. Records the
+// request line, the body and the well known headers. The hash table for
+// arbitrary names is left for hs_build_header_table.
+void hs_build_header_index(http_request_t* request) {
+  hs_header_index_t* index = &request->index;
+  index->method = index->target = index->version = index->body = -1;
+  for (int k = 0; k < HTTP_HDR_KNOWN_COUNT; k++) index->known[k] = -1;
+  index->slots = NULL;
+  index->headers = 0;
+  for (int i = 0; i < request->tokens.size; i++) {
+    http_token_t token = request->tokens.buf[i];
+    switch (token.type) {
+      case HS_TOK_HEADER_KEY: {
+        index->headers++;
+        if (i + 1 >= request->tokens.size) break;
+        int id = hs_known_header_id(&request->stream.buf[token.index], token.len);
+        if (id >= 0 && index->known[id] < 0) index->known[id] = i + 1;
+        break;
+      }
+      case HS_TOK_METHOD: if (index->method < 0) index->method = i; break;
+      case HS_TOK_TARGET: if (index->target < 0) index->target = i; break;
+      case HS_TOK_VERSION: if (index->version < 0) index->version = i; break;
+      case HS_TOK_BODY: if (index->body < 0) index->body = i; break;
+    }
+  }
+  index->built = 1;
+}
+
+void hs_build_header_table(http_request_t* request) {
+  hs_header_index_t* index = &request->index;
+  int size = 8;
+  while (size < index->headers * 2) size <<= 1;
+  index->slots = (hs_header_slot_t*)hs_arena_alloc(
+    &request->arena, size * sizeof(hs_header_slot_t)
+  );
+  for (int j = 0; j < size; j++) index->slots[j].token = -1;
+  index->mask = size - 1;
+  for (int i = 0; i + 1 < request->tokens.size; i++) {
+    http_token_t token = request->tokens.buf[i];
+    if (token.type != HS_TOK_HEADER_KEY) continue;
+    char const * key = &request->stream.buf[token.index];
+    uint32_t hash = hs_header_hash(key, token.len);
+    int j = hash & index->mask;
+    int dup = 0;
+    for ( ; index->slots[j].token >= 0; j = (j + 1) & index->mask) {
+      http_token_t other = request->tokens.buf[index->slots[j].token];
+      if (
+        index->slots[j].hash == hash && other.len == token.len &&
+        hs_case_insensitive_cmp(&request->stream.buf[other.index], key, token.len)
+      ) {
+        dup = 1;
+        break;
+      }
+    }
+    if (!dup) index->slots[j] = (hs_header_slot_t) { .hash = hash, .token = i };
+  }
+}
+
+http_string_t hs_request_header_scan(http_request_t* request, char const * key, int len) {
   for (int i = 0; i < request->tokens.size; i++) {
     http_token_t token = request->tokens.buf[i];
     if (token.type == HS_TOK_HEADER_KEY && token.len == len) {
@@ -1340,222 +3568,1988 @@ http_string_t http_request_header(http_request_t* request, char const * key) {
       }
     }
   }
-  return (http_string_t) { };
+  return (http_string_t) { };
+}
+
+http_string_t http_request_header(http_request_t* request, char const * key) {
+  int len = strlen(key);
+  hs_header_index_t* index = &request->index;
+  if (index->built) {
+    int id = hs_known_header_id(key, len);
+    if (id >= 0) return hs_token_string(request, index->known[id]);
+  }
+  if (!index->built || index->headers <= HTTP_HEADER_INDEX_MIN) {
+    return hs_request_header_scan(request, key, len);
+  }
+  if (index->slots == NULL) hs_build_header_table(request);
+  uint32_t hash = hs_header_hash(key, len);
+  for (
+    int j = hash & index->mask;
+    index->slots[j].token >= 0;
+    j = (j + 1) & index->mask
+  ) {
+    if (index->slots[j].hash != hash) continue;
+    http_token_t token = request->tokens.buf[index->slots[j].token];
+    if (
+      token.len == len &&
+      hs_case_insensitive_cmp(&request->stream.buf[token.index], key, len)
+    ) {
+      return hs_token_string(request, index->slots[j].token + 1);
+    }
+  }
+  return (http_string_t) { };
+}
+
+http_string_t http_request_known_header(http_request_t* request, int header) {
+  if (header < 0 || header >= HTTP_HDR_KNOWN_COUNT) return (http_string_t) { };
+  if (!request->index.built) return http_request_header(request, hs_known_headers[header]);
+  return hs_token_string(request, request->index.known[header]);
+}
+
+void http_request_free_buffer(http_request_t* request) {
+  hs_free_buffer(request);
+}
+
+int http_request_peer(http_request_t* request, char* buf, int size) {
+  hs_peer_t* peer = &request->peer;
+  if (peer->family == AF_UNSPEC) {
+    if (size < (int)sizeof("unknown")) return -1;
+    memcpy(buf, "unknown", sizeof("unknown"));
+  } else if (inet_ntop(peer->family, peer->addr, buf, size) == NULL) {
+    return -1;
+  }
+  return strlen(buf);
+}
+
+void* http_request_alloc(http_request_t* request, int size) {
+  return hs_arena_alloc(&request->arena, size);
+}
+
+char* http_request_strdup(http_request_t* request, http_string_t str) {
+  char* s = (char*)hs_arena_alloc(&request->arena, str.len + 1);
+  if (str.len > 0) memcpy(s, str.buf, str.len);
+  s[str.len] = '\0';
+  return s;
+}
+
+void* http_request_userdata(http_request_t* request) {
+  return request->data;
+}
+
+void http_request_set_userdata(http_request_t* request, void* data) {
+  request->data = data;
+}
+
+void* http_request_server_userdata(struct http_request_s* request) {
+  return request->server->data;
+}
+
+void hs_auto_detect_keep_alive(http_request_t* request) {
+  http_string_t str = http_get_token_string(request, HS_TOK_VERSION);
+  if (str.buf == NULL) return;
+  int version = str.buf[str.len - 1] == '1';
+  str = http_request_known_header(request, HTTP_HDR_CONNECTION);
+  if (
+    (str.len == 5 && hs_case_insensitive_cmp(str.buf, "close", 5)) ||
+    (str.len == 0 && version == HTTP_1_0)
+  ) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+  } else {
+    HTTP_FLAG_SET(request->flags, HTTP_KEEP_ALIVE);
+  }
+}
+
+void http_request_connection(http_request_t* request, int directive) {
+  if (directive == HTTP_KEEP_ALIVE) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_AUTOMATIC);
+    HTTP_FLAG_SET(request->flags, HTTP_KEEP_ALIVE);
+  } else if (directive == HTTP_CLOSE) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_AUTOMATIC);
+    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+  }
+}
+
+http_string_t http_request_chunk(struct http_request_s* request) {
+  http_token_t token = request->tokens.buf[request->tokens.size - 1];
+  return (http_string_t) {
+    .buf = &request->stream.buf[token.index],
+    .len = token.len
+  };
+}
+
+// *** http response ***
+
+// Responses are recycled through a small per thread free list rather than
+// going back to malloc for every request.
+static HS_THREAD_LOCAL http_response_t* hs_response_free_list = NULL;
+static HS_THREAD_LOCAL int hs_response_free_count = 0;
+
+http_response_t* http_response_init() {
+  http_response_t* response = hs_response_free_list;
+  if (response) {
+    hs_response_free_list = response->next_free;
+    hs_response_free_count--;
+    memset(response, 0, sizeof(http_response_t));
+  } else {
+    response = (http_response_t*)calloc(1, sizeof(http_response_t));
+    assert(response != NULL);
+  }
+  response->status = 200;
+  return response;
+}
+
+void hs_response_free(http_response_t* response) {
+  http_header_t* header = response->headers;
+  while (header) {
+    http_header_t* tmp = header;
+    header = tmp->next;
+    int inlined = tmp >= response->inline_headers &&
+      tmp < response->inline_headers + HTTP_RESPONSE_INLINE_HEADERS;
+    if (!inlined) free(tmp);
+  }
+  if (hs_response_free_count >= HTTP_RESPONSE_FREE_MAX) {
+    free(response);
+    return;
+  }
+  response->next_free = hs_response_free_list;
+  hs_response_free_list = response;
+  hs_response_free_count++;
+}
+
+void http_response_header(http_response_t* response, char const * key, char const * value) {
+  http_header_t* header;
+  if (response->header_count < HTTP_RESPONSE_INLINE_HEADERS) {
+    header = &response->inline_headers[response->header_count];
+  } else {
+    header = (http_header_t*)malloc(sizeof(http_header_t));
+    assert(header != NULL);
+  }
+  response->header_count++;
+  header->key = key;
+  header->value = value;
+  http_header_t* prev = response->headers;
+  header->next = prev;
+  response->headers = header;
+}
+
+void http_response_status(http_response_t* response, int status) {
+  response->status = status > 599 || status < 100 ? 500 : status;
+}
+
+void http_response_body(http_response_t* response, char const * body, int length) {
+  response->body = body;
+  response->content_length = length;
+  response->release = NULL;
+  response->owned = 0;
+}
+
+void http_response_body_owned(
+  http_response_t* response,
+  char const * body,
+  int length,
+  void (*release)(void*)
+) {
+  response->body = body;
+  response->content_length = length;
+  response->release = release;
+  response->owned = 1;
+}
+
+void http_response_length(http_response_t* response, int length) {
+  response->body = NULL;
+  response->content_length = length;
+  response->release = NULL;
+  response->owned = 0;
+}
+
+typedef struct {
+  char* buf;
+  int capacity;
+  int size;
+  hs_pool_t* pool;
+  int64_t* memused;
+} grwprintf_t;
+
+// The buffer comes from the pool since it ends up as the request's stream
+// buffer, and is returned there by hs_free_buffer. Growing it with realloc
+// takes it out of its size class, and hs_pool_put frees it instead.
+void grwprintf_init(grwprintf_t* ctx, int capacity, hs_pool_t* pool, int64_t* memused) {
+  ctx->memused = memused;
+  ctx->pool = pool;
+  ctx->size = 0;
+  ctx->buf = hs_pool_get(pool, capacity, &ctx->capacity);
+  *ctx->memused += ctx->capacity;
+}
+
+void grwresize(grwprintf_t* ctx, int capacity) {
+  *ctx->memused += capacity - ctx->capacity;
+  ctx->pool->used_bytes += capacity - ctx->capacity;
+  ctx->capacity = capacity;
+  ctx->buf = (char*)realloc(ctx->buf, ctx->capacity);
+  assert(ctx->buf != NULL);
+}
+
+// Grows at least twofold so that building a response out of many small
+// copies doesn't realloc for each one.
+void grwmemcpy(grwprintf_t* ctx, char const * src, int size) {
+  if (ctx->size + size > ctx->capacity) {
+    int capacity = ctx->capacity * 2;
+    if (capacity < ctx->size + size) capacity = ctx->size + size;
+    grwresize(ctx, capacity);
+  }
+  memcpy(ctx->buf + ctx->size, src, size);
+  ctx->size += size;
+}
+
+void grwprintf(grwprintf_t* ctx, char const * fmt, ...) {
+  va_list args, retry;
+  va_start(args, fmt);
+  va_copy(retry, args);
+
+  // vsnprintf needs room for the terminator too, or it truncates the output
+  int bytes = vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
+  if (bytes + ctx->size >= ctx->capacity) {
+    int capacity = ctx->capacity;
+    while (bytes + ctx->size >= capacity) capacity *= 2;
+    grwresize(ctx, capacity);
+    bytes = vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, retry);
+  }
+  ctx->size += bytes;
+
+  va_end(retry);
+  va_end(args);
+}
+
+// Writes the decimal digits of value to buf, returns how many there were.
+int hs_format_int(char* buf, int64_t value) {
+  char tmp[24];
+  int n = 0, len = 0;
+  uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (value < 0) buf[len++] = '-';
+  while (n) buf[len++] = tmp[--n];
+  return len;
+}
+
+// Serializes one header line. The header values are copied as they are, there
+// is no formatting to be done.
+void hs_buffer_header(grwprintf_t* printctx, char const * key, int key_len, char const * value, int value_len) {
+  if (printctx->size + key_len + value_len + 4 > printctx->capacity) {
+    grwmemcpy(printctx, key, key_len);
+    grwmemcpy(printctx, ": ", 2);
+    grwmemcpy(printctx, value, value_len);
+    grwmemcpy(printctx, "\r\n", 2);
+    return;
+  }
+  char* p = printctx->buf + printctx->size;
+  memcpy(p, key, key_len);
+  p += key_len;
+  *p++ = ':';
+  *p++ = ' ';
+  memcpy(p, value, value_len);
+  p += value_len;
+  *p++ = '\r';
+  *p++ = '\n';
+  printctx->size = p - printctx->buf;
+}
+
+void http_buffer_headers(
+  http_request_t* request,
+  http_response_t* response,
+  grwprintf_t* printctx
+) {
+  http_header_t* header = response->headers;
+  while (header) {
+    hs_buffer_header(
+      printctx, header->key, strlen(header->key), header->value, strlen(header->value)
+    );
+    header = header->next;
+  }
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
+    char length[24];
+    int n = hs_format_int(length, response->content_length);
+    hs_buffer_header(printctx, "Content-Length", 14, length, n);
+  }
+  grwmemcpy(printctx, "\r\n", 2);
+}
+
+// Writes the status line up to where the Date value goes.
+void hs_buffer_status_line(grwprintf_t* printctx, int status) {
+  char const * text = hs_status_text[status];
+  char code[4] = { '0' + status / 100, '0' + status / 10 % 10, '0' + status % 10, ' ' };
+  grwmemcpy(printctx, "HTTP/1.1 ", 9);
+  grwmemcpy(printctx, code, 4);
+  grwmemcpy(printctx, text, strlen(text));
+  grwmemcpy(printctx, "\r\nDate: ", 8);
+}
+
+void http_respond_headers(
+  http_request_t* request,
+  http_response_t* response,
+  grwprintf_t* printctx
+) {
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_AUTOMATIC)) {
+    hs_auto_detect_keep_alive(request);
+  }
+  if (request->server->drain_until) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+  }
+  http_template_t* tmpl = response->tmpl;
+  if (tmpl && tmpl->status == response->status) {
+    grwmemcpy(printctx, tmpl->block, tmpl->date_at);
+  } else {
+    hs_buffer_status_line(printctx, response->status);
+  }
+  grwmemcpy(printctx, request->server->date, strlen(request->server->date));
+  if (tmpl) {
+    grwmemcpy(printctx, tmpl->block + tmpl->date_at, tmpl->length - tmpl->date_at);
+  } else {
+    grwmemcpy(printctx, "\r\n", 2);
+  }
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE)) {
+    grwmemcpy(printctx, "Connection: keep-alive\r\n", 24);
+  } else {
+    grwmemcpy(printctx, "Connection: close\r\n", 19);
+  }
+  http_buffer_headers(request, response, printctx);
+}
+
+// *** response templates ***
+
+void hs_template_append(http_template_t* tmpl, char const * src, int size) {
+  if (tmpl->length + size > tmpl->capacity) {
+    while (tmpl->length + size > tmpl->capacity) tmpl->capacity *= 2;
+    tmpl->block = (char*)realloc(tmpl->block, tmpl->capacity);
+    assert(tmpl->block != NULL);
+  }
+  memcpy(tmpl->block + tmpl->length, src, size);
+  tmpl->length += size;
+}
+
+http_template_t* http_template_init(int status) {
+  http_template_t* tmpl = (http_template_t*)calloc(1, sizeof(http_template_t));
+  assert(tmpl != NULL);
+  tmpl->status = status > 599 || status < 100 ? 500 : status;
+  tmpl->capacity = 256;
+  tmpl->block = (char*)malloc(tmpl->capacity);
+  assert(tmpl->block != NULL);
+  tmpl->tail = &tmpl->headers;
+  grwprintf_t printctx = { .buf = tmpl->block, .capacity = tmpl->capacity };
+  hs_buffer_status_line(&printctx, tmpl->status);
+  tmpl->length = tmpl->date_at = printctx.size;
+  hs_template_append(tmpl, "\r\n", 2);
+  return tmpl;
+}
+
+void http_template_header(http_template_t* tmpl, char const * key, char const * value) {
+  int key_len = strlen(key), value_len = strlen(value);
+  http_header_t* header = (http_header_t*)malloc(sizeof(http_header_t) + key_len + value_len + 2);
+  assert(header != NULL);
+  char* copy = (char*)(header + 1);
+  memcpy(copy, key, key_len + 1);
+  memcpy(copy + key_len + 1, value, value_len + 1);
+  header->key = copy;
+  header->value = copy + key_len + 1;
+  header->next = NULL;
+  *tmpl->tail = header;
+  tmpl->tail = &header->next;
+  hs_template_append(tmpl, key, key_len);
+  hs_template_append(tmpl, ": ", 2);
+  hs_template_append(tmpl, value, value_len);
+  hs_template_append(tmpl, "\r\n", 2);
+}
+
+void http_response_template(http_response_t* response, http_template_t* tmpl) {
+  response->tmpl = tmpl;
+  response->status = tmpl->status;
+}
+
+void http_template_free(http_template_t* tmpl) {
+  while (tmpl->headers) {
+    http_header_t* header = tmpl->headers;
+    tmpl->headers = header->next;
+    free(header);
+  }
+  free(tmpl->block);
+  free(tmpl);
+}
+
+// Queues the serialized headers as the next response to go out.
+hs_out_t* hs_out_push(http_request_t* request, grwprintf_t* printctx) {
+  hs_out_t* out = &request->out[request->out_count++];
+  *out = (hs_out_t){ };
+  out->head = printctx->buf;
+  out->head_length = printctx->size;
+  out->head_capacity = printctx->capacity;
+  return out;
+}
+
+// Whether to hold this response back and answer the next request in the
+// read buffer first.
+int hs_can_pipeline(http_request_t* request) {
+  return
+    HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE) &&
+    !HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE) &&
+    request->out_count < HTTP_PIPELINE_MAX &&
+    hs_stream_pending(request);
+}
+
+void http_end_response(http_request_t* request, http_response_t* response, grwprintf_t* printctx) {
+  hs_trace_respond(request, response);
+  hs_response_free(response);
+  hs_admit_release(request);
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
+    HTTP_FLAG_SET(request->flags, HTTP_RESPONDED);
+    // The trace goes with the last of the response.
+    request->out[request->out_count - 1].trace = request->trace;
+    request->trace = NULL;
+  }
+  if (hs_can_pipeline(request)) {
+    // The request is finished with but the application may still be using
+    // its arena, so the switch to the next request is left to
+    // hs_read_and_process_request.
+    request->state = HTTP_SESSION_READ;
+    hs_retain_bodies(request);
+  } else {
+    if (!hs_stream_pending(request)) hs_free_buffer(request);
+    request->state = HTTP_SESSION_WRITE;
+    hs_write_response(request);
+    hs_retain_bodies(request);
+  }
+  if (
+    request->state == HTTP_SESSION_READ &&
+    !HTTP_FLAG_CHECK(request->flags, HTTP_IN_READ)
+  ) {
+    // Responded from outside the request handler, so nothing else is going
+    // to look at the buffered requests.
+    hs_read_and_process_request(request);
+  }
+}
+
+void hs_static_body(void* body) {
+  (void)body;
+}
+
+// A HEAD request gets the headers a GET would have, Content-Length included,
+// and nothing after them.
+void hs_head_drop_body(http_request_t* request, http_response_t* response) {
+  if (!response->body) return;
+  http_string_t method = http_request_method(request);
+  if (method.len != 4 || memcmp(method.buf, "HEAD", 4) != 0) return;
+  if (response->owned && response->release) {
+    response->release((void*)response->body);
+  }
+  response->body = NULL;
+}
+
+void http_respond(http_request_t* request, http_response_t* response) {
+  hs_head_drop_body(request, response);
+  if (request->h2_conn) {
+    hs_h2_respond(request, response);
+    return;
+  }
+  grwprintf_t printctx;
+  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->pool, &request->server->memused);
+  http_respond_headers(request, response, &printctx);
+  hs_out_t* out = hs_out_push(request, &printctx);
+  if (response->body && response->content_length > 0) {
+    out->body = response->body;
+    out->body_length = response->content_length;
+    out->body_release = response->owned
+      ? (response->release ? response->release : hs_static_body)
+      : NULL;
+  } else if (response->body && response->owned && response->release) {
+    response->release((void*)response->body);
+  }
+  http_end_response(request, response, &printctx);
+}
+
+void http_respond_chunk(
+  http_request_t* request,
+  http_response_t* response,
+  void (*cb)(http_request_t*)
+) {
+  if (request->h2_conn) {
+    hs_h2_respond_chunk(request, response, cb);
+    return;
+  }
+  grwprintf_t printctx;
+  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->pool, &request->server->memused);
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
+    HTTP_FLAG_SET(request->flags, HTTP_CHUNKED_RESPONSE);
+    http_response_header(response, "Transfer-Encoding", "chunked");
+    http_respond_headers(request, response, &printctx);
+  }
+  request->chunk_cb = cb;
+  grwprintf(&printctx, "%X\r\n", response->content_length);
+  grwmemcpy(&printctx, response->body, response->content_length);
+  grwprintf(&printctx, "\r\n");
+  hs_out_push(request, &printctx);
+  http_end_response(request, response, &printctx);
+}
+
+void http_respond_chunk_end(http_request_t* request, http_response_t* response) {
+  if (request->h2_conn) {
+    hs_h2_respond_chunk_end(request, response);
+    return;
+  }
+  grwprintf_t printctx;
+  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->pool, &request->server->memused);
+  grwprintf(&printctx, "0\r\n");
+  http_buffer_headers(request, response, &printctx);
+  grwprintf(&printctx, "\r\n");
+  HTTP_FLAG_CLEAR(request->flags, HTTP_CHUNKED_RESPONSE);
+  hs_out_push(request, &printctx);
+  http_end_response(request, response, &printctx);
+}
+
+// *** http/2 ***
+
+// Cleartext HTTP/2 on top of the same connections. Each stream gets a
+// request of its own whose buffer holds the decoded header strings followed
+// by the body, with the same tokens the HTTP/1 parser would have produced, so
+// request handlers can't tell the difference. Responses are HPACK encoded
+// without the dynamic table or Huffman coding and sent as HEADERS and DATA
+// frames as the flow control windows allow.
+
+uint32_t hs_h2_get32(uint8_t const * p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void hs_h2_put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// *** hpack ***
+
+typedef struct {
+  char const * name;
+  char const * value;
+} hs_hpack_static_t;
+
+static hs_hpack_static_t const hs_hpack_static[] = {
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+  { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+  { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+  { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+  { "accept-ranges", "" }, { "accept", "" },
+  { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+  { "authorization", "" }, { "cache-control", "" },
+  { "content-disposition", "" }, { "content-encoding", "" },
+  { "content-language", "" }, { "content-length", "" },
+  { "content-location", "" }, { "content-range", "" },
+  { "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" },
+  { "expect", "" }, { "expires", "" }, { "from", "" }, { "host", "" },
+  { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+  { "if-range", "" }, { "if-unmodified-since", "" },
+  { "last-modified", "" }, { "link", "" }, { "location", "" },
+  { "max-forwards", "" }, { "proxy-authenticate", "" },
+  { "proxy-authorization", "" }, { "range", "" }, { "referer", "" },
+  { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+  { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" },
+  { "via", "" }, { "www-authenticate", "" }
+};
+
+#define HS_HPACK_STATIC_COUNT 61
+#define HS_HPACK_DATE 33
+#define HS_HPACK_CONTENT_LENGTH 28
+#define HS_HPACK_STATUS_200 8
+
+// Code lengths of the HPACK Huffman code (RFC 7541 appendix B), indexed by
+// symbol with EOS last. The code is canonical so the lengths are all it
+// takes to rebuild it.
+static uint8_t const hs_huffman_length[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+   6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+   5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+  13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+   7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+  15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+   6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+#define HS_HUFFMAN_EOS 256
+#define HS_HUFFMAN_MAX_LENGTH 30
+
+// Canonical decoding tables: for each code length the first code, how many
+// codes there are and where their symbols start in the sorted symbol list.
+static HS_THREAD_LOCAL uint32_t hs_huffman_first[HS_HUFFMAN_MAX_LENGTH + 1];
+static HS_THREAD_LOCAL uint16_t hs_huffman_count[HS_HUFFMAN_MAX_LENGTH + 1];
+static HS_THREAD_LOCAL uint16_t hs_huffman_offset[HS_HUFFMAN_MAX_LENGTH + 1];
+static HS_THREAD_LOCAL uint16_t hs_huffman_symbols[257];
+static HS_THREAD_LOCAL int hs_huffman_ready = 0;
+
+void hs_huffman_init() {
+  if (hs_huffman_ready) return;
+  for (int sym = 0; sym < 257; sym++) hs_huffman_count[hs_huffman_length[sym]]++;
+  uint32_t code = 0;
+  int offset = 0;
+  for (int len = 1; len <= HS_HUFFMAN_MAX_LENGTH; len++) {
+    code <<= 1;
+    hs_huffman_first[len] = code;
+    hs_huffman_offset[len] = offset;
+    code += hs_huffman_count[len];
+    offset += hs_huffman_count[len];
+  }
+  int next[HS_HUFFMAN_MAX_LENGTH + 1];
+  for (int len = 0; len <= HS_HUFFMAN_MAX_LENGTH; len++) next[len] = hs_huffman_offset[len];
+  for (int sym = 0; sym < 257; sym++) {
+    hs_huffman_symbols[next[hs_huffman_length[sym]]++] = sym;
+  }
+  hs_huffman_ready = 1;
+}
+
+// Decodes len bytes of Huffman coded string into dst, which must have room
+// for len * 8 / 5 bytes, the most the shortest codes can expand to. Returns
+// the decoded length or -1 if the string is not validly coded.
+int hs_huffman_decode(uint8_t const * src, int len, char* dst) {
+  hs_huffman_init();
+  uint32_t code = 0;
+  int bits = 0, n = 0;
+  for (int i = 0; i < len; i++) {
+    for (int b = 7; b >= 0; b--) {
+      code = code << 1 | ((src[i] >> b) & 1);
+      bits++;
+      if (code - hs_huffman_first[bits] < hs_huffman_count[bits]) {
+        int sym = hs_huffman_symbols[hs_huffman_offset[bits] + code - hs_huffman_first[bits]];
+        if (sym == HS_HUFFMAN_EOS) return -1;
+        dst[n++] = sym;
+        code = 0;
+        bits = 0;
+      } else if (bits == HS_HUFFMAN_MAX_LENGTH) {
+        return -1;
+      }
+    }
+  }
+  // Padding is at most 7 bits of the start of EOS, which is all ones.
+  if (bits > 7 || code != (1u << bits) - 1) return -1;
+  return n;
+}
+
+int hs_hpack_int(uint8_t const ** p, uint8_t const * end, int prefix, uint32_t* value) {
+  if (*p >= end) return 0;
+  uint32_t max = (1u << prefix) - 1;
+  uint32_t v = **p & max;
+  (*p)++;
+  if (v == max) {
+    int shift = 0;
+    uint8_t b;
+    do {
+      if (*p >= end || shift > 21) return 0;
+      b = **p;
+      (*p)++;
+      v += (uint32_t)(b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+  }
+  *value = v;
+  return 1;
+}
+
+// Reads a string literal. Plain strings are used where they lie in the
+// header block, Huffman coded ones are decoded into the arena.
+int hs_hpack_string(uint8_t const ** p, uint8_t const * end, hs_arena_t* arena, http_string_t* str) {
+  if (*p >= end) return 0;
+  int huffman = **p & 0x80;
+  uint32_t len;
+  if (!hs_hpack_int(p, end, 7, &len) || len > (uint32_t)(end - *p)) return 0;
+  if (huffman) {
+    char* buf = (char*)hs_arena_alloc(arena, (int64_t)len * 8 / 5 + 1);
+    int n = hs_huffman_decode(*p, len, buf);
+    if (n < 0) return 0;
+    *str = (http_string_t) { .buf = buf, .len = n };
+  } else {
+    *str = (http_string_t) { .buf = (char const *)*p, .len = (int)len };
+  }
+  *p += len;
+  return 1;
+}
+
+void hs_hpack_evict(hs_hpack_table_t* table, int size) {
+  while (table->count > 0 && table->size > size) {
+    int last = (table->head + table->count - 1) % HS_HPACK_MAX_ENTRIES;
+    hs_hpack_entry_t* entry = &table->entries[last];
+    table->size -= entry->name_len + entry->value_len + 32;
+    free(entry->data);
+    entry->data = NULL;
+    table->count--;
+  }
+}
+
+// The name and value are copied before anything is evicted since they may
+// refer to an entry that is about to go.
+void hs_hpack_insert(hs_hpack_table_t* table, http_string_t name, http_string_t value) {
+  int size = name.len + value.len + 32;
+  if (size > table->max_size) {
+    hs_hpack_evict(table, 0);
+    return;
+  }
+  char* data = (char*)malloc(name.len + value.len + 1);
+  assert(data != NULL);
+  memcpy(data, name.buf, name.len);
+  memcpy(data + name.len, value.buf, value.len);
+  hs_hpack_evict(table, table->max_size - size);
+  table->head = (table->head + HS_HPACK_MAX_ENTRIES - 1) % HS_HPACK_MAX_ENTRIES;
+  table->entries[table->head] = (hs_hpack_entry_t) {
+    .data = data, .name_len = name.len, .value_len = value.len
+  };
+  table->count++;
+  table->size += size;
+}
+
+int hs_hpack_field(hs_hpack_table_t* table, uint32_t index, http_string_t* name, http_string_t* value) {
+  if (index == 0) return 0;
+  if (index <= HS_HPACK_STATIC_COUNT) {
+    hs_hpack_static_t const * field = &hs_hpack_static[index - 1];
+    *name = (http_string_t) { .buf = field->name, .len = (int)strlen(field->name) };
+    *value = (http_string_t) { .buf = field->value, .len = (int)strlen(field->value) };
+    return 1;
+  }
+  index -= HS_HPACK_STATIC_COUNT + 1;
+  if (index >= (uint32_t)table->count) return 0;
+  hs_hpack_entry_t* entry = &table->entries[(table->head + index) % HS_HPACK_MAX_ENTRIES];
+  *name = (http_string_t) { .buf = entry->data, .len = entry->name_len };
+  *value = (http_string_t) { .buf = entry->data + entry->name_len, .len = entry->value_len };
+  return 1;
+}
+
+void hs_h2_header(http_request_t* stream, http_string_t name, http_string_t value);
+
+// Decodes a complete header block, handing each field to the stream, which
+// may be NULL when the block only needs decoding to keep the dynamic table in
+// step. Returns 0 on a compression error.
+int hs_hpack_decode(
+  hs_hpack_table_t* table,
+  hs_arena_t* arena,
+  uint8_t const * p,
+  int len,
+  http_request_t* stream
+) {
+  uint8_t const * end = p + len;
+  int fields = 0;
+  while (p < end) {
+    http_string_t name, value;
+    uint32_t index;
+    int indexing = 0;
+    if (*p & 0x80) {
+      if (!hs_hpack_int(&p, end, 7, &index)) return 0;
+      if (!hs_hpack_field(table, index, &name, &value)) return 0;
+    } else if ((*p & 0xe0) == 0x20) {
+      // Dynamic table size updates only come at the start of a block.
+      if (fields > 0 || !hs_hpack_int(&p, end, 5, &index)) return 0;
+      if (index > HS_HPACK_TABLE_SIZE) return 0;
+      table->max_size = index;
+      hs_hpack_evict(table, index);
+      continue;
+    } else {
+      indexing = (*p & 0xc0) == 0x40;
+      if (!hs_hpack_int(&p, end, indexing ? 6 : 4, &index)) return 0;
+      if (index > 0) {
+        if (!hs_hpack_field(table, index, &name, &value)) return 0;
+      } else if (!hs_hpack_string(&p, end, arena, &name)) {
+        return 0;
+      }
+      if (!hs_hpack_string(&p, end, arena, &value)) return 0;
+    }
+    fields++;
+    hs_h2_header(stream, name, value);
+    if (indexing) hs_hpack_insert(table, name, value);
+  }
+  return 1;
+}
+
+uint8_t* hs_hpack_put_int(uint8_t* p, uint8_t first, int prefix, uint32_t v) {
+  uint32_t max = (1u << prefix) - 1;
+  if (v < max) {
+    *p++ = first | v;
+    return p;
+  }
+  *p++ = first | max;
+  v -= max;
+  while (v >= 128) {
+    *p++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+uint8_t* hs_hpack_put_string(uint8_t* p, char const * s, int len, int lower) {
+  p = hs_hpack_put_int(p, 0, 7, len);
+  for (int i = 0; i < len; i++) p[i] = lower ? HS_LOWER(s[i]) : s[i];
+  return p + len;
+}
+
+// Literal header field without indexing, with the name from the static table.
+uint8_t* hs_hpack_put_indexed_name(uint8_t* p, int index, char const * value, int len) {
+  p = hs_hpack_put_int(p, 0, 4, index);
+  return hs_hpack_put_string(p, value, len, 0);
+}
+
+// *** frames ***
+
+// Makes room for size more bytes of output, reusing the space in front of
+// what is still waiting to be written.
+void hs_h2_reserve(http_request_t* conn, int64_t size) {
+  hs_h2_t* h2 = conn->h2;
+  if (h2->out_written == h2->out_length) {
+    h2->out_written = h2->out_length = 0;
+  }
+  if (h2->out_length + size <= h2->out_capacity) return;
+  if (h2->out_written > 0) {
+    h2->out_length -= h2->out_written;
+    memmove(h2->out, h2->out + h2->out_written, h2->out_length);
+    h2->out_written = 0;
+    if (h2->out_length + size <= h2->out_capacity) return;
+  }
+  int64_t capacity = h2->out_capacity ? h2->out_capacity : HTTP_REQUEST_BUF_SIZE * 4;
+  while (capacity < h2->out_length + size) capacity *= 2;
+  conn->server->memused += capacity - h2->out_capacity;
+  h2->out = (char*)realloc(h2->out, capacity);
+  assert(h2->out != NULL);
+  h2->out_capacity = capacity;
+}
+
+// Queues a frame header and returns where its payload goes.
+uint8_t* hs_h2_frame(http_request_t* conn, int length, int type, int flags, int32_t id) {
+  hs_h2_reserve(conn, HS_H2_FRAME_HEADER + length);
+  hs_h2_t* h2 = conn->h2;
+  uint8_t* p = (uint8_t*)h2->out + h2->out_length;
+  p[0] = length >> 16;
+  p[1] = length >> 8;
+  p[2] = length;
+  p[3] = type;
+  p[4] = flags;
+  hs_h2_put32(p + 5, id & 0x7fffffff);
+  h2->out_length += HS_H2_FRAME_HEADER + length;
+  return p + HS_H2_FRAME_HEADER;
+}
+
+void hs_h2_rst_stream(http_request_t* conn, int32_t id, uint32_t code) {
+  hs_h2_put32(hs_h2_frame(conn, 4, HS_H2_RST_STREAM, 0, id), code);
+}
+
+void hs_h2_window_update(http_request_t* conn, int32_t id, uint32_t increment) {
+  hs_h2_put32(hs_h2_frame(conn, 4, HS_H2_WINDOW_UPDATE, 0, id), increment);
+}
+
+// Connection errors: tell the client why and hang up once that's written.
+void hs_h2_goaway(http_request_t* conn, uint32_t code) {
+  hs_h2_t* h2 = conn->h2;
+  if (h2->closing == HS_H2_ABORT) return;
+  uint8_t* p = hs_h2_frame(conn, 8, HS_H2_GOAWAY, 0, 0);
+  hs_h2_put32(p, h2->last_stream);
+  hs_h2_put32(p + 4, code);
+  h2->closing = HS_H2_ABORT;
+  for (http_request_t* stream = h2->streams; stream; stream = stream->h2_next) {
+    if (!HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DONE)) hs_trace_reset(stream, code);
+  }
+}
+
+void hs_h2_send_settings(http_request_t* conn) {
+  uint8_t* p = hs_h2_frame(conn, 12, HS_H2_SETTINGS, 0, 0);
+  p[0] = 0;
+  p[1] = HS_H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  hs_h2_put32(p + 2, HTTP_H2_MAX_STREAMS);
+  p[6] = 0;
+  p[7] = HS_H2_SETTINGS_ENABLE_PUSH;
+  hs_h2_put32(p + 8, 0);
+}
+
+// Applies a SETTINGS payload. Returns an error code, or 0.
+uint32_t hs_h2_settings(http_request_t* conn, uint8_t const * p, int len) {
+  hs_h2_t* h2 = conn->h2;
+  for (int i = 0; i + 6 <= len; i += 6) {
+    int id = p[i] << 8 | p[i + 1];
+    uint32_t value = hs_h2_get32(p + i + 2);
+    switch (id) {
+      case HS_H2_SETTINGS_ENABLE_PUSH:
+        if (value > 1) return HS_H2_PROTOCOL_ERROR;
+        break;
+      case HS_H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+        if (value > HS_H2_MAX_WINDOW) return HS_H2_FLOW_CONTROL_ERROR;
+        int64_t delta = (int64_t)value - h2->peer_window;
+        for (http_request_t* stream = h2->streams; stream; stream = stream->h2_next) {
+          stream->h2_window += delta;
+        }
+        h2->peer_window = value;
+        break;
+      }
+      case HS_H2_SETTINGS_MAX_FRAME_SIZE:
+        if (value < HS_H2_DEFAULT_FRAME || value > 0xffffff) return HS_H2_PROTOCOL_ERROR;
+        h2->peer_frame = value;
+        break;
+    }
+  }
+  return 0;
+}
+
+// *** streams ***
+
+http_request_t* hs_h2_find(hs_h2_t* h2, int32_t id) {
+  for (http_request_t* stream = h2->streams; stream; stream = stream->h2_next) {
+    if (stream->h2_id == id) {
+      return HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DONE) ? NULL : stream;
+    }
+  }
+  return NULL;
+}
+
+// Appends to the stream's buffer, returning where the bytes went or -1 if the
+// request has outgrown HTTP_MAX_REQUEST_BUF_SIZE.
+int hs_h2_append(http_request_t* stream, char const * buf, int len) {
+  hs_stream_t* in = &stream->stream;
+  http_server_t* server = stream->server;
+  int64_t need = (int64_t)in->length + len;
+  if (need > in->capacity) {
+    if (need > HTTP_MAX_REQUEST_BUF_SIZE) return -1;
+    int64_t size = in->capacity ? (int64_t)in->capacity * 4 : HTTP_REQUEST_BUF_SIZE;
+    if (size < need) size = need;
+    if (size > HTTP_MAX_REQUEST_BUF_SIZE) size = HTTP_MAX_REQUEST_BUF_SIZE;
+    int32_t capacity;
+    char* grown = hs_pool_get(&server->pool, size, &capacity);
+    if (in->buf) {
+      memcpy(grown, in->buf, in->length);
+      hs_pool_put(&server->pool, in->buf, in->capacity);
+    }
+    server->memused += capacity - in->capacity;
+    in->buf = grown;
+    in->capacity = capacity;
+  }
+  if (len > 0) memcpy(in->buf + in->length, buf, len);
+  int at = in->length;
+  in->length += len;
+  return at;
+}
+
+void hs_h2_push(http_request_t* stream, char const * buf, int len, int type) {
+  int at = hs_h2_append(stream, buf, len);
+  if (at < 0) {
+    HTTP_FLAG_SET(stream->h2_flags, HS_H2_MALFORMED);
+    return;
+  }
+  http_token_dyn_push(&stream->tokens, (http_token_t) { at, len, type });
+}
+
+http_request_t* hs_h2_stream_new(http_request_t* conn, int32_t id) {
+  hs_h2_t* h2 = conn->h2;
+  http_request_t* stream = h2->spare;
+  if (stream) {
+    h2->spare = stream->h2_next;
+    h2->spare_count--;
+    hs_arena_t arena = stream->arena;
+    memset(stream, 0, sizeof(http_request_t));
+    stream->arena = arena;
+  } else {
+    stream = (http_request_t*)calloc(1, sizeof(http_request_t));
+    assert(stream != NULL);
+  }
+  stream->server = conn->server;
+  stream->socket = conn->socket;
+  stream->h2_conn = conn;
+  stream->h2_id = id;
+  stream->h2_window = h2->peer_window;
+  stream->peer = conn->peer;
+  stream->state = HTTP_SESSION_READ;
+  hs_init_session(stream);
+  hs_trace_begin(stream);
+  HTTP_FLAG_CLEAR(stream->flags, HTTP_AUTOMATIC);
+  HTTP_FLAG_SET(stream->flags, HTTP_KEEP_ALIVE);
+  hs_h2_push(stream, "HTTP/2.0", 8, HS_TOK_VERSION);
+  http_request_t** link = &h2->streams;
+  while (*link) link = &(*link)->h2_next;
+  *link = stream;
+  h2->active++;
+  return stream;
+}
+
+// Turns a decoded header field into request tokens. Pseudo headers stand in
+// for the request line and :authority for the Host header.
+void hs_h2_header(http_request_t* stream, http_string_t name, http_string_t value) {
+  if (stream == NULL || HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_MALFORMED)) return;
+  if (name.len > 0 && name.buf[0] == ':') {
+    // Pseudo headers all come before the regular ones.
+    if (stream->parser.header_count > 0) {
+      HTTP_FLAG_SET(stream->h2_flags, HS_H2_MALFORMED);
+    } else if (name.len == 7 && memcmp(name.buf, ":method", 7) == 0) {
+      HTTP_FLAG_SET(stream->h2_flags, HS_H2_HAS_METHOD);
+      hs_h2_push(stream, value.buf, value.len, HS_TOK_METHOD);
+    } else if (name.len == 5 && memcmp(name.buf, ":path", 5) == 0) {
+      HTTP_FLAG_SET(stream->h2_flags, HS_H2_HAS_PATH);
+      hs_h2_push(stream, value.buf, value.len, HS_TOK_TARGET);
+    } else if (name.len == 10 && memcmp(name.buf, ":authority", 10) == 0) {
+      hs_h2_push(stream, "host", 4, HS_TOK_HEADER_KEY);
+      hs_h2_push(stream, value.buf, value.len, HS_TOK_HEADER_VAL);
+    } else if (!(name.len == 7 && memcmp(name.buf, ":scheme", 7) == 0)) {
+      HTTP_FLAG_SET(stream->h2_flags, HS_H2_MALFORMED);
+    }
+    return;
+  }
+  if (++stream->parser.header_count > HTTP_MAX_HEADER_COUNT) {
+    HTTP_FLAG_SET(stream->h2_flags, HS_H2_MALFORMED);
+    return;
+  }
+  hs_h2_push(stream, name.buf, name.len, HS_TOK_HEADER_KEY);
+  hs_h2_push(stream, value.buf, value.len, HS_TOK_HEADER_VAL);
+}
+
+// Hands connection window back to the client for DATA that is no longer
+// buffered.
+void hs_h2_credit(http_request_t* conn, int64_t bytes) {
+  if (bytes <= 0) return;
+  conn->h2->recv_window += bytes;
+  hs_h2_window_update(conn, 0, bytes);
+}
+
+// The stream is finished with: its response is all queued or it was reset.
+// It is freed by hs_h2_reap once the application can no longer be using it.
+void hs_h2_finish(http_request_t* stream) {
+  if (HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DONE)) return;
+  HTTP_FLAG_SET(stream->h2_flags, HS_H2_DONE);
+  hs_release_output(stream);
+  hs_admit_release(stream);
+  if (stream->trace) {
+    int written = HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_END_SENT) != 0;
+    hs_trace_end(stream->server, stream->trace, written);
+    stream->trace = NULL;
+  }
+  stream->h2_conn->h2->active--;
+  hs_h2_credit(stream->h2_conn, stream->h2_held);
+  stream->h2_held = 0;
+}
+
+// Finished streams, up to a full window of them, are kept on the connection
+// for the next ones to reuse along with their first arena block, rather than
+// handed back to malloc a window's worth at a time.
+void hs_h2_stream_free(http_request_t* stream) {
+  hs_release_output(stream);
+  hs_admit_release(stream);
+  hs_free_buffer(stream);
+  if (stream->trace) {
+    hs_trace_end(stream->server, stream->trace, 0);
+    stream->trace = NULL;
+  }
+  hs_h2_t* h2 = stream->h2_conn->h2;
+  if (h2 && h2->spare_count < HTTP_H2_MAX_STREAMS) {
+    hs_arena_reset(&stream->arena);
+    stream->h2_next = h2->spare;
+    h2->spare = stream;
+    h2->spare_count++;
+    return;
+  }
+  hs_arena_free(&stream->arena);
+  free(stream);
+}
+
+// Frees the finished streams. This only happens from the connection's own IO
+// handling, so like an HTTP/1 request a stream stays valid for the rest of
+// the handler that answered it.
+void hs_h2_reap(http_request_t* conn) {
+  http_request_t** link = &conn->h2->streams;
+  while (*link) {
+    http_request_t* stream = *link;
+    if (HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DONE)) {
+      *link = stream->h2_next;
+      hs_h2_stream_free(stream);
+    } else {
+      link = &stream->h2_next;
+    }
+  }
+}
+
+// The client reset the stream, or we did. A handler that is still working
+// on it gets to respond into the void.
+void hs_h2_cancel(http_request_t* stream) {
+  if (
+    HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DISPATCHED) &&
+    !HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_ANSWERED)
+  ) {
+    HTTP_FLAG_SET(stream->h2_flags, HS_H2_RESET);
+    return;
+  }
+  hs_h2_finish(stream);
+}
+
+void hs_h2_reset(http_request_t* conn, http_request_t* stream, uint32_t code) {
+  hs_h2_rst_stream(conn, stream->h2_id, code);
+  hs_trace_reset(stream, code);
+  hs_h2_cancel(stream);
+}
+
+// The request is complete, hand it to the application.
+void hs_h2_dispatch(http_request_t* stream) {
+  http_request_t* conn = stream->h2_conn;
+  int required = HS_H2_HAS_METHOD | HS_H2_HAS_PATH;
+  if (
+    HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_MALFORMED) ||
+    (stream->h2_flags & required) != required
+  ) {
+    hs_h2_reset(conn, stream, HS_H2_PROTOCOL_ERROR);
+    return;
+  }
+  hs_stream_t* in = &stream->stream;
+  http_token_dyn_push(
+    &stream->tokens,
+    (http_token_t) { in->index, in->length - in->index, HS_TOK_BODY }
+  );
+  HTTP_FLAG_SET(stream->h2_flags, HS_H2_DISPATCHED);
+  hs_trace_headers(stream);
+  hs_build_header_index(stream);
+  stream->state = HTTP_SESSION_NOP;
+  int64_t body = in->length - in->index;
+  int status = hs_admit(stream, body > 0, body);
+  if (status) {
+    hs_shed_response(stream, status, 1);
+    return;
+  }
+  hs_trace_handler(stream);
+  stream->server->requests++;
+  stream->server->request_handler(stream);
+}
+
+// *** frame handling ***
+
+// A complete header block for stream id. Blocks that don't open a new
+// stream are still decoded so the dynamic table stays in step with the
+// client's.
+void hs_h2_headers(http_request_t* conn, int32_t id, int flags, uint8_t const * block, int len) {
+  hs_h2_t* h2 = conn->h2;
+  http_request_t* stream = hs_h2_find(h2, id);
+  http_request_t* target = NULL;
+  int refused = 0;
+  if (stream == NULL && id > h2->last_stream) {
+    h2->last_stream = id;
+    if (h2->active < HTTP_H2_MAX_STREAMS && h2->closing == 0) {
+      stream = target = hs_h2_stream_new(conn, id);
+    } else {
+      refused = 1;
+    }
+  }
+  hs_arena_t* arena = target ? &target->arena : &conn->arena;
+  int ok = hs_hpack_decode(&h2->decoder, arena, block, len, target);
+  if (target == NULL) hs_arena_reset(&conn->arena);
+  if (!ok) {
+    hs_h2_goaway(conn, HS_H2_COMPRESSION_ERROR);
+    return;
+  }
+  if (refused) {
+    hs_h2_rst_stream(conn, id, HS_H2_REFUSED_STREAM);
+    return;
+  }
+  if (stream == NULL) {
+    hs_h2_rst_stream(conn, id, HS_H2_STREAM_CLOSED);
+    return;
+  }
+  if (target) {
+    // The body starts where the headers end.
+    stream->stream.index = stream->stream.length;
+  } else if (
+    HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DISPATCHED) ||
+    !(flags & HS_H2_END_STREAM)
+  ) {
+    // Trailers have to end the stream, anything else after the body is too
+    // late.
+    hs_h2_reset(conn, stream, HS_H2_STREAM_CLOSED);
+    return;
+  }
+  if (flags & HS_H2_END_STREAM) hs_h2_dispatch(stream);
+}
+
+int hs_h2_block_append(hs_h2_t* h2, uint8_t const * p, int len) {
+  if (h2->block_length + len > HS_H2_MAX_HEADER_BLOCK) return 0;
+  if (h2->block_length + len > h2->block_capacity) {
+    int capacity = h2->block_capacity ? h2->block_capacity : HS_H2_DEFAULT_FRAME;
+    while (capacity < h2->block_length + len) capacity *= 2;
+    h2->block = (char*)realloc(h2->block, capacity);
+    assert(h2->block != NULL);
+    h2->block_capacity = capacity;
+  }
+  memcpy(h2->block + h2->block_length, p, len);
+  h2->block_length += len;
+  return 1;
+}
+
+// Whether a handler has any of the connection's streams, and so will give
+// some of the window back when it answers.
+int hs_h2_answering(hs_h2_t* h2) {
+  for (http_request_t* stream = h2->streams; stream; stream = stream->h2_next) {
+    if ((stream->h2_flags & (HS_H2_DISPATCHED | HS_H2_DONE)) == HS_H2_DISPATCHED) return 1;
+  }
+  return 0;
+}
+
+void hs_h2_data(http_request_t* conn, int32_t id, int flags, uint8_t const * p, int len) {
+  hs_h2_t* h2 = conn->h2;
+  int length = len;
+  if (flags & HS_H2_PADDED) {
+    if (len < 1 || p[0] >= len) {
+      hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+      return;
+    }
+    length = len - 1 - p[0];
+    p++;
+  }
+  // The connection window only comes back as streams are answered, so a
+  // client can't have more than HTTP_H2_CONN_BUFFER buffered at once. The
+  // stream window is handed straight back, the body has to be buffered
+  // whole before the handler sees it.
+  h2->recv_window -= len;
+  if (h2->recv_window < 0) {
+    hs_h2_goaway(conn, HS_H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  // Padding isn't kept.
+  hs_h2_credit(conn, len - length);
+  http_request_t* stream = hs_h2_find(h2, id);
+  if (stream == NULL) {
+    hs_h2_credit(conn, length);
+    if (id > h2->last_stream) {
+      hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+    } else {
+      hs_h2_rst_stream(conn, id, HS_H2_STREAM_CLOSED);
+    }
+    return;
+  }
+  if (HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DISPATCHED)) {
+    hs_h2_credit(conn, length);
+    hs_h2_reset(conn, stream, HS_H2_STREAM_CLOSED);
+    return;
+  }
+  if (hs_h2_append(stream, (char const *)p, length) < 0) {
+    hs_h2_credit(conn, length);
+    HTTP_FLAG_SET(stream->h2_flags, HS_H2_DISPATCHED);
+    hs_error_response(stream, 413, "Payload Too Large");
+    return;
+  }
+  stream->h2_held += length;
+  if (flags & HS_H2_END_STREAM) {
+    hs_h2_dispatch(stream);
+    return;
+  }
+  if (len > 0) hs_h2_window_update(conn, id, len);
+  if (h2->recv_window < HS_H2_DEFAULT_FRAME && !hs_h2_answering(h2)) {
+    // The window is all held by bodies still on their way and none of them
+    // can finish. Turn this one away so the client can get the rest done.
+    hs_h2_reset(conn, stream, HS_H2_REFUSED_STREAM);
+  }
+}
+
+void hs_h2_window(http_request_t* conn, int32_t id, uint8_t const * p, int len) {
+  hs_h2_t* h2 = conn->h2;
+  if (len != 4) {
+    hs_h2_goaway(conn, HS_H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  uint32_t increment = hs_h2_get32(p) & 0x7fffffff;
+  if (id == 0) {
+    h2->send_window += increment;
+    if (increment == 0) {
+      hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+    } else if (h2->send_window > HS_H2_MAX_WINDOW) {
+      hs_h2_goaway(conn, HS_H2_FLOW_CONTROL_ERROR);
+    }
+    return;
+  }
+  http_request_t* stream = hs_h2_find(h2, id);
+  if (stream == NULL) return;
+  stream->h2_window += increment;
+  if (increment == 0) {
+    hs_h2_reset(conn, stream, HS_H2_PROTOCOL_ERROR);
+  } else if (stream->h2_window > HS_H2_MAX_WINDOW) {
+    hs_h2_reset(conn, stream, HS_H2_FLOW_CONTROL_ERROR);
+  }
+}
+
+void hs_h2_handle_frame(
+  http_request_t* conn,
+  int type,
+  int flags,
+  int32_t id,
+  uint8_t const * p,
+  int len
+) {
+  hs_h2_t* h2 = conn->h2;
+  if (h2->block_stream && type != HS_H2_CONTINUATION) {
+    hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+    return;
+  }
+  switch (type) {
+    case HS_H2_DATA:
+      if (id == 0) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+        return;
+      }
+      hs_h2_data(conn, id, flags, p, len);
+      break;
+    case HS_H2_HEADERS:
+      if (id == 0 || (id & 1) == 0) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (flags & HS_H2_PADDED) {
+        if (len < 1 || p[0] >= len) {
+          hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+          return;
+        }
+        len -= 1 + p[0];
+        p++;
+      }
+      if (flags & HS_H2_PRIORITY_FLAG) {
+        if (len < 5) {
+          hs_h2_goaway(conn, HS_H2_FRAME_SIZE_ERROR);
+          return;
+        }
+        p += 5;
+        len -= 5;
+      }
+      if (flags & HS_H2_END_HEADERS) {
+        hs_h2_headers(conn, id, flags, p, len);
+      } else {
+        h2->block_stream = id;
+        h2->block_flags = flags;
+        h2->block_length = 0;
+        if (!hs_h2_block_append(h2, p, len)) hs_h2_goaway(conn, HS_H2_ENHANCE_YOUR_CALM);
+      }
+      break;
+    case HS_H2_CONTINUATION:
+      if (id == 0 || id != h2->block_stream) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (!hs_h2_block_append(h2, p, len)) {
+        hs_h2_goaway(conn, HS_H2_ENHANCE_YOUR_CALM);
+        return;
+      }
+      if (flags & HS_H2_END_HEADERS) {
+        h2->block_stream = 0;
+        hs_h2_headers(conn, id, h2->block_flags, (uint8_t*)h2->block, h2->block_length);
+      }
+      break;
+    case HS_H2_PRIORITY:
+      // Streams are answered in the order their responses come in.
+      if (id == 0) hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+      break;
+    case HS_H2_RST_STREAM: {
+      if (id == 0) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (len != 4) {
+        hs_h2_goaway(conn, HS_H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      http_request_t* stream = hs_h2_find(h2, id);
+      if (stream) {
+        hs_h2_cancel(stream);
+      } else if (id > h2->last_stream) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+      }
+      break;
+    }
+    case HS_H2_SETTINGS: {
+      if (id != 0) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+        return;
+      }
+      if ((flags & HS_H2_ACK) ? len != 0 : len % 6 != 0) {
+        hs_h2_goaway(conn, HS_H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      if (flags & HS_H2_ACK) return;
+      uint32_t code = hs_h2_settings(conn, p, len);
+      if (code) {
+        hs_h2_goaway(conn, code);
+        return;
+      }
+      hs_h2_frame(conn, 0, HS_H2_SETTINGS, HS_H2_ACK, 0);
+      break;
+    }
+    case HS_H2_PUSH_PROMISE:
+      hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+      break;
+    case HS_H2_PING:
+      if (id != 0) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (len != 8) {
+        hs_h2_goaway(conn, HS_H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      if (!(flags & HS_H2_ACK)) {
+        memcpy(hs_h2_frame(conn, 8, HS_H2_PING, HS_H2_ACK, 0), p, 8);
+      }
+      break;
+    case HS_H2_GOAWAY:
+      if (id != 0) {
+        hs_h2_goaway(conn, HS_H2_PROTOCOL_ERROR);
+        return;
+      }
+      // Finish what's in flight, then close.
+      if (h2->closing == 0) h2->closing = HS_H2_DRAIN;
+      break;
+    case HS_H2_WINDOW_UPDATE:
+      hs_h2_window(conn, id, p, len);
+      break;
+  }
+}
+
+// Handles every complete frame in the read buffer and moves what's left of
+// a partial one to the front.
+void hs_h2_process(http_request_t* conn) {
+  hs_h2_t* h2 = conn->h2;
+  hs_stream_t* in = &conn->stream;
+  h2->need = 0;
+  while (h2->closing != HS_H2_ABORT) {
+    uint8_t const * p = (uint8_t const *)in->buf + in->index;
+    int avail = in->length - in->index;
+    if (h2->preface) {
+      if (avail < HS_H2_PREFACE_LEN) {
+        if (memcmp(p, HS_H2_PREFACE, avail) != 0) h2->closing = HS_H2_ABORT;
+        break;
+      }
+      if (memcmp(p, HS_H2_PREFACE, HS_H2_PREFACE_LEN) != 0) {
+        h2->closing = HS_H2_ABORT;
+        break;
+      }
+      in->index += HS_H2_PREFACE_LEN;
+      h2->preface = 0;
+      continue;
+    }
+    if (avail < HS_H2_FRAME_HEADER) break;
+    int len = p[0] << 16 | p[1] << 8 | p[2];
+    if (len > HS_H2_DEFAULT_FRAME) {
+      hs_h2_goaway(conn, HS_H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (avail < HS_H2_FRAME_HEADER + len) {
+      h2->need = HS_H2_FRAME_HEADER + len;
+      break;
+    }
+    in->index += HS_H2_FRAME_HEADER + len;
+    hs_h2_handle_frame(
+      conn, p[3], p[4], hs_h2_get32(p + 5) & 0x7fffffff, p + HS_H2_FRAME_HEADER, len
+    );
+  }
+  int left = in->length - in->index;
+  if (left > 0 && in->index > 0) memmove(in->buf, in->buf + in->index, left);
+  in->length = left;
+  in->index = 0;
+}
+
+// *** output ***
+
+// Turns response bodies into DATA frames, a frame per stream per round so
+// one large body doesn't hold up the rest, for as long as the flow control
+// windows allow and the output buffer isn't backed up. Streams that are
+// done are finished, chunked ones get asked for their next chunk.
+void hs_h2_schedule(http_request_t* conn) {
+  hs_h2_t* h2 = conn->h2;
+  if (h2->scheduling) return;
+  h2->scheduling = 1;
+  int progress = 1;
+  while (progress && h2->out_length - h2->out_written < HS_H2_OUT_HIGH) {
+    progress = 0;
+    for (http_request_t* stream = h2->streams; stream; stream = stream->h2_next) {
+      if (
+        !HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_ANSWERED) ||
+        HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_DONE)
+      ) continue;
+      hs_out_t* out = &stream->out[0];
+      int chunked = HTTP_FLAG_CHECK(stream->flags, HTTP_CHUNKED_RESPONSE);
+      int64_t left = stream->out_count ? out->body_length - stream->out_written : 0;
+      if (left > 0) {
+        int64_t n = left;
+        if (n > h2->peer_frame) n = h2->peer_frame;
+        if (n > h2->send_window) n = h2->send_window;
+        if (n > stream->h2_window) n = stream->h2_window;
+        if (n <= 0) continue;
+        int end = n == left && !chunked;
+        uint8_t* payload = hs_h2_frame(
+          conn, n, HS_H2_DATA, end ? HS_H2_END_STREAM : 0, stream->h2_id
+        );
+        memcpy(payload, out->body + stream->out_written, n);
+        stream->out_written += n;
+        stream->h2_window -= n;
+        h2->send_window -= n;
+        if (end) HTTP_FLAG_SET(stream->h2_flags, HS_H2_END_SENT);
+        progress = 1;
+        if (n < left) continue;
+      }
+      if (chunked) {
+        if (HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_CHUNK_WAIT)) continue;
+        hs_release_output(stream);
+        HTTP_FLAG_SET(stream->h2_flags, HS_H2_CHUNK_WAIT);
+        stream->chunk_cb(stream);
+        progress = 1;
+        continue;
+      }
+      if (!HTTP_FLAG_CHECK(stream->h2_flags, HS_H2_END_SENT)) {
+        hs_h2_frame(conn, 0, HS_H2_DATA, HS_H2_END_STREAM, stream->h2_id);
+        HTTP_FLAG_SET(stream->h2_flags, HS_H2_END_SENT);
+      }
+      hs_h2_finish(stream);
+      progress = 1;
+    }
+  }
+  h2->scheduling = 0;
 }
 
-void http_request_free_buffer(http_request_t* request) {
-  hs_free_buffer(request);
+// Writes out everything that's queued, scheduling more as the output
+// drains. If the socket fills up the rest waits for it to become writable.
+void hs_h2_send(http_request_t* conn) {
+  hs_h2_t* h2 = conn->h2;
+  for (;;) {
+    hs_h2_schedule(conn);
+    if (h2->out_written == h2->out_length) break;
+    ssize_t bytes = write(
+      conn->socket, h2->out + h2->out_written, h2->out_length - h2->out_written
+    );
+    if (bytes > 0) {
+      h2->out_written += bytes;
+    } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!HTTP_FLAG_CHECK(conn->flags, HTTP_WRITE_ARMED)) {
+        HTTP_FLAG_SET(conn->flags, HTTP_WRITE_ARMED);
+        hs_add_write_event(conn);
+      }
+      return;
+    } else {
+      HTTP_FLAG_SET(conn->flags, HTTP_END_SESSION);
+      return;
+    }
+  }
+  h2->out_written = h2->out_length = 0;
+  if (HTTP_FLAG_CHECK(conn->flags, HTTP_WRITE_ARMED)) {
+    HTTP_FLAG_CLEAR(conn->flags, HTTP_WRITE_ARMED);
+    hs_add_read_event(conn);
+  }
+  if (
+    h2->closing == HS_H2_ABORT ||
+    (h2->closing == HS_H2_DRAIN && h2->active == 0)
+  ) {
+    HTTP_FLAG_SET(conn->flags, HTTP_END_SESSION);
+  }
 }
 
-void* http_request_userdata(http_request_t* request) {
-  return request->data;
+// Called once a stream has queued something. Within the read loop the
+// output goes out in one go at the end; responses from anywhere else are
+// sent right away.
+void hs_h2_kick(http_request_t* stream) {
+  http_request_t* conn = stream->h2_conn;
+  hs_h2_schedule(conn);
+  // Whatever didn't fit in the windows is copied so the caller can free the
+  // body.
+  hs_retain_bodies(stream);
+  if (
+    HTTP_FLAG_CHECK(conn->flags, HTTP_IN_READ) ||
+    conn->h2->scheduling
+  ) return;
+  hs_h2_send(conn);
+  if (HTTP_FLAG_CHECK(conn->flags, HTTP_END_SESSION)) hs_end_session(conn);
 }
 
-void http_request_set_userdata(http_request_t* request, void* data) {
-  request->data = data;
+// Tells the client no new streams will be taken, then closes once the open
+// ones are answered.
+void hs_h2_drain(http_request_t* conn) {
+  hs_h2_t* h2 = conn->h2;
+  if (h2->closing) return;
+  uint8_t* p = hs_h2_frame(conn, 8, HS_H2_GOAWAY, 0, 0);
+  hs_h2_put32(p, h2->last_stream);
+  hs_h2_put32(p + 4, 0);
+  h2->closing = HS_H2_DRAIN;
+  if (HTTP_FLAG_CHECK(conn->flags, HTTP_IN_READ) || h2->scheduling) return;
+  hs_h2_send(conn);
+  if (HTTP_FLAG_CHECK(conn->flags, HTTP_END_SESSION)) hs_end_session(conn);
 }
 
-void* http_request_server_userdata(struct http_request_s* request) {
-  return request->server->data;
+int hs_h2_hop_header(char const * key, int len) {
+  switch (len) {
+    case 7: return hs_case_insensitive_cmp(key, "upgrade", 7);
+    case 10:
+      return
+        hs_case_insensitive_cmp(key, "connection", 10) ||
+        hs_case_insensitive_cmp(key, "keep-alive", 10);
+    case 16: return hs_case_insensitive_cmp(key, "proxy-connection", 16);
+    case 17: return hs_case_insensitive_cmp(key, "transfer-encoding", 17);
+  }
+  return 0;
 }
 
-void hs_auto_detect_keep_alive(http_request_t* request) {
-  http_string_t str = http_get_token_string(request, HS_TOK_VERSION);
-  if (str.buf == NULL) return;
-  int version = str.buf[str.len - 1] == '1';
-  str = http_request_header(request, "Connection");
-  if (
-    (str.len == 5 && hs_case_insensitive_cmp(str.buf, "close", 5)) ||
-    (str.len == 0 && version == HTTP_1_0)
-  ) {
-    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+// HPACK encodes the status and headers into a HEADERS frame, continued in
+// CONTINUATION frames if the block is bigger than the client will take in
+// one frame.
+void hs_h2_send_headers(http_request_t* stream, http_response_t* response, int end_stream) {
+  http_request_t* conn = stream->h2_conn;
+  hs_h2_t* h2 = conn->h2;
+  http_header_t* fixed = response->tmpl ? response->tmpl->headers : NULL;
+  int64_t size = 64;
+  for (http_header_t* header = fixed; header; header = header->next) {
+    size += strlen(header->key) + strlen(header->value) + 12;
+  }
+  for (http_header_t* header = response->headers; header; header = header->next) {
+    size += strlen(header->key) + strlen(header->value) + 12;
+  }
+  uint8_t* block = (uint8_t*)hs_arena_alloc(&stream->arena, size);
+  uint8_t* p = block;
+  if (response->status == 200) {
+    *p++ = 0x80 | HS_HPACK_STATUS_200;
   } else {
-    HTTP_FLAG_SET(request->flags, HTTP_KEEP_ALIVE);
+    char status[3];
+    hs_format_int(status, response->status);
+    p = hs_hpack_put_indexed_name(p, HS_HPACK_STATUS_200, status, 3);
   }
-}
-
-void http_request_connection(http_request_t* request, int directive) {
-  if (directive == HTTP_KEEP_ALIVE) {
-    HTTP_FLAG_CLEAR(request->flags, HTTP_AUTOMATIC);
-    HTTP_FLAG_SET(request->flags, HTTP_KEEP_ALIVE);
-  } else if (directive == HTTP_CLOSE) {
-    HTTP_FLAG_CLEAR(request->flags, HTTP_AUTOMATIC);
-    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+  char const * date = stream->server->date;
+  p = hs_hpack_put_indexed_name(p, HS_HPACK_DATE, date, strlen(date));
+  // The template's headers go first, then the response's own.
+  http_header_t* header = fixed ? fixed : response->headers;
+  while (header) {
+    int len = strlen(header->key);
+    if (!hs_h2_hop_header(header->key, len)) {
+      *p++ = 0;
+      p = hs_hpack_put_string(p, header->key, len, 1);
+      p = hs_hpack_put_string(p, header->value, strlen(header->value), 0);
+    }
+    header = header->next;
+    if (!header && fixed) {
+      header = response->headers;
+      fixed = NULL;
+    }
   }
+  if (!HTTP_FLAG_CHECK(stream->flags, HTTP_CHUNKED_RESPONSE)) {
+    char length[24];
+    int n = hs_format_int(length, response->content_length);
+    p = hs_hpack_put_indexed_name(p, HS_HPACK_CONTENT_LENGTH, length, n);
+  }
+  int total = p - block, offset = 0, type = HS_H2_HEADERS;
+  do {
+    int n = total - offset;
+    if (n > h2->peer_frame) n = h2->peer_frame;
+    int flags = offset + n == total ? HS_H2_END_HEADERS : 0;
+    if (type == HS_H2_HEADERS && end_stream) flags |= HS_H2_END_STREAM;
+    memcpy(hs_h2_frame(conn, n, type, flags, stream->h2_id), block + offset, n);
+    offset += n;
+    type = HS_H2_CONTINUATION;
+  } while (offset < total);
+  if (end_stream) HTTP_FLAG_SET(stream->h2_flags, HS_H2_END_SENT);
+  HTTP_FLAG_SET(stream->h2_flags, HS_H2_ANSWERED);
 }
 
-http_string_t http_request_chunk(struct http_request_s* request) {
-  http_token_t token = request->tokens.buf[request->tokens.size - 1];
-  return (http_string_t) {
-    .buf = &request->stream.buf[token.index],
-    .len = token.len
-  };
+// Puts the response body on the stream's output queue for hs_h2_schedule.
+void hs_h2_queue_body(http_request_t* stream, http_response_t* response) {
+  if (response->body && response->content_length > 0) {
+    hs_out_t* out = &stream->out[0];
+    *out = (hs_out_t){ };
+    out->body = response->body;
+    out->body_length = response->content_length;
+    out->body_release = response->owned
+      ? (response->release ? response->release : hs_static_body)
+      : NULL;
+    stream->out_count = 1;
+    stream->out_written = 0;
+  } else if (response->body && response->owned && response->release) {
+    response->release((void*)response->body);
+  }
 }
 
-// *** http response ***
-
-http_response_t* http_response_init() {
-  http_response_t* response = (http_response_t*)calloc(1, sizeof(http_response_t));
-  assert(response != NULL);
-  response->status = 200;
-  return response;
+// A stream reset while the handler was working on it takes the response
+// and drops it.
+int hs_h2_discard(http_request_t* stream, http_response_t* response) {
+  if (!(stream->h2_flags & (HS_H2_RESET | HS_H2_DONE))) return 0;
+  if (response->body && response->owned && response->release) {
+    response->release((void*)response->body);
+  }
+  hs_response_free(response);
+  hs_h2_finish(stream);
+  return 1;
 }
 
-void http_response_header(http_response_t* response, char const * key, char const * value) {
-  http_header_t* header = (http_header_t*)malloc(sizeof(http_header_t));
-  assert(header != NULL);
-  header->key = key;
-  header->value = value;
-  http_header_t* prev = response->headers;
-  header->next = prev;
-  response->headers = header;
+void hs_h2_respond(http_request_t* stream, http_response_t* response) {
+  if (hs_h2_discard(stream, response)) return;
+  hs_trace_respond(stream, response);
+  int body = response->body && response->content_length > 0;
+  hs_h2_send_headers(stream, response, !body);
+  hs_h2_queue_body(stream, response);
+  hs_response_free(response);
+  hs_h2_kick(stream);
 }
 
-void http_response_status(http_response_t* response, int status) {
-  response->status = status > 599 || status < 100 ? 500 : status;
+void hs_h2_respond_chunk(
+  http_request_t* stream,
+  http_response_t* response,
+  void (*cb)(http_request_t*)
+) {
+  if (hs_h2_discard(stream, response)) return;
+  hs_trace_respond(stream, response);
+  if (!HTTP_FLAG_CHECK(stream->flags, HTTP_CHUNKED_RESPONSE)) {
+    HTTP_FLAG_SET(stream->flags, HTTP_CHUNKED_RESPONSE);
+    hs_h2_send_headers(stream, response, 0);
+  }
+  stream->chunk_cb = cb;
+  HTTP_FLAG_CLEAR(stream->h2_flags, HS_H2_CHUNK_WAIT);
+  hs_h2_queue_body(stream, response);
+  hs_response_free(response);
+  hs_h2_kick(stream);
 }
 
-void http_response_body(http_response_t* response, char const * body, int length) {
-  response->body = body;
-  response->content_length = length;
+// HTTP/2 has no chunk framing to end, the last DATA frame ends the stream.
+// Trailers are not sent.
+void hs_h2_respond_chunk_end(http_request_t* stream, http_response_t* response) {
+  if (hs_h2_discard(stream, response)) return;
+  HTTP_FLAG_CLEAR(stream->flags, HTTP_CHUNKED_RESPONSE);
+  hs_response_free(response);
+  hs_h2_kick(stream);
 }
 
-typedef struct {
-  char* buf;
-  int capacity;
-  int size;
-  int64_t* memused;
-} grwprintf_t;
+// *** connection ***
 
-void grwprintf_init(grwprintf_t* ctx, int capacity, int64_t* memused) {
-  ctx->memused = memused;
-  ctx->size = 0;
-  ctx->buf = (char*)malloc(capacity);
-  *ctx->memused += capacity;
-  assert(ctx->buf != NULL);
-  ctx->capacity = capacity;
+int hs_h2_preface(http_request_t* request) {
+  if (request->tokens.size != 3 || request->out_count > 0) return 0;
+  http_string_t method = hs_token_string(request, 0);
+  http_string_t version = hs_token_string(request, 2);
+  return
+    method.len == 3 && memcmp(method.buf, "PRI", 3) == 0 &&
+    version.len == 8 && memcmp(version.buf, "HTTP/2.0", 8) == 0;
 }
 
-void grwmemcpy(grwprintf_t* ctx, char const * src, int size) {
-  if (ctx->size + size > ctx->capacity) {
-    *ctx->memused -= ctx->capacity;
-    ctx->capacity = ctx->size + size;
-    *ctx->memused += ctx->capacity;
-    ctx->buf = (char*)realloc(ctx->buf, ctx->capacity);
-    assert(ctx->buf != NULL);
+// Whether a comma separated header value lists token.
+int hs_header_has_token(http_string_t value, char const * token) {
+  int len = strlen(token);
+  int i = 0;
+  while (i < value.len) {
+    while (i < value.len && (value.buf[i] == ' ' || value.buf[i] == ',')) i++;
+    int start = i;
+    while (i < value.len && value.buf[i] != ',' && value.buf[i] != ' ') i++;
+    if (i - start == len && hs_case_insensitive_cmp(value.buf + start, token, len)) {
+      return 1;
+    }
   }
-  memcpy(ctx->buf + ctx->size, src, size);
-  ctx->size += size;
+  return 0;
 }
 
-void grwprintf(grwprintf_t* ctx, char const * fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
+// Requests with a streamed or spilled body can't be replayed as stream 1, and
+// responses to earlier pipelined requests have to go out over HTTP/1.1
+// first, so those stay on HTTP/1.1.
+int hs_h2_wants_upgrade(http_request_t* request) {
+  if ((request->flags & (HTTP_FLG_STREAMED | HTTP_SPILLED)) || request->out_count > 0) {
+    return 0;
+  }
+  http_string_t upgrade = http_request_header(request, "Upgrade");
+  if (upgrade.buf == NULL || !hs_header_has_token(upgrade, "h2c")) return 0;
+  return http_request_header(request, "HTTP2-Settings").buf != NULL;
+}
 
-  int bytes = vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
-  if (bytes + ctx->size > ctx->capacity) {
-    *ctx->memused -= ctx->capacity;
-    while (bytes + ctx->size > ctx->capacity) ctx->capacity *= 2;
-    *ctx->memused += ctx->capacity;
-    ctx->buf = (char*)realloc(ctx->buf, ctx->capacity);
-    assert(ctx->buf != NULL);
-    bytes += vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
+void hs_h2_init(http_request_t* conn) {
+  hs_h2_t* h2 = (hs_h2_t*)calloc(1, sizeof(hs_h2_t));
+  assert(h2 != NULL);
+  h2->decoder.max_size = HS_HPACK_TABLE_SIZE;
+  h2->send_window = HS_H2_DEFAULT_WINDOW;
+  h2->peer_window = HS_H2_DEFAULT_WINDOW;
+  h2->peer_frame = HS_H2_DEFAULT_FRAME;
+  h2->preface = 1;
+  conn->h2 = h2;
+  // The connection's own trace was for the preface or upgrade request, its
+  // streams get their own.
+  if (conn->trace) {
+    hs_trace_end(conn->server, conn->trace, 0);
+    conn->trace = NULL;
   }
-  ctx->size += bytes;
+}
 
-  va_end(args);
+// Hands the connection over to the frame parser. Anything in the read buffer
+// from stream.index on is kept for it.
+void hs_h2_switch(http_request_t* conn) {
+  hs_next_request(conn);
+  conn->tokens.buf = NULL;
+  conn->tokens.size = 0;
+  conn->state = HTTP_SESSION_H2;
+  hs_h2_send_settings(conn);
+  // The connection window starts at the default, open it up to the buffer.
+  conn->h2->recv_window = HS_H2_DEFAULT_WINDOW;
+  hs_h2_credit(conn, HTTP_H2_CONN_BUFFER - HS_H2_DEFAULT_WINDOW);
 }
 
-void http_buffer_headers(
-  http_request_t* request,
-  http_response_t* response,
-  grwprintf_t* printctx
-) {
-  http_header_t* header = response->headers;
-  while (header) {
-    grwprintf(printctx, "%s: %s\r\n", header->key, header->value);
-    header = header->next;
-  }
-  if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
-    grwprintf(printctx, "Content-Length: %d\r\n", response->content_length);
-  }
-  grwprintf(printctx, "\r\n");
+// Prior knowledge: the client opened with the connection preface. The frame
+// parser checks all of it, from the start of the request line.
+void hs_h2_start(http_request_t* request) {
+  request->stream.index = request->tokens.buf[0].index;
+  hs_h2_init(request);
+  hs_h2_switch(request);
 }
 
-void http_respond_headers(
-  http_request_t* request,
-  http_response_t* response,
-  grwprintf_t* printctx
-) {
-  if (HTTP_FLAG_CHECK(request->flags, HTTP_AUTOMATIC)) {
-    hs_auto_detect_keep_alive(request);
-  }
-  if (HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE)) {
-    http_response_header(response, "Connection", "keep-alive");
-  } else {
-    http_response_header(response, "Connection", "close");
+// Decodes the base64url HTTP2-Settings header, returning its length.
+int hs_h2_decode_settings(http_string_t str, uint8_t* out, int capacity) {
+  uint32_t bits = 0;
+  int nbits = 0, n = 0;
+  for (int i = 0; i < str.len; i++) {
+    char c = str.buf[i];
+    int v;
+    if (c >= 'A' && c <= 'Z') v = c - 'A';
+    else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+    else if (c >= '0' && c <= '9') v = c - '0' + 52;
+    else if (c == '-' || c == '+') v = 62;
+    else if (c == '_' || c == '/') v = 63;
+    else if (c == '=') break;
+    else return -1;
+    bits = bits << 6 | v;
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      if (n == capacity) return -1;
+      out[n++] = bits >> nbits;
+    }
   }
-  grwprintf(
-    printctx, "HTTP/1.1 %d %s\r\nDate: %s\r\n",
-    response->status, hs_status_text[response->status], request->server->date
-  );
-  http_buffer_headers(request, response, printctx);
+  return n;
 }
 
-void http_end_response(http_request_t* request, http_response_t* response, grwprintf_t* printctx) {
-  http_header_t* header = response->headers;
-  while (header) {
-    http_header_t* tmp = header;
-    header = tmp->next;
-    free(tmp);
+// Answers an Upgrade: h2c request with 101 Switching Protocols and carries
+// it on as stream 1, half closed since the request is already complete. The
+// settings the client sent along apply as if they came in a SETTINGS frame,
+// without being acknowledged.
+void hs_h2_upgrade(http_request_t* request) {
+  hs_h2_init(request);
+  hs_h2_t* h2 = request->h2;
+  uint8_t settings[256];
+  int len = hs_h2_decode_settings(
+    http_request_header(request, "HTTP2-Settings"), settings, sizeof(settings)
+  );
+  if (len > 0) hs_h2_settings(request, settings, len - len % 6);
+
+  // Copy the request into the stream before the connection lets go of it.
+  http_request_t* stream = hs_h2_stream_new(request, 1);
+  h2->last_stream = 1;
+  for (int i = 0; i < request->tokens.size; i++) {
+    http_token_t token = request->tokens.buf[i];
+    http_string_t str = hs_token_string(request, i);
+    switch (token.type) {
+      case HS_TOK_METHOD:
+        HTTP_FLAG_SET(stream->h2_flags, HS_H2_HAS_METHOD);
+        hs_h2_push(stream, str.buf, str.len, HS_TOK_METHOD);
+        break;
+      case HS_TOK_TARGET:
+        HTTP_FLAG_SET(stream->h2_flags, HS_H2_HAS_PATH);
+        hs_h2_push(stream, str.buf, str.len, HS_TOK_TARGET);
+        break;
+      case HS_TOK_HEADER_KEY: {
+        http_string_t value = hs_token_string(request, ++i);
+        if (
+          hs_h2_hop_header(str.buf, str.len) ||
+          (str.len == 14 && hs_case_insensitive_cmp(str.buf, "http2-settings", 14))
+        ) break;
+        hs_h2_header(stream, str, value);
+        break;
+      }
+      case HS_TOK_BODY:
+        stream->stream.index = stream->stream.length;
+        if (hs_h2_append(stream, str.buf, str.len) < 0) {
+          HTTP_FLAG_SET(stream->h2_flags, HS_H2_MALFORMED);
+        }
+        break;
+    }
   }
-  hs_free_buffer(request);
-  free(response);
-  request->stream.buf = printctx->buf;
-  request->stream.total_bytes = 0;
-  request->stream.length = printctx->size;
-  request->stream.capacity = printctx->capacity;
-  request->state = HTTP_SESSION_WRITE;
-  hs_write_response(request);
+
+  static char const switching[] =
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+  int n = sizeof(switching) - 1;
+  hs_h2_reserve(request, n);
+  memcpy(h2->out, switching, n);
+  h2->out_length = n;
+  hs_h2_switch(request);
+
+  hs_h2_dispatch(stream);
+  hs_h2_read(request);
 }
 
-void http_respond(http_request_t* request, http_response_t* response) {
-  grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
-  http_respond_headers(request, response, &printctx);
-  if (response->body) {
-    grwmemcpy(&printctx, response->body, response->content_length);
+// Reads and handles frames until the socket runs dry, then sends whatever
+// that produced in one go.
+void hs_h2_read(http_request_t* conn) {
+  hs_h2_t* h2 = conn->h2;
+  http_server_t* server = conn->server;
+  hs_stream_t* in = &conn->stream;
+  HTTP_FLAG_SET(conn->flags, HTTP_IN_READ);
+  hs_reset_timeout(conn, HTTP_KEEP_ALIVE_TIMEOUT);
+  if (in->buf) hs_h2_process(conn);
+  int bytes = 1;
+  while (bytes > 0 && h2->closing != HS_H2_ABORT) {
+    if (!in->buf) {
+      in->buf = hs_pool_get(&server->pool, HTTP_REQUEST_BUF_SIZE, &in->capacity);
+      server->memused += in->capacity;
+    }
+    if (
+      in->length == in->capacity &&
+      !hs_stream_make_room(in, h2->need, &server->pool, &server->memused)
+    ) {
+      h2->closing = HS_H2_ABORT;
+      break;
+    }
+    bytes = read(conn->socket, in->buf + in->length, in->capacity - in->length);
+    if (bytes > 0) {
+      in->length += bytes;
+      in->total_bytes += bytes;
+      hs_h2_process(conn);
+    }
   }
-  http_end_response(request, response, &printctx);
+  if (bytes == 0 && h2->closing == 0) {
+    // The client is done sending, answer what it asked for and close.
+    h2->closing = HS_H2_DRAIN;
+  } else if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    h2->closing = HS_H2_ABORT;
+  }
+  if (in->length == 0) hs_free_buffer(conn);
+  HTTP_FLAG_CLEAR(conn->flags, HTTP_IN_READ);
+  hs_h2_send(conn);
+  hs_h2_reap(conn);
 }
 
-void http_respond_chunk(
-  http_request_t* request,
-  http_response_t* response,
-  void (*cb)(http_request_t*)
-) {
-  grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
-  if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
-    HTTP_FLAG_SET(request->flags, HTTP_CHUNKED_RESPONSE);
-    http_response_header(response, "Transfer-Encoding", "chunked");
-    http_respond_headers(request, response, &printctx);
+void hs_h2_io(http_request_t* conn) {
+  hs_reset_timeout(conn, HTTP_KEEP_ALIVE_TIMEOUT);
+  if (HTTP_FLAG_CHECK(conn->flags, HTTP_WRITE_ARMED)) {
+    hs_h2_send(conn);
+    if (conn->flags & (HTTP_WRITE_ARMED | HTTP_END_SESSION)) {
+      hs_h2_reap(conn);
+      return;
+    }
   }
-  request->chunk_cb = cb;
-  grwprintf(&printctx, "%X\r\n", response->content_length);
-  grwmemcpy(&printctx, response->body, response->content_length);
-  grwprintf(&printctx, "\r\n");
-  http_end_response(request, response, &printctx);
+  hs_h2_read(conn);
 }
 
-void http_respond_chunk_end(http_request_t* request, http_response_t* response) {
-  grwprintf_t printctx;
-  grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
-  grwprintf(&printctx, "0\r\n");
-  http_buffer_headers(request, response, &printctx);
-  grwprintf(&printctx, "\r\n");
-  HTTP_FLAG_CLEAR(request->flags, HTTP_CHUNKED_RESPONSE);
-  http_end_response(request, response, &printctx);
+void hs_h2_free(http_request_t* conn) {
+  hs_h2_t* h2 = conn->h2;
+  conn->h2 = NULL;
+  while (h2->streams) {
+    http_request_t* stream = h2->streams;
+    h2->streams = stream->h2_next;
+    hs_h2_stream_free(stream);
+  }
+  while (h2->spare) {
+    http_request_t* stream = h2->spare;
+    h2->spare = stream->h2_next;
+    hs_arena_free(&stream->arena);
+    free(stream);
+  }
+  hs_hpack_evict(&h2->decoder, 0);
+  conn->server->memused -= h2->out_capacity;
+  free(h2->out);
+  free(h2->block);
+  free(h2);
 }
 
 // *** kqueue platform specific ***
@@ -1565,7 +5559,9 @@ void http_respond_chunk_end(http_request_t* request, http_response_t* response)
 void hs_server_listen_cb(struct kevent* ev) {
   http_server_t* server = (http_server_t*)ev->udata;
   if (ev->filter == EVFILT_TIMER) {
-    hs_generate_date_time(server->date);
+    hs_server_tick(server);
+  } else if (ev->filter == EVFILT_USER) {
+    hs_admit_sample(server);
   } else {
     hs_accept_connections(server);
   }
@@ -1573,50 +5569,74 @@ void hs_server_listen_cb(struct kevent* ev) {
 
 void hs_session_io_cb(struct kevent* ev) {
   http_request_t* request = (http_request_t*)ev->udata;
-  if (ev->filter == EVFILT_TIMER) {
-    request->timeout -= 1;
-    if (request->timeout == 0) hs_end_session(request);
-  } else {
-    http_session(request);
-  }
+  hs_admit_probe(request->server);
+  http_session(request);
 }
 
 void hs_server_init(http_server_t* serv) {
   serv->loop = kqueue();
+  serv->admit = (hs_admit_t){ };
+  struct kevent ev_set[2];
+  EV_SET(&ev_set[0], 1, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, 1000, serv);
+  EV_SET(&ev_set[1], 2, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, serv);
+  kevent(serv->loop, ev_set, 2, NULL, 0, NULL);
+}
+
+void hs_admit_post_probe(http_server_t* serv) {
   struct kevent ev_set;
-  EV_SET(&ev_set, 1, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, 1000, serv);
+  EV_SET(&ev_set, 2, EVFILT_USER, 0, NOTE_TRIGGER, 0, serv);
   kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
 void hs_add_server_sock_events(http_server_t* serv) {
   struct kevent ev_set;
-  EV_SET(&ev_set, serv->socket, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, serv);
+  EV_SET(&ev_set, serv->socket, EVFILT_READ, EV_ADD, 0, 0, serv);
   kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
-int http_server_listen_addr(http_server_t* serv, const char* ipaddr) {
-  http_listen(serv, ipaddr);
+void hs_delete_server_sock_events(http_server_t* serv) {
+  struct kevent ev_set;
+  EV_SET(&ev_set, serv->socket, EVFILT_READ, EV_DELETE, 0, 0, serv);
+  kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
+}
 
+int hs_server_run(http_server_t* serv) {
   struct kevent ev_list[1];
 
-  while (1) {
+  while (!hs_server_drained(serv)) {
     int nev = kevent(serv->loop, NULL, 0, ev_list, 1, NULL);
     for (int i = 0; i < nev; i++) {
       ev_cb_t* ev_cb = (ev_cb_t*)ev_list[i].udata;
       ev_cb->handler(&ev_list[i]);
     }
   }
+  hs_server_each(serv, hs_end_session);
   return 0;
 }
 
+int http_server_listen_addr(http_server_t* serv, const char* ipaddr) {
+  http_listen(serv, ipaddr);
+  return hs_server_run(serv);
+}
+
 int http_server_listen(http_server_t* serv) {
   return http_server_listen_addr(serv, NULL);
 }
 
+int http_server_listen_socket(http_server_t* serv, int socket) {
+  serv->socket = socket;
+  hs_listen_socket(serv);
+  return hs_server_run(serv);
+}
+
+int http_server_listen_unix(http_server_t* serv, const char* path, int mode) {
+  http_listen_unix(serv, path, mode);
+  return hs_server_run(serv);
+}
+
 void hs_delete_events(http_request_t* request) {
-  struct kevent ev_set;
-  EV_SET(&ev_set, request->socket, EVFILT_TIMER, EV_DELETE, 0, 0, request);
-  kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
+  // Closing the socket removes its filters from the kqueue.
+  (void)request;
 }
 
 int http_server_poll(http_server_t* serv) {
@@ -1630,10 +5650,9 @@ int http_server_poll(http_server_t* serv) {
 }
 
 void hs_add_events(http_request_t* request) {
-  struct kevent ev_set[2];
-  EV_SET(&ev_set[0], request->socket, EVFILT_READ, EV_ADD, 0, 0, request);
-  EV_SET(&ev_set[1], request->socket, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0, 1000, request);
-  kevent(request->server->loop, ev_set, 2, NULL, 0, NULL);
+  struct kevent ev_set;
+  EV_SET(&ev_set, request->socket, EVFILT_READ, EV_ADD, 0, 0, request);
+  kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
 void hs_add_write_event(http_request_t* request) {
@@ -1642,6 +5661,12 @@ void hs_add_write_event(http_request_t* request) {
   kevent(request->server->loop, ev_set, 2, NULL, 0, NULL);
 }
 
+void hs_add_read_event(http_request_t* request) {
+  struct kevent ev_set;
+  EV_SET(&ev_set, request->socket, EVFILT_WRITE, EV_DELETE, 0, 0, request);
+  kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
+}
+
 #else
 
 // *** epoll platform specific ***
@@ -1651,33 +5676,44 @@ void hs_server_listen_cb(struct epoll_event* ev) {
 }
 
 void hs_session_io_cb(struct epoll_event* ev) {
-  http_session((http_request_t*)ev->data.ptr);
+  http_request_t* request = (http_request_t*)ev->data.ptr;
+  hs_admit_probe(request->server);
+  http_session(request);
 }
 
-void hs_server_timer_cb(struct epoll_event* ev) {
-  http_server_t* server = (http_server_t*)((char*)ev->data.ptr - sizeof(epoll_cb_t));
+void hs_server_probe_cb(struct epoll_event* ev) {
+  http_server_t* server =
+    (http_server_t*)((char*)ev->data.ptr - offsetof(http_server_t, probe_handler));
   uint64_t res;
-  int bytes = read(server->timerfd, &res, sizeof(res));
-  (void)bytes; // suppress warning
-  hs_generate_date_time(server->date);
+  if (read(server->probefd, &res, sizeof(res)) != sizeof(res)) return;
+  hs_admit_sample(server);
 }
 
-void hs_request_timer_cb(struct epoll_event* ev) {
-  http_request_t* request = (http_request_t*)((char*)ev->data.ptr - sizeof(epoll_cb_t));
-  uint64_t res;
-  int bytes = read(request->timerfd, &res, sizeof(res));
-  (void)bytes; // suppress warning
-  request->timeout -= 1;
-  if (request->timeout == 0) hs_end_session(request);
+void hs_admit_post_probe(http_server_t* serv) {
+  uint64_t one = 1;
+  if (write(serv->probefd, &one, sizeof(one)) != sizeof(one)) serv->admit.probe_sent = 0;
+}
+
+void hs_server_timer_cb(struct epoll_event* ev) {
+  http_server_t* server = (http_server_t*)((char*)ev->data.ptr - sizeof(epoll_cb_t));
+  uint64_t res = 0;
+  int bytes = read(server->timerfd, &res, sizeof(res));
+  if (bytes != sizeof(res)) return;
+  // Catch up on any ticks we missed while the loop was busy.
+  while (res--) hs_server_tick(server);
 }
 
 void hs_add_server_sock_events(http_server_t* serv) {
   struct epoll_event ev;
-  ev.events = EPOLLIN | EPOLLET;
+  ev.events = EPOLLIN;
   ev.data.ptr = serv;
   epoll_ctl(serv->loop, EPOLL_CTL_ADD, serv->socket, &ev);
 }
 
+void hs_delete_server_sock_events(http_server_t* serv) {
+  epoll_ctl(serv->loop, EPOLL_CTL_DEL, serv->socket, NULL);
+}
+
 void hs_server_init(http_server_t* serv) {
   serv->loop = epoll_create1(0);
   serv->timer_handler = hs_server_timer_cb;
@@ -1693,29 +5729,51 @@ void hs_server_init(http_server_t* serv) {
   ev.data.ptr = &serv->timer_handler;
   epoll_ctl(serv->loop, EPOLL_CTL_ADD, tfd, &ev);
   serv->timerfd = tfd;
+
+  // The admission controller's probes go round the loop through an eventfd.
+  serv->admit = (hs_admit_t){ };
+  serv->probe_handler = hs_server_probe_cb;
+  serv->probefd = eventfd(0, EFD_NONBLOCK);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = &serv->probe_handler;
+  epoll_ctl(serv->loop, EPOLL_CTL_ADD, serv->probefd, &ev);
 }
 
-int http_server_listen_addr(http_server_t* serv, const char* ipaddr) {
-  http_listen(serv, ipaddr);
+int hs_server_run(http_server_t* serv) {
   struct epoll_event ev_list[1];
-  while (1) {
+  while (!hs_server_drained(serv)) {
     int nev = epoll_wait(serv->loop, ev_list, 1, -1);
     for (int i = 0; i < nev; i++) {
       ev_cb_t* ev_cb = (ev_cb_t*)ev_list[i].data.ptr;
       ev_cb->handler(&ev_list[i]);
     }
   }
+  hs_server_each(serv, hs_end_session);
   return 0;
 }
 
+int http_server_listen_addr(http_server_t* serv, const char* ipaddr) {
+  http_listen(serv, ipaddr);
+  return hs_server_run(serv);
+}
+
 int http_server_listen(http_server_t* serv) {
   return http_server_listen_addr(serv, NULL);
 }
 
+int http_server_listen_socket(http_server_t* serv, int socket) {
+  serv->socket = socket;
+  hs_listen_socket(serv);
+  return hs_server_run(serv);
+}
+
+int http_server_listen_unix(http_server_t* serv, const char* path, int mode) {
+  http_listen_unix(serv, path, mode);
+  return hs_server_run(serv);
+}
+
 void hs_delete_events(http_request_t* request) {
   epoll_ctl(request->server->loop, EPOLL_CTL_DEL, request->socket, NULL);
-  epoll_ctl(request->server->loop, EPOLL_CTL_DEL, request->timerfd, NULL);
-  close(request->timerfd);
 }
 
 int http_server_poll(http_server_t* serv) {
@@ -1728,25 +5786,11 @@ int http_server_poll(http_server_t* serv) {
 }
 
 void hs_add_events(http_request_t* request) {
-  request->timer_handler = hs_request_timer_cb;
-
-  // Watch for read events
+  // Watch for read events. Timeouts are handled by the server's timing wheel.
   struct epoll_event ev;
   ev.events = EPOLLIN | EPOLLET;
   ev.data.ptr = request;
   epoll_ctl(request->server->loop, EPOLL_CTL_ADD, request->socket, &ev);
-
-  // Add timer to timeout requests.
-  int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
-  struct itimerspec ts = {};
-  ts.it_value.tv_sec = 1;
-  ts.it_interval.tv_sec = 1;
-  timerfd_settime(tfd, 0, &ts, NULL);
-
-  ev.events = EPOLLIN | EPOLLET;
-  ev.data.ptr = &request->timer_handler;
-  epoll_ctl(request->server->loop, EPOLL_CTL_ADD, tfd, &ev);
-  request->timerfd = tfd;
 }
 
 void hs_add_write_event(http_request_t* request) {
@@ -1756,6 +5800,13 @@ void hs_add_write_event(http_request_t* request) {
   epoll_ctl(request->server->loop, EPOLL_CTL_MOD, request->socket, &ev);
 }
 
+void hs_add_read_event(http_request_t* request) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = request;
+  epoll_ctl(request->server->loop, EPOLL_CTL_MOD, request->socket, &ev);
+}
+
 #endif
 
 #endif
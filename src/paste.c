@@ -17,302 +17,2645 @@
 
 #include "sqlite3.h"
 
+#include "uuid.h"
+#include "sha256.h"
+
+// NOTE (Brian) the uuid functions are compiled in and registered on the
+// database directly, rather than loaded out of ext_uuid.so at startup
+#define SQLITE_CORE
+#include "uuid.c"
+
 #include <magic.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PORT (5000)
+
+// NOTE (Brian) per client limits, generous enough for a person pasting by hand
+// or a script fetching pastes, not for one filling the disk
+#define RATE_REQUESTS      (50)
+#define RATE_REQUEST_BURST (500)
+#define RATE_BYTES         (4 * 1024 * 1024)
+#define RATE_BYTE_BURST    (64 * 1024 * 1024)
+
+// NOTE (Brian) uploads this big are written to an unlinked file next to the
+// database as they come in instead of being held in memory, and mapped back
+// in for the insert; a few people pasting wads at once shouldn't push
+// everyone else into 503s
+#define SPILL_THRESHOLD (256 * 1024)
+#define SPILL_DIR       (".")
+
+static magic_t MAGIC_COOKIE;
+static pthread_mutex_t magic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sqlite3 *db;
+
+// NOTE (Brian) paste ids are made here instead of by the uuid() default, so
+// the insert is the only statement an upload needs. The random bytes come
+// from getrandom a batch at a time into a per thread buffer, which is thrown
+// out after a fork so a child can't hand out ids its parent already has.
+
+#define IDRAND_BATCH (256) // ids per getrandom
+
+struct idrand_t {
+	unsigned char buf[IDRAND_BATCH * UUID_BLOB_LEN];
+	size_t used;
+	pid_t pid;
+};
+
+static _Thread_local struct idrand_t idrand;
+
+// NOTE (Brian) pastes never change, and the static files rarely do, so we only
+// ever compress a given body once and keep the result around. Entries are
+// keyed on "paste:<id>" or "file:<path>", with the mtime guarding the latter.
+
+#define COMPRESS_MIN_SIZE (1024)
+#define COMPRESS_LEVEL    (6)
+
+#define ZCACHE_SLOTS      (128)
+#define ZCACHE_MAX_BYTES  (64 * 1024 * 1024)
+
+enum {
+	  ENC_IDENTITY
+	, ENC_GZIP
+	, ENC_DEFLATE
+	, ENC_TOTAL
+};
+
+struct zcache_t {
+	char key[BUFSMALL];
+	char mime_type[BUFSMALL];
+	int enc;
+	time_t mtime;
+	void *data;
+	size_t len;
+	u64 used;
+};
+
+static struct zcache_t zcache[ZCACHE_SLOTS];
+static size_t zcache_bytes;
+static u64 zcache_tick;
+
+static char *enc_names[ENC_TOTAL] = {
+	  "identity" // ENC_IDENTITY
+	, "gzip"     // ENC_GZIP
+	, "deflate"  // ENC_DEFLATE
+};
+
+// NOTE (Brian) libmagic runs hundreds of tests over the whole buffer, which for
+// text is milliseconds a paste. Nearly everything pasted is text or one of a
+// few binary formats with magic bytes at the front, so classify looks for
+// those first. Text is checked to be ascii or utf-8 all the way through, a
+// SIMD register at a time, and served as text/plain whatever language it's
+// in; a paste is never served as html. libmagic only sees what classify
+// doesn't know, and only the first MAGIC_PREFIX bytes of it. The cookie
+// isn't safe to share between threads, so it's only used under magic_lock.
+//
+// Static files are typed by their extension, when we know it and classify
+// says they're text.
+
+#define MAGIC_PREFIX (4096)
+#define JSON_SCAN    (64 * 1024) // JSON is only checked this far in
+
+enum {
+	  CT_UNKNOWN
+	, CT_PNG
+	, CT_JPEG
+	, CT_GIF
+	, CT_GZIP
+	, CT_ZIP
+	, CT_PDF
+	, CT_ELF
+	, CT_JSON
+	, CT_TEXT
+	, CT_TOTAL
+};
+
+static char *ct_names[CT_TOTAL] = {
+	  NULL                       // CT_UNKNOWN
+	, "image/png"                // CT_PNG
+	, "image/jpeg"               // CT_JPEG
+	, "image/gif"                // CT_GIF
+	, "application/gzip"         // CT_GZIP
+	, "application/zip"          // CT_ZIP
+	, "application/pdf"          // CT_PDF
+	, "application/x-executable" // CT_ELF
+	, "application/json"         // CT_JSON
+	, "text/plain"               // CT_TEXT
+};
+
+static char *ext_types[][2] = {
+	  { ".html", "text/html" }
+	, { ".css",  "text/css" }
+	, { ".js",   "text/javascript" }
+	, { ".json", "application/json" }
+	, { ".svg",  "image/svg+xml" }
+	, { ".txt",  "text/plain" }
+};
+
+// NOTE (Brian) almost every response we send is one of a handful of shapes, so
+// the status line and fixed headers for those are serialized once at startup,
+// see http_template_init. Only the mime type and encoding vary per body.
+
+enum {
+	  TMPL_NOT_FOUND
+	, TMPL_UNAVAILABLE
+	, TMPL_UPLOAD
+	, TMPL_BODY
+	, TMPL_BODY_VARY
+	, TMPL_TOTAL
+};
+
+static struct http_template_s *templates[TMPL_TOTAL];
+
+// NOTE (Brian) everything runs on the server's one thread, so the metrics are
+// plain counters bumped in place, nothing is locked or atomic. Latencies go in
+// log-linear histograms, HDR style: each power of two of microseconds is split
+// into HIST_SUB buckets, so a bucket's bound is within 25% of anything in it,
+// from a microsecond up to a couple of minutes. /metrics serves them up in
+// the Prometheus text format.
+
+#define HIST_SUB_BITS (2)
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (26 * HIST_SUB) // the last one is +Inf
+
+enum {
+	  ROUTE_UPLOAD
+	, ROUTE_PASTE
+	, ROUTE_STATIC
+	, ROUTE_META
+	, ROUTE_ERROR
+	, ROUTE_TOTAL
+};
+
+static char *route_names[ROUTE_TOTAL] = {
+	  "upload" // ROUTE_UPLOAD
+	, "paste"  // ROUTE_PASTE
+	, "static" // ROUTE_STATIC
+	, "meta"   // ROUTE_META
+	, "error"  // ROUTE_ERROR
+};
+
+enum {
+	  PHASE_SQLITE_INSERT
+	, PHASE_SQLITE_SELECT
+	, PHASE_MIME
+	, PHASE_COMPRESS
+	, PHASE_TOTAL
+};
+
+static char *phase_names[PHASE_TOTAL] = {
+	  "sqlite_insert" // PHASE_SQLITE_INSERT
+	, "sqlite_select" // PHASE_SQLITE_SELECT
+	, "mime"          // PHASE_MIME
+	, "compress"      // PHASE_COMPRESS
+};
+
+// NOTE (Brian) endpoints are declared in the routes table, next to
+// request_handler, as a method and a path pattern. A pattern is a '/'
+// separated list of segments, each one of
+//
+//   name  matches itself
+//   :id   a paste id, parsed into the args' 16 bytes
+//   *     the rest of the path, however many segments, as a view into it
+//
+// init_routes compiles the patterns into a trie of segments, with what ends
+// at a node kept per method. A request's path is walked through it as views
+// into the request, so matching copies nothing and costs the same however
+// many routes there are. A literal segment is tried before :id and :id
+// before *, and a walk that dead ends backs up to try the next one, so
+// "/debug/nope" still falls through to the static files. A HEAD with no
+// route of its own takes the GET route, the server drops the body.
+
+#define RNODES_MAX (64)
+
+enum {
+	  METHOD_GET
+	, METHOD_HEAD
+	, METHOD_POST
+	, METHOD_TOTAL
+};
+
+static char *method_names[METHOD_TOTAL] = {
+	  "GET"  // METHOD_GET
+	, "HEAD" // METHOD_HEAD
+	, "POST" // METHOD_POST
+};
+
+enum {
+	  SEG_LITERAL
+	, SEG_ID
+	, SEG_REST
+};
+
+struct route_args_t {
+	unsigned char id[UUID_BLOB_LEN]; // :id
+	struct http_string_s rest;       // *, without the '/' in front of it
+	struct http_string_s query;      // after the '?', empty if there isn't one
+	char remote[INET6_ADDRSTRLEN];
+};
+
+struct route_t {
+	char *method;
+	char *path;
+	int route;   // ROUTE_* it's counted as, -1 for not at all
+	int errcode; // sent when the handler fails
+	int (*handler)(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+};
+
+struct rnode_t {
+	int kind;
+	char *seg; // SEG_LITERAL's text
+	size_t len;
+	struct rnode_t *child; // literals first, then :id, then *
+	struct rnode_t *next;
+	struct route_t *routes[METHOD_TOTAL];
+};
+
+static struct rnode_t rnodes[RNODES_MAX];
+static int rnodes_used;
+
+// NOTE (Brian) a paste's size, type and hash are worked out once when it's
+// uploaded and kept in paste_meta, so HEAD and /<id>/meta can answer without
+// reading the data. Pastes from before there was a paste_meta get their row
+// the first time they're asked about.
+
+struct paste_meta_t {
+	s64 size;
+	char mime_type[BUFSMALL];
+	char created[32];
+	char sha256[SHA256_LEN * 2 + 1];
+};
+
+struct hist_t {
+	u64 buckets[HIST_BUCKETS];
+	u64 count;
+	u64 sum; // microseconds
+};
+
+struct metrics_t {
+	struct hist_t latency[ROUTE_TOTAL];
+	struct hist_t phases[PHASE_TOTAL];
+	u64 bytes_in[ROUTE_TOTAL];
+	u64 bytes_out[ROUTE_TOTAL];
+	size_t sent; // body bytes of the response being sent, see send_body
+	int status;  // and its status
+};
+
+static struct metrics_t metrics;
+
+static struct http_server_s *server;
+
+struct strbuf_t {
+	char *buf;
+	size_t len, cap;
+};
+
+// NOTE (Brian) the access log mustn't slow requests down when the disk does.
+// The server hands over every request once it's done with it, answered by
+// request_handler or turned away before it got there (bad requests, sheds,
+// HTTP/2 resets), and its line is copied into a ring; a writer thread formats
+// what's in the ring and writes it out. If the ring is full the line is
+// dropped and counted, the writer notes how many went missing. SIGHUP has the
+// writer reopen the file, for logrotate.
+//
+// There is one producer, the event loop, and one consumer, the writer, so the
+// ring needs nothing more than the two indices: tail is only written by
+// alog_add and head only by the writer.
+
+#define ALOG_SLOTS   (4096) // power of two
+#define ALOG_IDLE_MS (20)
+
+struct alog_entry_t {
+	struct timespec ts;
+	u64 bytes;
+	u64 bytes_in;
+	u64 duration; // microseconds, from the first byte read to the last written
+	int status;
+	int reset; // the HTTP/2 error code, when the stream was reset
+	char method[16];
+	char remote[INET6_ADDRSTRLEN];
+	char target[64];
+};
+
+struct alog_t {
+	struct alog_entry_t entries[ALOG_SLOTS];
+	_Atomic u64 head;
+	_Atomic u64 tail;
+	_Atomic u64 dropped;
+	_Atomic int running;
+	pthread_t thread;
+	FILE *fp;
+	char *path;
+};
+
+static struct alog_t alog;
+static volatile sig_atomic_t alog_reopen;
+
+// NOTE (Brian) the server times each request's way through, reading it,
+// waiting on its body, the handler and writing the response, and the handler
+// adds a span for each phase it times for /metrics. A request slower than
+// SLOW_REQUEST_MS gets a line on stderr saying where the time went. One in
+// TRACE_SAMPLE_EVERY is kept whatever it took, and the last TRACE_KEEP of
+// those are served at /debug/trace in the Chrome trace event format, to load
+// into chrome://tracing or Perfetto. Targets are paste ids, so that's only
+// served to addresses given with -t.
+
+#define SLOW_REQUEST_MS    (250)
+#define TRACE_SAMPLE_EVERY (1000)
+#define TRACE_KEEP         (256)
+
+static struct http_trace_s traces[TRACE_KEEP];
+static u64 traces_kept;
+
+// NOTE (Brian) hot restart. A paste started while another is running in the
+// same directory takes over from it without refusing a connection. The new
+// one connects to the old one's HANDOFF_PATH, is sent the listening socket
+// over it (SCM_RIGHTS), and sends a byte back once it has it; connections
+// queue on the socket until its loop is running. Until that byte both are
+// accepting. After it the old one stops, gives what's in flight up to
+// HANDOFF_DRAIN seconds to finish, cleans up and exits, and the new one
+// listens on HANDOFF_PATH for the next time. If the new one dies before the
+// byte, the old one carries on as if nothing happened. A new one that gets
+// through but isn't sent the socket, as another is taking over already,
+// leaves the old one and HANDOFF_PATH be and exits.
+//
+// The path is only open to our own user, anyone who can connect to it gets
+// the socket.
+
+#define HANDOFF_PATH  ("paste.sock")
+#define HANDOFF_DRAIN (30) // seconds
+#define HANDOFF_WAIT  (5)  // seconds the new one waits on the old one
+
+// handoff_t: the listener, or the connection to the new process, in the event loop
+struct handoff_t {
+	void (*handler)(struct epoll_event *ev);
+	int fd;
+};
+
+static struct handoff_t handoff_listener;
+static struct handoff_t handoff_conn;
+
+// init: initializes the program
+void init(char *db_file_name, char *sql_file_name);
+
+void cleanup(void);
+
+// create_tables: execs create * statements on the database
+int create_tables(sqlite3 *db, char *fname);
+
+// init_templates: serializes the fixed parts of the responses we send
+void init_templates(void);
+
+// request_handler: the http request handler
+void request_handler(struct http_request_s *req);
+
+// ROUTING
+// init_routes: compiles the routes table into the trie
+void init_routes(void);
+// route_add: adds one route's pattern to the trie
+void route_add(struct route_t *route);
+// route_match: finds the route for a method and target, filling in args; NULL if there isn't one
+struct route_t *route_match(struct http_string_s method, struct http_string_s target, struct route_args_t *args);
+// route_walk: matches the path from s, just past a '/', to end below node n
+struct route_t *route_walk(struct rnode_t *n, int method, char *s, char *end, struct route_args_t *args);
+// query_arg: finds key in the query string, setting val to its (still encoded) value
+int query_arg(struct route_args_t *args, char *key, struct http_string_s *val);
+// route_metrics: GET /metrics
+int route_metrics(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+// route_trace: GET /debug/trace, trusted clients only
+int route_trace(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+// route_paste: GET /:id
+int route_paste(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+// route_head: HEAD /:id
+int route_head(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+// route_meta: GET /:id/meta
+int route_meta(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+// route_upload: POST /upload
+int route_upload(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+// request_body_len: the length of the request body, in memory or in a file
+size_t request_body_len(struct http_request_s *req);
+// route_file: GET /*
+int route_file(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args);
+
+// SERVER FUNCTIONS
+// send_paste: sends the given paste to the requester
+int send_paste(struct http_request_s *req, struct http_response_s *res, unsigned char *uuid);
+// new_id: makes a random (version 4) uuid for a new paste, returns -1 if it can't
+int new_id(unsigned char *uuid);
+// add_paste: adds a paste into the database, writing its id into uuid
+int add_paste(unsigned char *uuid, void *blob, size_t len, char *remote);
+// get_paste: loads the entire blob into memory, returns 1 if there's no such paste
+int get_paste(unsigned char *uuid, void **blob, size_t *len);
+// make_meta: works out the size, type and hash of a paste's data, not when it was made
+void make_meta(struct paste_meta_t *meta, void *blob, size_t len);
+// put_meta: stores a paste's metadata
+int put_meta(char *id, struct paste_meta_t *meta);
+// get_meta: loads a paste's metadata without its data, returns 1 if there's no such paste
+int get_meta(unsigned char *uuid, struct paste_meta_t *meta);
+// send_file: sends the file at path from "html/", coalescing "" to 'index.html'
+int send_file(struct http_request_s *req, struct http_response_s *res, struct http_string_s path);
+// send_error: sends an error
+int send_error(struct http_request_s *req, struct http_response_s *res, int errcode);
+// send_body: sends a 200 with the given (possibly encoded) body, handing data to release if non-NULL
+int send_body(struct http_request_s *req, struct http_response_s *res, char *mime_type, int enc, void *data, size_t len, int vary, void (*release)(void *));
+
+// CONTENT ENCODING
+// pick_encoding: chooses a content-coding from the request's Accept-Encoding
+int pick_encoding(struct http_request_s *req);
+// is_compressible: returns true if the mime type is worth compressing
+int is_compressible(char *mime_type);
+// compress_buffer: compresses src with the given encoding, returns -1 if it didn't shrink
+int compress_buffer(int enc, void *src, size_t len, void **dst, size_t *dstlen);
+// zcache_evict: frees a cache slot
+void zcache_evict(struct zcache_t *z);
+// zcache_get: fetches a cached, encoded body; returns NULL on a miss
+struct zcache_t *zcache_get(char *key, int enc, time_t mtime);
+// zcache_put: stores an encoded body in the cache, taking ownership of data
+struct zcache_t *zcache_put(char *key, int enc, time_t mtime, char *mime_type, void *data, size_t len);
+
+// CONTENT TYPE
+// content_type: writes the mime type of data into out, ext_type stands in for text/plain if non-NULL
+void content_type(char *out, size_t size, void *data, size_t len, char *ext_type);
+// classify: recognizes the common types from their first bytes, sets the charset if it does
+int classify(void *data, size_t len, char **charset);
+// text_run: the length of the run of printable ascii, tabs and newlines at the start of s
+size_t text_run(unsigned char *s, size_t len);
+// text_charset: "us-ascii" or "utf-8" if data is all text, NULL if it isn't
+char *text_charset(unsigned char *s, size_t len);
+// utf8_len: the length of the utf-8 sequence at the start of s, 0 if it isn't one
+int utf8_len(unsigned char *s, size_t len);
+// is_json: returns true if the text looks like a JSON object or array
+int is_json(unsigned char *s, size_t len);
+// ext_type: the mime type for a static file's extension, NULL if we don't know it
+char *ext_type(char *path);
+
+// METRICS
+// now_us: monotonic microseconds
+u64 now_us(void);
+// hist_add: records a value in microseconds
+void hist_add(struct hist_t *h, u64 us);
+// hist_bound: the upper bound of bucket i in microseconds, what's in it is shorter
+u64 hist_bound(int i);
+// send_metrics: sends the counters and histograms as Prometheus text
+int send_metrics(struct http_request_s *req, struct http_response_s *res);
+// sbprintf: printf onto the end of a strbuf_t, growing it as needed
+void sbprintf(struct strbuf_t *sb, char *fmt, ...);
+// sbhist: appends a histogram in the Prometheus text format
+void sbhist(struct strbuf_t *sb, char *name, char *label, char *value, struct hist_t *h);
+
+// ACCESS LOG
+// alog_open: opens the access log and starts its writer, returns -1 if it can't
+int alog_open(char *path);
+// alog_close: writes out what's left in the ring and stops the writer
+void alog_close(void);
+// alog_add: the server's access log hook, queues the request's line or drops it if the ring is full
+void alog_add(struct http_trace_s *t);
+// alog_writer: the writer thread, drains the ring into the file
+void *alog_writer(void *arg);
+// alog_write: formats one entry as a line of JSON
+void alog_write(FILE *fp, struct alog_entry_t *e);
+// json_escape: writes a JSON string's contents, escaping what needs it
+void json_escape(FILE *fp, char *str);
+// alog_hup: SIGHUP handler, has the writer reopen the file
+void alog_hup(int sig);
+
+// TRACING
+// phase_add: records a phase that started at mark, in /metrics and the request's trace
+void phase_add(struct http_request_s *req, int phase, u64 mark);
+// trace_cb: called with the trace of every slow or sampled request
+void trace_cb(struct http_trace_s *t);
+// trace_ms: milliseconds between two points of a trace, 0 if it never reached either
+double trace_ms(int64_t from, int64_t to);
+// trace_event: writes a complete ("X") trace event
+void trace_event(FILE *fp, char *name, char *cat, int tid, int64_t from, int64_t to);
+// send_trace: sends the sampled traces as Chrome trace events
+int send_trace(struct http_request_s *req, struct http_response_s *res);
+
+// HOT RESTART
+// handoff_take: takes the listening socket from a running paste, -1 if there isn't one, -2 if it didn't hand over
+int handoff_take(void);
+// handoff_listen: listens on HANDOFF_PATH for the next paste to hand over to, returns -1 if it can't
+int handoff_listen(void);
+// handoff_accept: sends the listening socket to a new paste
+void handoff_accept(struct epoll_event *ev);
+// handoff_ready: the new paste has the socket (or died), drains if it has
+void handoff_ready(struct epoll_event *ev);
+// handoff_addr: fills in HANDOFF_PATH's address
+void handoff_addr(struct sockaddr_un *addr);
+
+#define DB_BUSY_MS (250)
+
+#define SQL_WAL_ENABLE ("PRAGMA journal_mode=WAL;")
+
+#define SQLITE_ERRMSG(x) (fprintf(stderr, "Error: %s\n", sqlite3_errstr(rc)))
+
+#define USAGE ("USAGE: %s [-u socket] [-p] [-t addr[/bits]]... <dbname> [access log]\n")
+
+// NOTE (Brian) -t trusts an address or range, which then isn't rate limited
+// and can see /debug/trace. Nothing is by default, not even loopback; the e2e
+// script and make bench want paste started with -t 127.0.0.1
+#define TRUST_MAX (8)
+
+// NOTE (Brian) with -u paste listens on a unix socket instead of the port, for
+// a proxy on the same box; -p has every connection start with a PROXY protocol
+// header so the rate limits and the remote column see the client, not the
+// proxy. Only use -p when the proxy is the only thing that can connect.
+// Without it every client over the socket is "unknown", and they all share
+// one rate limit. The socket is open to our own group, put the proxy's user
+// in it.
+#define UNIX_SOCKET_MODE (0660)
+
+#define DEFAULT_ACCESS_LOG ("access.log")
+
+int main(int argc, char **argv)
+{
+	char *path;
+	char *trusted[TRUST_MAX];
+	int sock, proxy, ntrusted, opt, i;
+
+	path = NULL;
+	proxy = 0;
+	ntrusted = 0;
+
+	while ((opt = getopt(argc, argv, "u:pt:")) != -1) {
+		switch (opt) {
+		case 'u':
+			path = optarg;
+			break;
+		case 'p':
+			proxy = 1;
+			break;
+		case 't':
+			if (ntrusted == TRUST_MAX) {
+				fprintf(stderr, "Too many -t, at most %d\n", TRUST_MAX);
+				return 1;
+			}
+			trusted[ntrusted++] = optarg;
+			break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind < 1) {
+		fprintf(stderr, USAGE, argv[0]);
+		return 1;
+	}
+
+	init(argv[optind], "schema.sql");
+
+	if (alog_open(argc - optind < 2 ? DEFAULT_ACCESS_LOG : argv[optind + 1]) < 0) {
+		ERR("Couldn't open the access log!\n");
+		exit(1);
+	}
+
+	server = http_server_init(PORT, request_handler);
+
+	http_server_rate_limit(server, RATE_REQUESTS, RATE_REQUEST_BURST, RATE_BYTES, RATE_BYTE_BURST);
+
+	for (i = 0; i < ntrusted; i++) {
+		if (http_server_trust(server, trusted[i]) < 0) {
+			ERR("Couldn't trust '%s', it isn't an address or range!\n", trusted[i]);
+			exit(1);
+		}
+	}
+
+	http_server_trace(server, SLOW_REQUEST_MS * 1000, TRACE_SAMPLE_EVERY, trace_cb);
+
+	http_server_access_log(server, alog_add);
+
+	http_server_proxy_protocol(server, proxy);
+
+	http_server_spill_bodies(server, SPILL_THRESHOLD, SPILL_DIR);
+
+	sock = handoff_take();
+
+	// NOTE (Brian) a paste that's running but didn't hand over still has the
+	// port and HANDOFF_PATH, taking the path from it would leave it with no
+	// way to hand over next time
+	if (sock == -2) {
+		ERR("The running paste didn't hand over, leaving it be\n");
+		cleanup();
+		return 1;
+	}
+
+	if (handoff_listen() < 0) {
+		ERR("Couldn't listen on %s, there's no hot restart!\n", HANDOFF_PATH);
+	}
+
+	if (0 <= sock) {
+		if (path) {
+			printf("took over %s\n", path);
+		} else {
+			printf("took over http://localhost:%d\n", PORT);
+		}
+		http_server_listen_socket(server, sock);
+	} else if (path) {
+		printf("listening on %s\n", path);
+		http_server_listen_unix(server, path, UNIX_SOCKET_MODE);
+	} else {
+		printf("listening on http://localhost:%d\n", PORT);
+		http_server_listen(server);
+	}
+
+	cleanup();
+
+	return 0;
+}
+
+// NOTE (Brian) the first route to claim a method and pattern has it
+static struct route_t routes[] = {
+	  { "GET",  "/metrics",     -1,           404, route_metrics }
+	, { "GET",  "/debug/trace", -1,           404, route_trace   }
+	, { "GET",  "/:id",         ROUTE_PASTE,  503, route_paste   }
+	, { "HEAD", "/:id",         ROUTE_META,   503, route_head    }
+	, { "GET",  "/:id/meta",    ROUTE_META,   503, route_meta    }
+	, { "POST", "/upload",      ROUTE_UPLOAD, 503, route_upload  }
+	, { "GET",  "/*",           ROUTE_STATIC, 404, route_file    }
+};
+
+// request_handler: the http request handler
+void request_handler(struct http_request_s *req)
+{
+	struct http_response_s *res;
+	struct http_string_s m, t;
+	struct route_args_t args;
+	struct route_t *r;
+	int route, head;
+	u64 start;
+	u64 elapsed;
+
+	start = now_us();
+	metrics.sent = 0;
+	metrics.status = 0;
+
+	res = http_response_init();
+
+	m = http_request_method(req);
+	t = http_request_target(req);
+
+	// NOTE (Brian) once the handler responds the request's buffer can be
+	// gone, so whether it's a HEAD is worked out before
+	head = m.len == 4 && memcmp(m.buf, "HEAD", 4) == 0;
+
+	if (http_request_peer(req, args.remote, sizeof args.remote) < 0)
+		args.remote[0] = '\0';
+
+	r = route_match(m, t, &args);
+	if (r == NULL) {
+		route = ROUTE_ERROR;
+		send_error(req, res, 404);
+	} else {
+		route = r->route;
+		if (r->handler(req, res, &args) < 0) {
+			route = ROUTE_ERROR;
+			send_error(req, res, r->errcode);
+		}
+	}
+
+	elapsed = now_us() - start;
+
+	// a HEAD that took a GET route had its body dropped by the server
+	if (head) {
+		metrics.sent = 0;
+	}
+
+	if (0 <= route) {
+		metrics.bytes_in[route] += request_body_len(req);
+		metrics.bytes_out[route] += metrics.sent;
+		hist_add(&metrics.latency[route], elapsed);
+	}
+}
+
+// init_routes: compiles the routes table into the trie
+void init_routes(void)
+{
+	size_t i;
+
+	rnodes_used = 1; // the root, for the '/' every path starts with
+
+	for (i = 0; i < ARRSIZE(routes); i++) {
+		route_add(routes + i);
+	}
+}
+
+// route_add: adds one route's pattern to the trie
+void route_add(struct route_t *route)
+{
+	struct rnode_t *n, *c, **link;
+	char *s, *e;
+	size_t len;
+	int method, kind;
+
+	for (method = 0; method < METHOD_TOTAL; method++) {
+		if (streq(route->method, method_names[method])) {
+			break;
+		}
+	}
+
+	assert(method < METHOD_TOTAL);
+	assert(route->path[0] == '/');
+
+	n = rnodes;
+
+	for (s = route->path + 1; ; s = e + 1) {
+		e = strchr(s, '/');
+		if (e == NULL) {
+			e = s + strlen(s);
+		}
+		len = e - s;
+
+		if (len == 3 && strncmp(s, ":id", 3) == 0) {
+			kind = SEG_ID;
+		} else if (len == 1 && s[0] == '*') {
+			kind = SEG_REST;
+			assert(*e == '\0'); // * takes the rest, so it comes last
+		} else {
+			kind = SEG_LITERAL;
+		}
+
+		// the children stay in kind order, which is the order they're tried in
+		c = NULL;
+		for (link = &n->child; *link && (*link)->kind <= kind; link = &(*link)->next) {
+			if ((*link)->kind == kind && (kind != SEG_LITERAL || ((*link)->len == len && strncmp((*link)->seg, s, len) == 0))) {
+				c = *link;
+				break;
+			}
+		}
+
+		if (c == NULL) {
+			assert(rnodes_used < RNODES_MAX);
+			c = rnodes + rnodes_used++;
+			c->kind = kind;
+			c->seg = s;
+			c->len = len;
+			c->next = *link;
+			*link = c;
+		}
+
+		n = c;
+
+		if (*e == '\0') {
+			break;
+		}
+	}
+
+	if (n->routes[method] == NULL) {
+		n->routes[method] = route;
+	}
+}
+
+// route_match: finds the route for a method and target, filling in args; NULL if there isn't one
+struct route_t *route_match(struct http_string_s method, struct http_string_s target, struct route_args_t *args)
+{
+	struct route_t *r;
+	char *s, *q, *end;
+	int i;
+
+	for (i = 0; i < METHOD_TOTAL; i++) {
+		if ((size_t)method.len == strlen(method_names[i]) && memcmp(method.buf, method_names[i], method.len) == 0) {
+			break;
+		}
+	}
+
+	if (i == METHOD_TOTAL || target.len < 1 || target.buf[0] != '/') {
+		return NULL;
+	}
+
+	end = (char *)target.buf + target.len;
+	s = (char *)target.buf + 1;
+
+	q = memchr(target.buf, '?', target.len);
+	if (q) {
+		args->query.buf = q + 1;
+		args->query.len = end - (q + 1);
+		end = q;
+	} else {
+		args->query.buf = end;
+		args->query.len = 0;
+	}
+
+	args->rest.buf = end;
+	args->rest.len = 0;
+
+	r = route_walk(rnodes, i, s, end, args);
+	if (r == NULL && i == METHOD_HEAD) {
+		r = route_walk(rnodes, METHOD_GET, s, end, args);
+	}
+
+	return r;
+}
+
+// route_walk: matches the path from s, just past a '/', to end below node n
+struct route_t *route_walk(struct rnode_t *n, int method, char *s, char *end, struct route_args_t *args)
+{
+	struct rnode_t *c;
+	struct route_t *r;
+	char *e;
+	size_t len;
+
+	e = memchr(s, '/', end - s);
+	if (e == NULL) {
+		e = end;
+	}
+	len = e - s;
+
+	for (c = n->child; c; c = c->next) {
+		switch (c->kind) {
+		case SEG_LITERAL:
+			if (c->len != len || memcmp(c->seg, s, len) != 0) {
+				continue;
+			}
+			break;
+		case SEG_ID:
+			if (uuid_parse(s, len, args->id) != 0) {
+				continue;
+			}
+			break;
+		case SEG_REST:
+			if (c->routes[method]) {
+				args->rest.buf = s;
+				args->rest.len = end - s;
+				return c->routes[method];
+			}
+			continue;
+		}
+
+		if (e == end) {
+			r = c->routes[method];
+		} else {
+			r = route_walk(c, method, e + 1, end, args);
+		}
+
+		if (r) {
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+// query_arg: finds key in the query string, setting val to its (still encoded) value
+int query_arg(struct route_args_t *args, char *key, struct http_string_s *val)
+{
+	char *s, *end, *e, *eq;
+	size_t klen;
+
+	klen = strlen(key);
+	s = (char *)args->query.buf;
+	end = s + args->query.len;
+
+	for (; s < end; s = e + 1) {
+		e = memchr(s, '&', end - s);
+		if (e == NULL) {
+			e = end;
+		}
+
+		eq = memchr(s, '=', e - s);
+		if ((size_t)((eq ? eq : e) - s) == klen && memcmp(s, key, klen) == 0) {
+			val->buf = eq ? eq + 1 : e;
+			val->len = eq ? e - (eq + 1) : 0;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// route_metrics: GET /metrics
+int route_metrics(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args)
+{
+	return send_metrics(req, res);
+}
+
+// route_trace: GET /debug/trace, trusted clients only
+int route_trace(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args)
+{
+	if (!http_request_trusted(req)) {
+		return -1;
+	}
+
+	return send_trace(req, res);
+}
+
+// route_paste: GET /:id
+int route_paste(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args)
+{
+	return send_paste(req, res, args->id);
+}
+
+// route_head: HEAD /:id
+int route_head(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args)
+{
+	struct paste_meta_t meta;
+	int rc;
+
+	rc = get_meta(args->id, &meta);
+	if (rc < 0) {
+		return -1;
+	} else if (rc > 0) {
+		return send_error(req, res, 404);
+	}
+
+	metrics.status = 200;
+
+	// NOTE (Brian) the length is the stored size whatever the client accepts,
+	// so this is the identity response's headers and there's no Vary
+	http_response_template(res, templates[TMPL_BODY]);
+	http_response_header(res, "Content-Type", meta.mime_type);
+	http_response_length(res, meta.size);
+
+	http_respond(req, res);
+
+	return 0;
+}
+
+// route_meta: GET /:id/meta
+int route_meta(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args)
+{
+	struct paste_meta_t meta;
+	char id[UUID_STR_LEN];
+	char buf[BUFLARGE];
+	int rc, len;
+
+	rc = get_meta(args->id, &meta);
+	if (rc < 0) {
+		return -1;
+	} else if (rc > 0) {
+		return send_error(req, res, 404);
+	}
+
+	uuid_format(args->id, id);
+
+	len = snprintf(buf, sizeof buf,
+		"{\"id\":\"%.*s\",\"size\":%lld,\"type\":\"%s\",\"created\":\"%sZ\",\"sha256\":\"%s\"}\n",
+		UUID_STR_LEN, id, (long long)meta.size, meta.mime_type, meta.created, meta.sha256);
+
+	metrics.sent = len;
+	metrics.status = 200;
+
+	http_response_template(res, templates[TMPL_BODY]);
+	http_response_header(res, "Content-Type", "application/json");
+	http_response_body(res, buf, len);
+
+	http_respond(req, res);
+
+	return 0;
+}
+
+// route_upload: POST /upload
+int route_upload(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args)
+{
+	struct http_string_s body, host;
+	unsigned char uuid[UUID_BLOB_LEN];
+	char id[UUID_STR_LEN];
+	char tbuf[BUFSMALL];
+	void *data;
+	int64_t len;
+	u64 mark;
+	int fd, rc;
+
+	host = http_request_known_header(req, HTTP_HDR_HOST);
+
+	fd = http_request_body_file(req, &len);
+	if (0 <= fd) {
+		data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			ERR("Couldn't map the upload: %s\n", strerror(errno));
+			return -1;
+		}
+	} else {
+		body = http_request_body(req);
+		data = (void *)body.buf;
+		len = body.len;
+	}
+
+	mark = now_us();
+	rc = add_paste(uuid, data, len, args->remote);
+	phase_add(req, PHASE_SQLITE_INSERT, mark);
+
+	if (0 <= fd) {
+		munmap(data, len);
+	}
+
+	if (rc < 0) {
+		return -1;
+	}
+
+	http_response_template(res, templates[TMPL_UPLOAD]);
+
+	uuid_format(uuid, id);
+	snprintf(tbuf, sizeof tbuf, "http://%.*s/%.*s\n", host.len, host.buf, UUID_STR_LEN, id);
+
+	metrics.sent = strlen(tbuf);
+	metrics.status = 200;
+
+	http_response_body(res, tbuf, strlen(tbuf));
+
+	http_respond(req, res);
+
+	return 0;
+}
+
+// route_file: GET /*
+int route_file(struct http_request_s *req, struct http_response_s *res, struct route_args_t *args)
+{
+	return send_file(req, res, args->rest);
+}
+
+// request_body_len: the length of the request body, in memory or in a file
+size_t request_body_len(struct http_request_s *req)
+{
+	int64_t len;
+
+	if (http_request_body_file(req, &len) < 0) {
+		len = http_request_body(req).len;
+	}
+
+	return len;
+}
+
+// add_paste: adds a paste into the database
+int add_paste(unsigned char *uuid, void *blob, size_t len, char *remote)
+{
+	struct paste_meta_t meta;
+	sqlite3_stmt *stmt;
+	char *err;
+	char id[UUID_STR_LEN];
+	int rc;
+
+	if (new_id(uuid) < 0) {
+		ERR("Couldn't make an id!\n");
+		return -1;
+	}
+
+	uuid_format(uuid, id);
+
+	make_meta(&meta, blob, len);
+
+	// NOTE (Brian) the paste and its metadata go in together, in one
+	// transaction so it's one sync to disk and not two
+	rc = sqlite3_exec(db, "begin;", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		SQLITE_ERRMSG(rc);
+		return -1;
+	}
+
+#define ADD_INSERT_SQL ("insert into pastes (id, remote, data) values (?, ?, ?);")
+
+	// NOTE (Brian) past the begin, every failure falls through to the one
+	// rollback at the bottom, so no error leaves the transaction open
+	rc = sqlite3_prepare_v2(db, ADD_INSERT_SQL, -1, &stmt, (const char **)&err);
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_bind_text(stmt, 1, id, UUID_STR_LEN, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_bind_text(stmt, 2, remote, -1, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_bind_blob(stmt, 3, blob, len, NULL);
+	}
+	if (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_DONE) {
+		rc = SQLITE_OK;
+	}
+
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_OK) {
+		SQLITE_ERRMSG(rc);
+	} else if (put_meta(id, &meta) == 0) {
+		rc = sqlite3_exec(db, "commit;", NULL, NULL, NULL);
+		if (rc == SQLITE_OK) {
+			return 0;
+		}
+		SQLITE_ERRMSG(rc);
+	}
+
+	sqlite3_exec(db, "rollback;", NULL, NULL, NULL);
+
+	return -1;
+}
+
+// make_meta: works out the size, type and hash of a paste's data, not when it was made
+void make_meta(struct paste_meta_t *meta, void *blob, size_t len)
+{
+	unsigned char digest[SHA256_LEN];
+	int i;
+
+	meta->size = len;
+
+	content_type(meta->mime_type, sizeof meta->mime_type, blob, len, NULL);
+
+	sha256(blob, len, digest);
+	for (i = 0; i < SHA256_LEN; i++) {
+		snprintf(meta->sha256 + i * 2, 3, "%02x", digest[i]);
+	}
+}
+
+// put_meta: stores a paste's metadata
+int put_meta(char *id, struct paste_meta_t *meta)
+{
+	sqlite3_stmt *stmt;
+	char *err;
+	int rc;
+
+#define PUT_META_SQL ("insert or replace into paste_meta (id, size, mime_type, sha256) values (?, ?, ?, ?);")
+
+	rc = sqlite3_prepare_v2(db, PUT_META_SQL, -1, &stmt, (const char **)&err);
+	if (rc != SQLITE_OK) {
+		SQLITE_ERRMSG(rc);
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_bind_text(stmt, 1, id, UUID_STR_LEN, NULL);
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_bind_int64(stmt, 2, meta->size);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_bind_text(stmt, 3, meta->mime_type, -1, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_bind_text(stmt, 4, meta->sha256, -1, NULL);
+	}
+	if (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_DONE) {
+		rc = SQLITE_OK;
+	}
+
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_OK) {
+		SQLITE_ERRMSG(rc);
+		return -1;
+	}
+
+	return 0;
+}
+
+// get_meta: loads a paste's metadata without its data, returns 1 if there's no such paste
+int get_meta(unsigned char *uuid, struct paste_meta_t *meta)
+{
+	sqlite3_stmt *stmt;
+	void *blob;
+	size_t len;
+	char *err;
+	char id[UUID_STR_LEN];
+	int rc, known;
+
+	uuid_format(uuid, id);
+
+	// NOTE (Brian) ts comes before data in pastes' rows, so reading it never
+	// goes out to the overflow pages a big paste's data lives on
+#define GET_META_SQL ("select p.ts, m.size, m.mime_type, m.sha256 from pastes p left join paste_meta m on m.id = p.id where p.id = ?;")
+
+	rc = sqlite3_prepare_v2(db, GET_META_SQL, -1, &stmt, (const char **)&err);
+	if (rc != SQLITE_OK) {
+		SQLITE_ERRMSG(rc);
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_bind_text(stmt, 1, id, sizeof id, NULL);
+	if (rc != SQLITE_OK) {
+		SQLITE_ERRMSG(rc);
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return 1;
+	} else if (rc != SQLITE_ROW) {
+		SQLITE_ERRMSG(rc);
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	known = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+	if (known) {
+		meta->size = sqlite3_column_int64(stmt, 1);
+		snprintf(meta->mime_type, sizeof meta->mime_type, "%s", sqlite3_column_text(stmt, 2));
+		snprintf(meta->sha256, sizeof meta->sha256, "%s", sqlite3_column_text(stmt, 3));
+	}
+	snprintf(meta->created, sizeof meta->created, "%s", sqlite3_column_text(stmt, 0));
+
+	sqlite3_finalize(stmt);
+
+	if (!known) { // from before paste_meta, work it out this once
+		rc = get_paste(uuid, &blob, &len);
+		if (rc != 0) {
+			return rc;
+		}
+
+		make_meta(meta, blob, len);
+		free(blob);
+
+		if (put_meta(id, meta) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// new_id: makes a random (version 4) uuid for a new paste, returns -1 if it can't
+int new_id(unsigned char *uuid)
+{
+	ssize_t n;
+	size_t got;
+	pid_t pid;
+
+	pid = getpid();
+
+	if (idrand.pid != pid || idrand.used == sizeof idrand.buf) {
+		for (got = 0; got < sizeof idrand.buf; got += n) {
+			n = getrandom(idrand.buf + got, sizeof idrand.buf - got, 0);
+			if (n < 0) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				idrand.pid = 0;
+				return -1;
+			}
+		}
+		idrand.used = 0;
+		idrand.pid = pid;
+	}
+
+	memcpy(uuid, idrand.buf + idrand.used, UUID_BLOB_LEN);
+	memset(idrand.buf + idrand.used, 0, UUID_BLOB_LEN); // no copy of it stays behind
+	idrand.used += UUID_BLOB_LEN;
+
+	// the same version and variant bits uuid() sets
+	uuid[6] = (uuid[6] & 0x0f) | 0x40;
+	uuid[8] = (uuid[8] & 0x3f) | 0x80;
+
+	return 0;
+}
+
+// send_file: sends the file in the request, coalescing to '/index.html' from "html/"
+int send_file(struct http_request_s *req, struct http_response_s *res, struct http_string_s path)
+{
+	struct zcache_t *z;
+	struct stat st;
+	char *s;
+	char *file_data;
+	void *zdata;
+	size_t len, zlen;
+	int enc;
+	u64 mark;
+	char target[BUFLARGE];
+	char bbuf[BUFLARGE];
+	char key[BUFLARGE + BUFSMALL];
+	char mime_type[BUFSMALL];
+
+#define DEFAULT_FILE ("index.html")
+
+	memset(target, 0, sizeof target);
+	memset(bbuf, 0, sizeof bbuf);
+
+	strncpy(target, path.buf, MIN((size_t)path.len, sizeof(target) - 1));
+
+	s = strstr(target, "..");
+	if (s) { // check for people being naughty?
+		return -1;
+	}
+
+	if (strlen(target) == 0) {
+		strncpy(target, DEFAULT_FILE, sizeof target);
+	}
+
+	snprintf(bbuf, sizeof bbuf, "html/%.4000s", target);
+
+	if (stat(bbuf, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+
+	enc = pick_encoding(req);
+	z = NULL;
+
+	snprintf(key, sizeof key, "file:%s", bbuf);
+
+	if (enc != ENC_IDENTITY) {
+		z = zcache_get(key, enc, st.st_mtime);
+		if (z && z->data) {
+			return send_body(req, res, z->mime_type, enc, z->data, z->len, 1, NULL);
+		}
+	}
+
+	file_data = sys_readfile(bbuf, &len);
+	if (file_data == NULL) {
+		return -1;
+	}
+
+	mark = now_us();
+	content_type(mime_type, sizeof mime_type, file_data, len, ext_type(bbuf));
+	phase_add(req, PHASE_MIME, mark);
+
+	if (enc != ENC_IDENTITY && z == NULL && is_compressible(mime_type) && COMPRESS_MIN_SIZE <= len) {
+		mark = now_us();
+		compress_buffer(enc, file_data, len, &zdata, &zlen);
+		phase_add(req, PHASE_COMPRESS, mark);
+		z = zcache_put(key, enc, st.st_mtime, mime_type, zdata, zlen);
+	}
+
+	// the cached body is copied if the socket can't take it all at once, the
+	// file contents we hand over outright
+	if (z && z->data) {
+		send_body(req, res, mime_type, enc, z->data, z->len, 1, NULL);
+		free(file_data);
+	} else {
+		send_body(req, res, mime_type, ENC_IDENTITY, file_data, len,
+			is_compressible(mime_type) && COMPRESS_MIN_SIZE <= len, free);
+	}
+
+	return 0;
+}
+
+// send_error: sends an error
+int send_error(struct http_request_s *req, struct http_response_s *res, int errcode)
+{
+	metrics.status = errcode;
+
+	switch (errcode) {
+	case 404:
+		http_response_template(res, templates[TMPL_NOT_FOUND]);
+		break;
+	case 503:
+		http_response_template(res, templates[TMPL_UNAVAILABLE]);
+		break;
+	default:
+		http_response_status(res, errcode);
+		break;
+	}
+	http_respond(req, res);
+
+	return 0;
+}
+
+// send_body: sends a 200 with the given (possibly encoded) body, handing data to release if non-NULL
+int send_body(struct http_request_s *req, struct http_response_s *res, char *mime_type, int enc, void *data, size_t len, int vary, void (*release)(void *))
+{
+	metrics.sent = len;
+	metrics.status = 200;
+
+	http_response_template(res, templates[vary ? TMPL_BODY_VARY : TMPL_BODY]);
+	http_response_header(res, "Content-Type", mime_type);
+	if (enc != ENC_IDENTITY) {
+		http_response_header(res, "Content-Encoding", enc_names[enc]);
+	}
+	if (release) {
+		http_response_body_owned(res, data, len, release);
+	} else {
+		http_response_body(res, data, len);
+	}
+
+	http_respond(req, res);
+
+	return 0;
+}
+
+// send_paste: sends the given paste to the requester
+int send_paste(struct http_request_s *req, struct http_response_s *res, unsigned char *uuid)
+{
+	struct zcache_t *z;
+	void *blob, *zdata;
+	size_t len, zlen;
+	int enc;
+	int rc;
+	u64 mark;
+	char key[BUFSMALL];
+	char type[BUFSMALL];
+
+	enc = pick_encoding(req);
+	z = NULL;
+
+	memcpy(key, "paste:", 6);
+	uuid_format(uuid, key + 6);
+	key[6 + UUID_STR_LEN] = '\0';
+
+	// pastes are immutable, so a cached encoding never has to touch the database
+	if (enc != ENC_IDENTITY) {
+		z = zcache_get(key, enc, 0);
+		if (z && z->data) {
+			return send_body(req, res, z->mime_type, enc, z->data, z->len, 1, NULL);
+		}
+	}
+
+	mark = now_us();
+	rc = get_paste(uuid, &blob, &len);
+	phase_add(req, PHASE_SQLITE_SELECT, mark);
+	if (rc < 0) {
+		return rc;
+	} else if (rc > 0) {
+		return send_error(req, res, 404);
+	}
+
+	mark = now_us();
+	content_type(type, sizeof type, blob, len, NULL);
+	phase_add(req, PHASE_MIME, mark);
+
+	if (enc != ENC_IDENTITY && z == NULL && is_compressible(type) && COMPRESS_MIN_SIZE <= len) {
+		mark = now_us();
+		compress_buffer(enc, blob, len, &zdata, &zlen);
+		phase_add(req, PHASE_COMPRESS, mark);
+		z = zcache_put(key, enc, 0, type, zdata, zlen);
+	}
+
+	if (z && z->data) {
+		send_body(req, res, type, enc, z->data, z->len, 1, NULL);
+		free(blob);
+	} else {
+		send_body(req, res, type, ENC_IDENTITY, blob, len,
+			is_compressible(type) && COMPRESS_MIN_SIZE <= len, free);
+	}
+
+	return 0;
+}
+
+// pick_encoding: chooses a content-coding from the request's Accept-Encoding
+int pick_encoding(struct http_request_s *req)
+{
+	struct http_string_s h;
+	char *s, *tok, *q;
+	double qval, best_q;
+	int enc, best;
+	char buf[BUFLARGE];
+
+	h = http_request_known_header(req, HTTP_HDR_ACCEPT_ENCODING);
+	if (h.len <= 0 || sizeof(buf) <= (size_t)h.len) {
+		return ENC_IDENTITY;
+	}
+
+	memcpy(buf, h.buf, h.len);
+	buf[h.len] = 0;
+
+	mklower(buf);
+
+	best = ENC_IDENTITY;
+	best_q = 0;
+
+	// NOTE (Brian) something like "gzip;q=0.8, deflate, br;q=0" - we take the
+	// highest q-value we can produce, preferring gzip on a tie
+	for (s = buf; s;) {
+		tok = ltrim(bstrtok(&s, ","));
+
+		qval = 1.0;
+
+		q = strchr(tok, ';');
+		if (q) {
+			*q++ = 0;
+			q = ltrim(q);
+			if (strncmp(q, "q=", 2) == 0) {
+				qval = atof(q + 2);
+			}
+		}
+
+		if (*tok == 0) {
+			continue;
+		}
+
+		rtrim(tok);
+
+		if (streq(tok, "gzip") || streq(tok, "x-gzip") || streq(tok, "*")) {
+			enc = ENC_GZIP;
+		} else if (streq(tok, "deflate")) {
+			enc = ENC_DEFLATE;
+		} else {
+			continue;
+		}
+
+		if (best_q < qval || (0 < qval && best_q == qval && enc == ENC_GZIP)) {
+			best = enc;
+			best_q = qval;
+		}
+	}
+
+	return best;
+}
+
+// is_compressible: returns true if the mime type is worth compressing
+int is_compressible(char *mime_type)
+{
+	size_t i;
+
+	char *prefixes[] = {
+		  "text/"
+		, "application/json"
+		, "application/javascript"
+		, "application/xml"
+		, "image/svg+xml"
+	};
+
+	for (i = 0; i < ARRSIZE(prefixes); i++) {
+		if (strncmp(mime_type, prefixes[i], strlen(prefixes[i])) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// compress_buffer: compresses src with the given encoding, returns -1 if it didn't shrink
+int compress_buffer(int enc, void *src, size_t len, void **dst, size_t *dstlen)
+{
+	z_stream zs;
+	int rc;
+
+	*dst = NULL;
+	*dstlen = 0;
+
+	memset(&zs, 0, sizeof zs);
+
+	// windowBits + 16 gets us a gzip wrapper, plain gets the zlib wrapper that
+	// HTTP calls "deflate"
+	rc = deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, enc == ENC_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) {
+		return -1;
+	}
+
+	*dstlen = deflateBound(&zs, len);
+	*dst = malloc(*dstlen);
+	if (*dst == NULL) {
+		deflateEnd(&zs);
+		return -1;
+	}
+
+	zs.next_in = src;
+	zs.avail_in = len;
+	zs.next_out = *dst;
+	zs.avail_out = *dstlen;
+
+	rc = deflate(&zs, Z_FINISH);
+
+	*dstlen = zs.total_out;
+
+	deflateEnd(&zs);
+
+	if (rc != Z_STREAM_END || len <= *dstlen) {
+		free(*dst);
+		*dst = NULL;
+		*dstlen = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+// zcache_evict: frees a cache slot
+void zcache_evict(struct zcache_t *z)
+{
+	zcache_bytes -= z->len;
+	free(z->data);
+	memset(z, 0, sizeof(*z));
+}
+
+// zcache_get: fetches a cached, encoded body; returns NULL on a miss
+struct zcache_t *zcache_get(char *key, int enc, time_t mtime)
+{
+	size_t i;
+
+	// NOTE a hit with NULL data means we already tried, and it didn't compress
+
+	for (i = 0; i < ARRSIZE(zcache); i++) {
+		if (zcache[i].enc == enc && streq(zcache[i].key, key)) {
+			if (zcache[i].mtime != mtime) {
+				zcache_evict(zcache + i);
+				return NULL;
+			}
+			zcache[i].used = ++zcache_tick;
+			return zcache + i;
+		}
+	}
+
+	return NULL;
+}
+
+// zcache_put: stores an encoded body in the cache, taking ownership of data
+struct zcache_t *zcache_put(char *key, int enc, time_t mtime, char *mime_type, void *data, size_t len)
+{
+	struct zcache_t *z, *lru;
+	size_t i;
+
+	if (sizeof(z->key) <= strlen(key) || ZCACHE_MAX_BYTES < len) {
+		free(data);
+		return NULL;
+	}
+
+	for (;;) {
+		z = lru = NULL;
+
+		for (i = 0; i < ARRSIZE(zcache); i++) {
+			if (zcache[i].key[0] == 0) {
+				z = z ? z : zcache + i;
+			} else if (lru == NULL || zcache[i].used < lru->used) {
+				lru = zcache + i;
+			}
+		}
+
+		if (z && zcache_bytes + len <= ZCACHE_MAX_BYTES) {
+			break;
+		}
+
+		zcache_evict(lru);
+	}
+
+	snprintf(z->key, sizeof z->key, "%s", key);
+	snprintf(z->mime_type, sizeof z->mime_type, "%s", mime_type);
+	z->enc = enc;
+	z->mtime = mtime;
+	z->data = data;
+	z->len = len;
+	z->used = ++zcache_tick;
+
+	zcache_bytes += len;
+
+	return z;
+}
+
+// content_type: writes the mime type of data into out, ext_type stands in for text/plain if non-NULL
+void content_type(char *out, size_t size, void *data, size_t len, char *ext_type)
+{
+	char *charset;
+	int ct;
+
+	ct = classify(data, len, &charset);
+
+	if (ct == CT_UNKNOWN) {
+		pthread_mutex_lock(&magic_lock);
+		snprintf(out, size, "%s", magic_buffer(MAGIC_COOKIE, data, MIN(len, MAGIC_PREFIX)));
+		pthread_mutex_unlock(&magic_lock);
+	} else if (ext_type && (ct == CT_TEXT || ct == CT_JSON)) {
+		snprintf(out, size, "%s; charset=%s", ext_type, charset);
+	} else {
+		snprintf(out, size, "%s; charset=%s", ct_names[ct], charset);
+	}
+}
+
+// classify: recognizes the common types from their first bytes, sets the charset if it does
+int classify(void *data, size_t len, char **charset)
+{
+	unsigned char *s;
+	size_t i;
+
+	s = data;
+	*charset = "binary";
+
+	if (8 <= len && memcmp(s, "\x89PNG\r\n\x1a\n", 8) == 0) {
+		return CT_PNG;
+	}
+	if (3 <= len && memcmp(s, "\xff\xd8\xff", 3) == 0) {
+		return CT_JPEG;
+	}
+	if (6 <= len && (memcmp(s, "GIF87a", 6) == 0 || memcmp(s, "GIF89a", 6) == 0)) {
+		return CT_GIF;
+	}
+	if (3 <= len && memcmp(s, "\x1f\x8b\x08", 3) == 0) {
+		return CT_GZIP;
+	}
+	if (4 <= len && (memcmp(s, "PK\x03\x04", 4) == 0 || memcmp(s, "PK\x05\x06", 4) == 0)) {
+		// NOTE (Brian) jars, docx, odt and the like are zips too, and libmagic
+		// tells them apart by the first entry's name, so only call it a zip if
+		// that's not one of the special ones
+		if (30 <= len && (memcmp(s + 30, "mimetype", 8) == 0 || memcmp(s + 30, "[Content_Types].xml", 19) == 0
+			|| memcmp(s + 30, "META-INF/", 9) == 0)) {
+			return CT_UNKNOWN;
+		}
+		return CT_ZIP;
+	}
+	if (5 <= len && memcmp(s, "%PDF-", 5) == 0) {
+		return CT_PDF;
+	}
+	if (18 <= len && memcmp(s, "\x7f" "ELF", 4) == 0) {
+		// e_type, executables only, libmagic has names of its own for the rest
+		if ((s[5] == 1 ? s[16] | s[17] << 8 : s[17] | s[16] << 8) == 2) {
+			return CT_ELF;
+		}
+		return CT_UNKNOWN;
+	}
+
+	if (len == 0 || (*charset = text_charset(s, len)) == NULL) {
+		*charset = NULL;
+		return CT_UNKNOWN;
+	}
+
+	for (i = 0; i < len && isspace(s[i]); i++)
+		;
+	if (i < len && (s[i] == '{' || s[i] == '[') && is_json(s + i, len - i)) {
+		return CT_JSON;
+	}
+
+	// NOTE (Brian) scripts, PostScript, xml and the like say what they are
+	// on the first line, so libmagic gets those
+	if ((2 <= len && memcmp(s, "#!", 2) == 0) || (2 <= len && memcmp(s, "%!", 2) == 0)
+		|| (5 <= len && memcmp(s, "<?xml", 5) == 0)) {
+		return CT_UNKNOWN;
+	}
+
+	return CT_TEXT;
+}
+
+// text_run: the length of the run of printable ascii, tabs and newlines at the start of s
+size_t text_run(unsigned char *s, size_t len)
+{
+	size_t i;
+
+	i = 0;
+
+	// NOTE (Brian) signed, bytes over 0x7f are negative, so one compare
+	// against ' ' - 1 catches them along with the control characters, and
+	// then tabs, newlines and carriage returns are let back in
+#if defined(__AVX2__) && !defined(HTTP_NO_SIMD)
+	__m256i lo32 = _mm256_set1_epi8(' ' - 1);
+	__m256i del32 = _mm256_set1_epi8(0x7f);
+	__m256i tab32 = _mm256_set1_epi8('\t');
+	__m256i nl32 = _mm256_set1_epi8('\n');
+	__m256i cr32 = _mm256_set1_epi8('\r');
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i const *)(s + i));
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo32), _mm256_cmpgt_epi8(del32, v));
+		ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, tab32));
+		ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, nl32));
+		ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, cr32));
+		uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(ok);
+		if (stop) {
+			return i + __builtin_ctz(stop);
+		}
+	}
+#endif
+#if defined(__SSE2__) && !defined(HTTP_NO_SIMD)
+	__m128i lo16 = _mm_set1_epi8(' ' - 1);
+	__m128i del16 = _mm_set1_epi8(0x7f);
+	__m128i tab16 = _mm_set1_epi8('\t');
+	__m128i nl16 = _mm_set1_epi8('\n');
+	__m128i cr16 = _mm_set1_epi8('\r');
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(s + i));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo16), _mm_cmplt_epi8(v, del16));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, tab16));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, nl16));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, cr16));
+		uint32_t stop = ~(uint32_t)_mm_movemask_epi8(ok) & 0xffff;
+		if (stop) {
+			return i + __builtin_ctz(stop);
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if ((s[i] < ' ' || 0x7e < s[i]) && s[i] != '\t' && s[i] != '\n' && s[i] != '\r') {
+			break;
+		}
+	}
+
+	return i;
+}
+
+// text_charset: "us-ascii" or "utf-8" if data is all text, NULL if it isn't
+char *text_charset(unsigned char *s, size_t len)
+{
+	size_t i;
+	int n, utf8;
+
+	utf8 = 0;
+
+	for (i = 0; ; i += n) {
+		i += text_run(s + i, len - i);
+		if (i == len) {
+			break;
+		}
+
+		if (s[i] < 0x80) {
+			// the rest of what libmagic takes for text, bell, backspace,
+			// vertical tab, form feed and escape
+			if (!(s[i] == 0x07 || s[i] == 0x08 || s[i] == 0x0b || s[i] == 0x0c || s[i] == 0x1b)) {
+				return NULL;
+			}
+			n = 1;
+		} else {
+			n = utf8_len(s + i, len - i);
+			if (n == 0) {
+				return NULL;
+			}
+			utf8 = 1;
+		}
+	}
+
+	return utf8 ? "utf-8" : "us-ascii";
+}
+
+// utf8_len: the length of the utf-8 sequence at the start of s, 0 if it isn't one
+int utf8_len(unsigned char *s, size_t len)
+{
+	unsigned char lo, hi;
+	int n, i;
+
+	lo = 0x80;
+	hi = 0xbf;
+
+	if (0xc2 <= s[0] && s[0] <= 0xdf) {
+		n = 2;
+	} else if (0xe0 <= s[0] && s[0] <= 0xef) {
+		n = 3;
+		if (s[0] == 0xe0) { // overlong
+			lo = 0xa0;
+		} else if (s[0] == 0xed) { // surrogates
+			hi = 0x9f;
+		}
+	} else if (0xf0 <= s[0] && s[0] <= 0xf4) {
+		n = 4;
+		if (s[0] == 0xf0) { // overlong
+			lo = 0x90;
+		} else if (s[0] == 0xf4) { // past U+10FFFF
+			hi = 0x8f;
+		}
+	} else {
+		return 0;
+	}
+
+	if (len < (size_t)n || s[1] < lo || hi < s[1]) {
+		return 0;
+	}
+
+	for (i = 2; i < n; i++) {
+		if (s[i] < 0x80 || 0xbf < s[i]) {
+			return 0;
+		}
+	}
+
+	return n;
+}
+
+// is_json: returns true if the text looks like a JSON object or array
+int is_json(unsigned char *s, size_t len)
+{
+	size_t i;
+	int depth, instr;
+
+	// NOTE (Brian) not a parser, this only checks the brackets balance
+	// outside of strings and that nothing but JSON's own tokens sit between
+	// them, over the first JSON_SCAN bytes
+	depth = 0;
+	instr = 0;
+
+	for (i = 0; i < len && i < JSON_SCAN; i++) {
+		if (instr) {
+			if (s[i] == '\\') {
+				i++;
+			} else if (s[i] == '"') {
+				instr = 0;
+			}
+			continue;
+		}
+
+		switch (s[i]) {
+		case '{': case '[':
+			depth++;
+			break;
+		case '}': case ']':
+			if (--depth < 0) {
+				return 0;
+			}
+			if (depth == 0) { // the end, only whitespace may follow
+				for (i++; i < len && isspace(s[i]); i++)
+					;
+				return i == len;
+			}
+			break;
+		case '"':
+			instr = 1;
+			break;
+		case ' ': case '\t': case '\n': case '\r': case ',': case ':':
+		case '0': case '1': case '2': case '3': case '4': case '5': case '6':
+		case '7': case '8': case '9': case '.': case '-': case '+': case 'e':
+		case 'E': case 't': case 'r': case 'u': case 'f': case 'a': case 'l':
+		case 's': case 'n':
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return len > JSON_SCAN;
+}
+
+// ext_type: the mime type for a static file's extension, NULL if we don't know it
+char *ext_type(char *path)
+{
+	size_t i;
+	char *ext;
+
+	ext = strrchr(path, '.');
+	if (ext == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < ARRSIZE(ext_types); i++) {
+		if (streq(ext, ext_types[i][0])) {
+			return ext_types[i][1];
+		}
+	}
+
+	return NULL;
+}
+
+// now_us: monotonic microseconds
+u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// hist_add: records a value in microseconds
+void hist_add(struct hist_t *h, u64 us)
+{
+	int i, e;
+
+	// NOTE (Brian) the HIST_SUB_BITS bits under the leading one pick the
+	// bucket within its power of two, values under HIST_SUB get one each
+	if (us < HIST_SUB) {
+		i = us;
+	} else {
+		e = 63 - __builtin_clzll(us);
+		i = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((us >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	}
+
+	if (HIST_BUCKETS <= i) {
+		i = HIST_BUCKETS - 1;
+	}
+
+	h->buckets[i]++;
+	h->count++;
+	h->sum += us;
+}
+
+// hist_bound: the upper bound of bucket i in microseconds, what's in it is shorter
+u64 hist_bound(int i)
+{
+	int e;
+
+	if (i < HIST_SUB) {
+		return i + 1;
+	}
+
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+
+	return (u64)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS);
+}
+
+// sbprintf: printf onto the end of a strbuf_t, growing it as needed
+void sbprintf(struct strbuf_t *sb, char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;) {
+		va_start(args, fmt);
+		n = vsnprintf(sb->buf + sb->len, sb->cap - sb->len, fmt, args);
+		va_end(args);
+
+		if (n < 0 || (size_t)n < sb->cap - sb->len) {
+			break;
+		}
+
+		sb->cap = sb->cap ? sb->cap * 2 : BUFLARGE * 16;
+		sb->buf = realloc(sb->buf, sb->cap);
+	}
+
+	if (0 < n) {
+		sb->len += n;
+	}
+}
+
+// sbhist: appends a histogram in the Prometheus text format
+void sbhist(struct strbuf_t *sb, char *name, char *label, char *value, struct hist_t *h)
+{
+	u64 n;
+	int i;
+
+	n = 0;
 
-#define PORT (5000)
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		n += h->buckets[i];
+		sbprintf(sb, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n",
+			name, label, value, hist_bound(i) / 1e6, n);
+	}
 
-static magic_t MAGIC_COOKIE;
+	sbprintf(sb, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value, h->count);
+	sbprintf(sb, "%s_sum{%s=\"%s\"} %g\n", name, label, value, h->sum / 1e6);
+	sbprintf(sb, "%s_count{%s=\"%s\"} %llu\n", name, label, value, h->count);
+}
 
-static sqlite3 *db;
+// send_metrics: sends the counters and histograms as Prometheus text
+int send_metrics(struct http_request_s *req, struct http_response_s *res)
+{
+	struct http_server_stats_s ss;
+	struct http_pool_stats_s ps;
+	struct http_admission_stats_s as;
+	struct strbuf_t sb;
+	int i;
 
-// init: initializes the program
-void init(char *db_file_name, char *sql_file_name);
+	http_server_stats(server, &ss);
+	http_server_pool_stats(server, &ps);
+	http_server_admission_stats(server, &as);
 
-void cleanup(void);
+	memset(&sb, 0, sizeof sb);
 
-// create_tables: execs create * statements on the database
-int create_tables(sqlite3 *db, char *fname);
+	sbprintf(&sb, "# HELP paste_request_duration_seconds Time spent answering a request, by route.\n");
+	sbprintf(&sb, "# TYPE paste_request_duration_seconds histogram\n");
+	for (i = 0; i < ROUTE_TOTAL; i++) {
+		sbhist(&sb, "paste_request_duration_seconds", "route", route_names[i], &metrics.latency[i]);
+	}
 
-// is_uuid: returns true if the input string is a uuid
-int is_uuid(char *id);
+	sbprintf(&sb, "# HELP paste_phase_duration_seconds Time spent in the database, libmagic and zlib.\n");
+	sbprintf(&sb, "# TYPE paste_phase_duration_seconds histogram\n");
+	for (i = 0; i < PHASE_TOTAL; i++) {
+		sbhist(&sb, "paste_phase_duration_seconds", "phase", phase_names[i], &metrics.phases[i]);
+	}
 
-// request_handler: the http request handler
-void request_handler(struct http_request_s *req);
+	sbprintf(&sb, "# HELP paste_request_body_bytes_total Request body bytes received, by route.\n");
+	sbprintf(&sb, "# TYPE paste_request_body_bytes_total counter\n");
+	for (i = 0; i < ROUTE_TOTAL; i++) {
+		sbprintf(&sb, "paste_request_body_bytes_total{route=\"%s\"} %llu\n", route_names[i], metrics.bytes_in[i]);
+	}
 
-// SERVER FUNCTIONS
-// send_paste: sends the given paste to the requester
-int send_paste(struct http_request_s *req, struct http_response_s *res, char *id);
-// add_paste: adds a paste into the database
-int add_paste(char **id, void *blob, size_t len);
-// get_paste: loads the entire blob into memory
-int get_paste(char *id, void **blob, size_t *len);
-// send_file: sends the file in the request, coalescing to '/index.html' from "html/"
-int send_file(struct http_request_s *req, struct http_response_s *res);
-// send_error: sends an error
-int send_error(struct http_request_s *req, struct http_response_s *res, int errcode);
+	sbprintf(&sb, "# HELP paste_response_body_bytes_total Response body bytes sent, by route.\n");
+	sbprintf(&sb, "# TYPE paste_response_body_bytes_total counter\n");
+	for (i = 0; i < ROUTE_TOTAL; i++) {
+		sbprintf(&sb, "paste_response_body_bytes_total{route=\"%s\"} %llu\n", route_names[i], metrics.bytes_out[i]);
+	}
 
-#define SQLITE_ERRMSG(x) (fprintf(stderr, "Error: %s\n", sqlite3_errstr(rc)))
+	sbprintf(&sb, "# HELP paste_connections Connections open now.\n");
+	sbprintf(&sb, "# TYPE paste_connections gauge\n");
+	sbprintf(&sb, "paste_connections %lld\n", (s64)ss.connections);
+	sbprintf(&sb, "# HELP paste_connections_accepted_total Connections accepted.\n");
+	sbprintf(&sb, "# TYPE paste_connections_accepted_total counter\n");
+	sbprintf(&sb, "paste_connections_accepted_total %lld\n", (s64)ss.accepted);
+	sbprintf(&sb, "# HELP paste_requests_total Requests handed to the handler, scrapes included.\n");
+	sbprintf(&sb, "# TYPE paste_requests_total counter\n");
+	sbprintf(&sb, "paste_requests_total %lld\n", (s64)ss.requests);
+	sbprintf(&sb, "# HELP paste_memused_bytes Request and response buffer bytes in use.\n");
+	sbprintf(&sb, "# TYPE paste_memused_bytes gauge\n");
+	sbprintf(&sb, "paste_memused_bytes %lld\n", (s64)ss.memused);
+
+	sbprintf(&sb, "# HELP paste_pool_bytes Bytes in the buffer pool, handed out or sitting free.\n");
+	sbprintf(&sb, "# TYPE paste_pool_bytes gauge\n");
+	sbprintf(&sb, "paste_pool_bytes{state=\"used\"} %lld\n", (s64)ps.used_bytes);
+	sbprintf(&sb, "paste_pool_bytes{state=\"free\"} %lld\n", (s64)ps.free_bytes);
+	sbprintf(&sb, "# HELP paste_pool_gets_total Buffers asked of the pool, by whether it had one.\n");
+	sbprintf(&sb, "# TYPE paste_pool_gets_total counter\n");
+	sbprintf(&sb, "paste_pool_gets_total{result=\"hit\"} %lld\n", (s64)ps.hits);
+	sbprintf(&sb, "paste_pool_gets_total{result=\"miss\"} %lld\n", (s64)ps.misses);
+
+	sbprintf(&sb, "# HELP paste_loop_lag_seconds Event loop lag at the last probe.\n");
+	sbprintf(&sb, "# TYPE paste_loop_lag_seconds gauge\n");
+	sbprintf(&sb, "paste_loop_lag_seconds %g\n", as.lag / 1e6);
+	sbprintf(&sb, "# HELP paste_overloaded 1 while load is being shed.\n");
+	sbprintf(&sb, "# TYPE paste_overloaded gauge\n");
+	sbprintf(&sb, "paste_overloaded %lld\n", (s64)as.overloaded);
+	sbprintf(&sb, "# HELP paste_shed_total Requests turned away, by reason.\n");
+	sbprintf(&sb, "# TYPE paste_shed_total counter\n");
+	sbprintf(&sb, "paste_shed_total{reason=\"lag\"} %lld\n", (s64)(as.shed_requests + as.shed_uploads));
+	sbprintf(&sb, "paste_shed_total{reason=\"upload_cap\"} %lld\n", (s64)as.shed_capped);
+	sbprintf(&sb, "paste_shed_total{reason=\"rate_limit\"} %lld\n", (s64)as.shed_rate);
+
+	sbprintf(&sb, "# HELP paste_access_log_dropped_total Access log lines dropped because the ring was full.\n");
+	sbprintf(&sb, "# TYPE paste_access_log_dropped_total counter\n");
+	sbprintf(&sb, "paste_access_log_dropped_total %llu\n", atomic_load_explicit(&alog.dropped, memory_order_relaxed));
+
+	sbprintf(&sb, "# HELP paste_zcache_bytes Bytes of compressed bodies cached.\n");
+	sbprintf(&sb, "# TYPE paste_zcache_bytes gauge\n");
+	sbprintf(&sb, "paste_zcache_bytes %zu\n", zcache_bytes);
+
+	metrics.sent = sb.len;
+	metrics.status = 200;
 
-#define USAGE ("USAGE: %s <dbname>\n")
+	http_response_status(res, 200);
+	http_response_header(res, "Content-Type", "text/plain; version=0.0.4");
+	http_response_body_owned(res, sb.buf, sb.len, free);
 
-int main(int argc, char **argv)
+	http_respond(req, res);
+
+	return 0;
+}
+
+// alog_open: opens the access log and starts its writer, returns -1 if it can't
+int alog_open(char *path)
 {
-	struct http_server_s *server;
+	sigset_t set;
 
-	if (argc < 2) {
-		fprintf(stderr, USAGE, argv[0]);
-		return 1;
+	alog.fp = fopen(path, "a");
+	if (alog.fp == NULL) {
+		return -1;
 	}
 
-	init(argv[1], "schema.sql");
+	alog.path = path;
 
-	server = http_server_init(PORT, request_handler);
+	// NOTE (Brian) SIGHUP is only let through on the writer thread, so it
+	// never interrupts the event loop
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	printf("listening on http://localhost:%d\n", PORT);
+	signal(SIGHUP, alog_hup);
 
-	http_server_listen(server);
+	atomic_store(&alog.running, 1);
 
-	cleanup();
+	if (pthread_create(&alog.thread, NULL, alog_writer, NULL) != 0) {
+		atomic_store(&alog.running, 0);
+		fclose(alog.fp);
+		alog.fp = NULL;
+		return -1;
+	}
 
 	return 0;
 }
 
-// request_handler: the http request handler
-void request_handler(struct http_request_s *req)
+// alog_close: writes out what's left in the ring and stops the writer
+void alog_close(void)
 {
-	struct http_response_s *res;
-	struct http_string_s m, t;
-	struct http_string_s body;
-	struct http_string_s h;
-	char *method, *target;
-	char *host;
-	char *id;
-	int rc;
-	char tbuf[BUFSMALL];
+	if (!atomic_load(&alog.running)) {
+		return;
+	}
 
-	res = http_response_init();
+	atomic_store(&alog.running, 0);
+	pthread_join(alog.thread, NULL);
 
-	m = http_request_method(req);
-	t = http_request_target(req);
-	h = http_request_header(req, "Host");
-	body = http_request_body(req);
-
-	method = strndup(m.buf, m.len);
-	target = strndup(t.buf, t.len);
-	host   = strndup(h.buf, h.len);
-
-	if (streq(method, "GET")) {
-		if (is_uuid(target + 1)) { // getting a paste
-			rc = send_paste(req, res, target + 1);
-			if (rc < 0) {
-				send_error(req, res, 503);
-			}
-		} else {
-			rc = send_file(req, res);
-			if (rc < 0) {
-				send_error(req, res, 404);
+	fclose(alog.fp);
+	alog.fp = NULL;
+}
+
+// alog_add: the server's access log hook, queues the request's line or drops it if the ring is full
+void alog_add(struct http_trace_s *t)
+{
+	struct alog_entry_t *e;
+	u64 head, tail;
+
+	if (!atomic_load_explicit(&alog.running, memory_order_relaxed)) {
+		return;
+	}
+
+	tail = atomic_load_explicit(&alog.tail, memory_order_relaxed);
+	head = atomic_load_explicit(&alog.head, memory_order_acquire);
+
+	if (tail - head == ALOG_SLOTS) {
+		atomic_fetch_add_explicit(&alog.dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	e = alog.entries + (tail & (ALOG_SLOTS - 1));
+
+	clock_gettime(CLOCK_REALTIME, &e->ts);
+	e->bytes = t->bytes;
+	e->bytes_in = t->received;
+	e->duration = (t->written ? t->written : (s64)now_us()) - t->start;
+	e->status = t->status;
+	e->reset = t->reset;
+
+	snprintf(e->method, sizeof e->method, "%s", t->method);
+	snprintf(e->remote, sizeof e->remote, "%s", t->peer);
+	snprintf(e->target, sizeof e->target, "%s", t->target);
+
+	atomic_store_explicit(&alog.tail, tail + 1, memory_order_release);
+}
+
+// alog_writer: the writer thread, drains the ring into the file
+void *alog_writer(void *arg)
+{
+	struct timespec idle;
+	sigset_t set;
+	u64 head, tail, dropped, reported;
+	int running;
+
+	idle.tv_sec = 0;
+	idle.tv_nsec = ALOG_IDLE_MS * 1000000L;
+
+	reported = 0;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	for (;;) {
+		// NOTE (Brian) read running before the ring, so whatever was pushed
+		// before alog_close still gets written out
+		running = atomic_load(&alog.running);
+
+		if (alog_reopen) {
+			alog_reopen = 0;
+			fclose(alog.fp);
+			alog.fp = fopen(alog.path, "a");
+			if (alog.fp == NULL) { // nowhere to write, so keep going with nowhere
+				alog.fp = fopen("/dev/null", "a");
 			}
 		}
-	} else if (streq(method, "POST") && streq(target, "/upload")) {
-		rc = add_paste(&id, (void *)body.buf, body.len);
-		if (rc < 0) {
-			send_error(req, res, 503);
-		}
 
-		http_response_status(res, 200);
-		http_response_header(res, "Content-Type", "text/plain");
+		head = atomic_load_explicit(&alog.head, memory_order_relaxed);
+		tail = atomic_load_explicit(&alog.tail, memory_order_acquire);
 
-		snprintf(tbuf, sizeof tbuf, "http://%s/%s\n", host, id);
+		for (; head != tail; head++) {
+			alog_write(alog.fp, alog.entries + (head & (ALOG_SLOTS - 1)));
+			atomic_store_explicit(&alog.head, head + 1, memory_order_release);
+		}
 
-		http_response_body(res, tbuf, strlen(tbuf));
+		dropped = atomic_load_explicit(&alog.dropped, memory_order_relaxed);
+		if (reported < dropped) {
+			fprintf(alog.fp, "{\"dropped\":%llu}\n", dropped - reported);
+			reported = dropped;
+		}
 
-		http_respond(req, res);
+		fflush(alog.fp);
 
-		free(id);
-	} else {
-		send_error(req, res, 404);
+		if (!running) {
+			break;
+		}
+
+		nanosleep(&idle, NULL);
 	}
 
-	free(host);
-	free(target);
-	free(method);
+	return arg;
 }
 
-// add_paste: adds a paste into the database
-int add_paste(char **id, void *blob, size_t len)
+// alog_write: formats one entry as a line of JSON
+void alog_write(FILE *fp, struct alog_entry_t *e)
 {
-	sqlite3_stmt *stmt;
-	char *err;
-	const unsigned char *tid;
-	size_t tlen;
-	long rowid;
-	int rc;
+	struct tm tm;
+	char ts[BUFSMALL];
 
-	// NOTE (Brian) to perform this semi-effectively, we insert the blob,
-	// then we get the 'rowid' of the thing we _just_ inserted, and use that
-	// to get the uuid that the database generated for it.
+	gmtime_r(&e->ts.tv_sec, &tm);
+	strftime(ts, sizeof ts, "%Y-%m-%dT%H:%M:%S", &tm);
 
-#define ADD_INSERT_SQL ("insert into pastes (data) values (?);")
-#define ADD_SELECT_SQL ("select id from pastes where rowid = ?;")
+	fprintf(fp, "{\"ts\":\"%s.%03ldZ\",\"remote\":\"%s\",\"method\":\"",
+		ts, e->ts.tv_nsec / 1000000, e->remote);
 
-	// we do the insert first
-	rc = sqlite3_prepare_v2(db, ADD_INSERT_SQL, -1, &stmt, (const char **)&err);
-	if (rc != SQLITE_OK) {
-		SQLITE_ERRMSG(rc);
-		sqlite3_finalize(stmt);
-		return -1;
+	json_escape(fp, e->method);
+
+	fputs("\",\"target\":\"", fp);
+
+	json_escape(fp, e->target);
+
+	fprintf(fp, "\",\"status\":%d,", e->status);
+
+	if (e->reset) {
+		fprintf(fp, "\"reset\":%d,", e->reset);
 	}
 
-	rc = sqlite3_bind_blob(stmt, 1, blob, len, NULL);
-	if (rc != SQLITE_OK) {
-		SQLITE_ERRMSG(rc);
-		sqlite3_finalize(stmt);
-		return -1;
+	fprintf(fp, "\"bytes_in\":%llu,\"bytes\":%llu,\"duration_us\":%llu}\n",
+		e->bytes_in, e->bytes, e->duration);
+}
+
+// json_escape: writes a JSON string's contents, methods and targets are
+// whatever the client sent so anything that isn't printable ascii is escaped
+void json_escape(FILE *fp, char *str)
+{
+	unsigned char *s;
+
+	for (s = (unsigned char *)str; *s; s++) {
+		if (*s < 0x20 || 0x7e < *s || *s == '"' || *s == '\\') {
+			fprintf(fp, "\\u%04x", *s);
+		} else {
+			fputc(*s, fp);
+		}
 	}
+}
 
-	rc = sqlite3_step(stmt);
+// alog_hup: SIGHUP handler, has the writer reopen the file
+void alog_hup(int sig)
+{
+	alog_reopen = 1;
+}
 
-	sqlite3_finalize(stmt);
+// phase_add: records a phase that started at mark, in /metrics and the request's trace
+void phase_add(struct http_request_s *req, int phase, u64 mark)
+{
+	u64 end;
 
-	rowid = sqlite3_last_insert_rowid(db);
+	end = now_us();
 
-	// then we do the select
-	rc = sqlite3_prepare_v2(db, ADD_SELECT_SQL, -1, &stmt, (const char **)&err);
-	if (rc != SQLITE_OK) {
-		SQLITE_ERRMSG(rc);
-		sqlite3_finalize(stmt);
-		return -1;
-	}
+	hist_add(&metrics.phases[phase], end - mark);
+	http_request_trace_span(req, phase_names[phase], mark, end);
+}
 
-	rc = sqlite3_bind_int64(stmt, 1, rowid);
-	if (rc != SQLITE_OK) {
-		SQLITE_ERRMSG(rc);
-		sqlite3_finalize(stmt);
-		return -1;
+// trace_cb: called with the trace of every slow or sampled request
+void trace_cb(struct http_trace_s *t)
+{
+	int i;
+
+	if (SLOW_REQUEST_MS * 1000 < t->written - t->start) {
+		fprintf(stderr, "slow request: %s %s %d %lldB %.1fms: read %.1fms, body %.1fms, handler %.1fms",
+			t->method, t->target, t->status, (s64)t->bytes, trace_ms(t->start, t->written),
+			trace_ms(t->start, t->headers), trace_ms(t->headers, t->handler),
+			trace_ms(t->handler, t->respond));
+
+		for (i = 0; i < t->span_count; i++) {
+			fprintf(stderr, "%s%s %.1fms", i ? ", " : " (", t->spans[i].name,
+				trace_ms(t->spans[i].start, t->spans[i].end));
+		}
+
+		fprintf(stderr, "%s, write %.1fms\n", t->span_count ? ")" : "",
+			trace_ms(t->respond, t->written));
 	}
 
-	rc = sqlite3_step(stmt);
+	if (t->sampled) {
+		traces[traces_kept++ % TRACE_KEEP] = *t;
+	}
+}
 
-	sqlite3_column_text(stmt, 0);
-	tlen = sqlite3_column_bytes(stmt, 0);
-	*id = calloc(tlen, 1);
-	tid = sqlite3_column_text(stmt, 0);
+// trace_ms: milliseconds between two points of a trace, 0 if it never reached either
+double trace_ms(int64_t from, int64_t to)
+{
+	if (from == 0 || to == 0) {
+		return 0;
+	}
 
-	memcpy(*id, tid, tlen);
+	return (to - from) / 1e3;
+}
 
-	sqlite3_finalize(stmt);
+// trace_event: writes a complete ("X") trace event
+void trace_event(FILE *fp, char *name, char *cat, int tid, int64_t from, int64_t to)
+{
+	if (from == 0 || to == 0) {
+		return;
+	}
 
-	return 0;
+	fputs(",\n{\"name\":\"", fp);
+	json_escape(fp, name);
+	fprintf(fp, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d}",
+		cat, (s64)from, (s64)(to - from), tid);
 }
 
-// send_file: sends the file in the request, coalescing to '/index.html' from "html/"
-int send_file(struct http_request_s *req, struct http_response_s *res)
+// send_trace: sends the sampled traces as Chrome trace events
+int send_trace(struct http_request_s *req, struct http_response_s *res)
 {
-	struct http_string_s t;
-	char *s;
-	char *file_data;
-	char *mime_type;
+	struct http_trace_s *t;
+	FILE *fp;
+	char *buf;
 	size_t len;
-	char target[BUFLARGE];
-	char bbuf[BUFLARGE];
+	char name[BUFSMALL];
+	u64 i;
+	int j, tid;
 
-#define DEFAULT_FILE ("index.html")
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL) {
+		return send_error(req, res, 503);
+	}
 
-	memset(target, 0, sizeof target);
-	memset(bbuf, 0, sizeof bbuf);
+	// NOTE (Brian) each request gets a row (tid) of its own, and every event
+	// starts with a comma so the process name goes first
+	fputs("{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"paste\"}}", fp);
 
-	t = http_request_target(req);
+	i = traces_kept < TRACE_KEEP ? 0 : traces_kept - TRACE_KEEP;
 
-	strncpy(target, t.buf, t.len);
+	for (; i < traces_kept; i++) {
+		t = traces + i % TRACE_KEEP;
+		tid = i + 1;
 
-	s = strstr(target, "..");
-	if (s) { // check for people being naughty?
+		snprintf(name, sizeof name, "%s %s %d", t->method, t->target, t->status);
+
+		trace_event(fp, name, "request", tid, t->start, t->written);
+		trace_event(fp, "read", "server", tid, t->start, t->headers);
+		trace_event(fp, "body", "server", tid, t->headers, t->handler);
+		trace_event(fp, "handler", "server", tid, t->handler, t->respond);
+		trace_event(fp, "write", "server", tid, t->respond, t->written);
+
+		for (j = 0; j < t->span_count; j++) {
+			trace_event(fp, (char *)t->spans[j].name, "phase", tid, t->spans[j].start, t->spans[j].end);
+		}
+	}
+
+	fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+	fclose(fp);
+
+	metrics.sent = len;
+	metrics.status = 200;
+
+	http_response_status(res, 200);
+	http_response_header(res, "Content-Type", "application/json");
+	http_response_body_owned(res, buf, len, free);
+
+	http_respond(req, res);
+
+	return 0;
+}
+
+// handoff_take: takes the listening socket from a running paste, -1 if there isn't one, -2 if it didn't hand over
+int handoff_take(void)
+{
+	struct sockaddr_un addr;
+	struct timeval tv;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	char c;
+	int fd, sock;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
 		return -1;
 	}
 
-	if (strlen(target) == 1) {
-		strncpy(target, DEFAULT_FILE, sizeof target);
+	handoff_addr(&addr);
+
+	// NOTE (Brian) no one there (or a stale socket from one that crashed) is
+	// the usual case, a fresh start
+	if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		close(fd);
+		return -1;
 	}
 
-	s = target;
+	tv.tv_sec = HANDOFF_WAIT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
 
-	if (s[0] == '/') {
-		s++;
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+
+	sock = -1;
+
+	if (recvmsg(fd, &msg, 0) == 1) {
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&sock, CMSG_DATA(cmsg), sizeof sock);
+		}
 	}
 
-	snprintf(bbuf, sizeof bbuf, "html/%s", s);
+	if (0 <= sock && write(fd, "", 1) != 1) {
+		close(sock);
+		sock = -1;
+	}
 
-	if (access(bbuf, F_OK) == 0) {
-		file_data = sys_readfile(bbuf, &len);
+	close(fd);
 
-		mime_type = (char *)magic_buffer(MAGIC_COOKIE, file_data, len);
+	return sock < 0 ? -2 : sock;
+}
 
-		http_response_status(res, 200);
-		http_response_header(res, "Content-Type", mime_type);
-		http_response_header(res, "Access-Control-Allow-Origin", "*");
-		http_response_body(res, file_data, len);
+// handoff_listen: listens on HANDOFF_PATH for the next paste to hand over to, returns -1 if it can't
+int handoff_listen(void)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	int fd;
 
-		http_respond(req, res);
+	handoff_conn.handler = handoff_ready;
+	handoff_conn.fd = -1;
 
-		free(file_data);
-	} else {
-		send_error(req, res, 404);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	handoff_addr(&addr);
+
+	unlink(addr.sun_path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || chmod(addr.sun_path, 0600) < 0 || listen(fd, 1) < 0) {
+		close(fd);
+		return -1;
 	}
 
+	handoff_listener.handler = handoff_accept;
+	handoff_listener.fd = fd;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &handoff_listener;
+	epoll_ctl(http_server_loop(server), EPOLL_CTL_ADD, fd, &ev);
+
 	return 0;
 }
 
-// send_error: sends an error
-int send_error(struct http_request_s *req, struct http_response_s *res, int errcode)
+// handoff_accept: sends the listening socket to a new paste
+void handoff_accept(struct epoll_event *ev)
 {
-	http_response_status(res, errcode);
-	http_respond(req, res);
+	struct epoll_event rev;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	int fd, sock;
+
+	for (;;) {
+		fd = accept(handoff_listener.fd, NULL, NULL);
+		if (fd < 0) {
+			return;
+		}
 
-	return 0;
+		// one at a time
+		if (0 <= handoff_conn.fd) {
+			close(fd);
+			continue;
+		}
+
+		sock = http_server_socket(server);
+
+		memset(&msg, 0, sizeof msg);
+		iov.iov_base = "";
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof control.buf;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof sock);
+		memcpy(CMSG_DATA(cmsg), &sock, sizeof sock);
+
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+			close(fd);
+			continue;
+		}
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+		handoff_conn.fd = fd;
+
+		rev.events = EPOLLIN | EPOLLET;
+		rev.data.ptr = &handoff_conn;
+		epoll_ctl(http_server_loop(server), EPOLL_CTL_ADD, fd, &rev);
+	}
 }
 
-// send_paste: sends the given paste to the requester
-int send_paste(struct http_request_s *req, struct http_response_s *res, char *id)
+// handoff_ready: the new paste has the socket (or died), drains if it has
+void handoff_ready(struct epoll_event *ev)
 {
-	void *blob;
-	size_t len;
-	int rc;
-	char slen[32];
-	char type[BUFSMALL];
+	ssize_t n;
+	char c;
 
-	rc = get_paste(id, &blob, &len);
-	if (rc < 0) {
-		return rc;
+	n = read(handoff_conn.fd, &c, 1);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
 	}
 
-	snprintf(slen, sizeof slen, "%ld", len);
-	snprintf(type, sizeof type, "%s", magic_buffer(MAGIC_COOKIE, blob, len));
+	epoll_ctl(http_server_loop(server), EPOLL_CTL_DEL, handoff_conn.fd, NULL);
+	close(handoff_conn.fd);
+	handoff_conn.fd = -1;
 
-	http_response_status(res, 200);
-	http_response_header(res, "Content-Length", slen);
-	http_response_header(res, "Content-Type", type);
-	http_response_header(res, "Access-Control-Allow-Origin", "*");
-	http_response_body(res, blob, len);
+	if (n != 1) {
+		ERR("The new paste went away before taking over, carrying on\n");
+		return;
+	}
 
-	http_respond(req, res);
+	// HANDOFF_PATH is the new one's now
+	epoll_ctl(http_server_loop(server), EPOLL_CTL_DEL, handoff_listener.fd, NULL);
+	close(handoff_listener.fd);
+	handoff_listener.fd = -1;
 
-	free(blob);
+	printf("handed over, draining\n");
 
-	return 0;
+	http_server_drain(server, HANDOFF_DRAIN);
+}
+
+// handoff_addr: fills in HANDOFF_PATH's address
+void handoff_addr(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof addr->sun_path, "%s", HANDOFF_PATH);
 }
 
-// get_paste: loads the entire blob into memory
-int get_paste(char *id, void **blob, size_t *len)
+// get_paste: loads the entire blob into memory, returns 1 if there's no such paste
+int get_paste(unsigned char *uuid, void **blob, size_t *len)
 {
 	int rc;
 	sqlite3_stmt *stmt;
 	const void *tblob;
 	char *err;
+	char id[UUID_STR_LEN];
 
-	if (id == NULL) {
+	if (uuid == NULL) {
 		return -1;
 	}
 
+	// NOTE (Brian) ids are stored as uuid() wrote them, lower case, so this
+	// finds a paste however the id in the url was cased
+	uuid_format(uuid, id);
+
 #define GET_SQL ("select data from pastes where id = ?;")
 
 	rc = sqlite3_prepare_v2(db, GET_SQL, -1, &stmt, (const char **)&err);
@@ -322,7 +2665,7 @@ int get_paste(char *id, void **blob, size_t *len)
 		return -1;
 	}
 
-	rc = sqlite3_bind_text(stmt, 1, id, strlen(id), NULL);
+	rc = sqlite3_bind_text(stmt, 1, id, sizeof id, NULL);
 	if (rc != SQLITE_OK) {
 		SQLITE_ERRMSG(rc);
 		sqlite3_finalize(stmt);
@@ -330,8 +2673,14 @@ int get_paste(char *id, void **blob, size_t *len)
 	}
 
 	rc = sqlite3_step(stmt);
-
-	// TODO (brian) reasonably check for errors
+	if (rc == SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return 1;
+	} else if (rc != SQLITE_ROW) {
+		SQLITE_ERRMSG(rc);
+		sqlite3_finalize(stmt);
+		return -1;
+	}
 
 	sqlite3_column_blob(stmt, 0);
 	*len = sqlite3_column_bytes(stmt, 0);
@@ -344,35 +2693,6 @@ int get_paste(char *id, void **blob, size_t *len)
 	return 0;
 }
 
-// is_uuid: returns true if the input string is a uuid
-int is_uuid(char *id)
-{
-	int i;
-
-	if (id == NULL) {
-		return 0;
-	}
-
-	if (strlen(id) < 36) {
-		return 0;
-	}
-
-	for (i = 0; i < 36; i++) { // ensure our chars are right
-		switch (id[i]) {
-		case '0': case '1': case '2': case '3': case '4': case '5': case '6':
-		case '7': case '8': case '9': case 'a': case 'b': case 'c': case 'd':
-		case 'e': case 'f': case 'A': case 'B': case 'C': case 'D': case 'E':
-		case 'F': case '-':
-				break;
-		default:
-			return 0;
-		}
-	}
-
-	// index 13 should always be '4'
-	return id[14] == '4';
-}
-
 // init: initializes the program
 void init(char *db_file_name, char *sql_file_name)
 {
@@ -399,13 +2719,17 @@ void init(char *db_file_name, char *sql_file_name)
 		exit(1);
 	}
 
-	sqlite3_db_config(db,SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+	// NOTE (Brian) while a hot restart drains two of us have the database
+	// open. In WAL mode readers don't wait on the writer or it on them, so
+	// the new one can start up while the old one is still taking uploads.
+	sqlite3_busy_timeout(db, DB_BUSY_MS);
+
+	rc = sqlite3_exec(db, SQL_WAL_ENABLE, NULL, NULL, NULL);
 	if (rc != SQLITE_OK) {
 		SQLITE_ERRMSG(rc);
-		exit(1);
 	}
 
-	rc = sqlite3_load_extension(db, "./ext_uuid.so", "sqlite3_uuid_init", NULL);
+	rc = sqlite3_uuid_init(db, NULL, NULL);
 	if (rc != SQLITE_OK) {
 		SQLITE_ERRMSG(rc);
 		exit(1);
@@ -417,21 +2741,39 @@ void init(char *db_file_name, char *sql_file_name)
 		exit(1);
 	}
 
-#if 0
-	char *err;
-#define SQL_WAL_ENABLE ("PRAGMA journal_mode=WAL;")
-	char *err;
-	rc = sqlite3_exec(db, SQL_WAL_ENABLE, NULL, NULL, (char **)&err);
-	if (rc != SQLITE_OK) {
-		SQLITE_ERRMSG(rc);
-		exit(1);
-	}
-#endif
+	init_templates();
+
+	init_routes();
+}
+
+// init_templates: serializes the fixed parts of the responses we send
+void init_templates(void)
+{
+	templates[TMPL_NOT_FOUND] = http_template_init(404);
+	templates[TMPL_UNAVAILABLE] = http_template_init(503);
+
+	templates[TMPL_UPLOAD] = http_template_init(200);
+	http_template_header(templates[TMPL_UPLOAD], "Content-Type", "text/plain");
+
+	templates[TMPL_BODY] = http_template_init(200);
+	http_template_header(templates[TMPL_BODY], "Access-Control-Allow-Origin", "*");
+
+	templates[TMPL_BODY_VARY] = http_template_init(200);
+	http_template_header(templates[TMPL_BODY_VARY], "Access-Control-Allow-Origin", "*");
+	http_template_header(templates[TMPL_BODY_VARY], "Vary", "Accept-Encoding");
 }
 
-// cleanup: cleans up for a shutdown (probably doesn't ever happen)
+// cleanup: cleans up once the server has handed over and drained
 void cleanup(void)
 {
+	int i;
+
+	for (i = 0; i < TMPL_TOTAL; i++) {
+		http_template_free(templates[i]);
+	}
+
+	alog_close();
+
 	sqlite3_close(db);
 }
 
@@ -0,0 +1,173 @@
+#if !defined(SHA256_H)
+#define SHA256_H
+
+/*
+ * Brian Chrzanowski
+ * 2026-10-19 02:41:37
+ *
+ * SHA-256
+ *
+ * FIPS 180-4 SHA-256, for the hashes the paste metadata hands out. Like
+ * uuid.h everything is static inline, just include it.
+ *
+ * USAGE
+ *
+ *    struct sha256_t ctx;
+ *    unsigned char digest[SHA256_LEN];
+ *
+ *    sha256_init(&ctx);
+ *    sha256_update(&ctx, data, len); // as many times as needed
+ *    sha256_final(&ctx, digest);
+ *
+ * or sha256(data, len, digest) when it's all in one buffer.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_LEN   (32)
+#define SHA256_BLOCK (64)
+
+struct sha256_t {
+	uint32_t h[8];
+	uint64_t len; // bytes so far
+	unsigned char buf[SHA256_BLOCK];
+	size_t used;
+};
+
+// sha256_init: starts a hash
+static inline void sha256_init(struct sha256_t *ctx);
+// sha256_update: hashes len more bytes of data
+static inline void sha256_update(struct sha256_t *ctx, const void *data, size_t len);
+// sha256_final: finishes the hash, writing SHA256_LEN bytes to digest
+static inline void sha256_final(struct sha256_t *ctx, unsigned char *digest);
+// sha256: hashes one buffer
+static inline void sha256(const void *data, size_t len, unsigned char *digest);
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// sha256_block: runs the compression function over one block
+static inline void sha256_block(uint32_t *h, const unsigned char *p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	}
+
+	for (; i < 64; i++) {
+		t1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = k + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static inline void sha256_init(struct sha256_t *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->h, iv, sizeof iv);
+	ctx->len = 0;
+	ctx->used = 0;
+}
+
+static inline void sha256_update(struct sha256_t *ctx, const void *data, size_t len)
+{
+	const unsigned char *p;
+	size_t n;
+
+	p = data;
+	ctx->len += len;
+
+	if (ctx->used) {
+		n = SHA256_BLOCK - ctx->used;
+		n = len < n ? len : n;
+		memcpy(ctx->buf + ctx->used, p, n);
+		ctx->used += n;
+		p += n;
+		len -= n;
+
+		if (ctx->used < SHA256_BLOCK) {
+			return;
+		}
+
+		sha256_block(ctx->h, ctx->buf);
+		ctx->used = 0;
+	}
+
+	for (; SHA256_BLOCK <= len; p += SHA256_BLOCK, len -= SHA256_BLOCK) {
+		sha256_block(ctx->h, p);
+	}
+
+	memcpy(ctx->buf, p, len);
+	ctx->used = len;
+}
+
+static inline void sha256_final(struct sha256_t *ctx, unsigned char *digest)
+{
+	uint64_t bits;
+	int i;
+
+	bits = ctx->len * 8;
+
+	// a 1 bit, zeroes, then the length in bits in the last eight bytes
+	ctx->buf[ctx->used++] = 0x80;
+	if (SHA256_BLOCK - 8 < ctx->used) {
+		memset(ctx->buf + ctx->used, 0, SHA256_BLOCK - ctx->used);
+		sha256_block(ctx->h, ctx->buf);
+		ctx->used = 0;
+	}
+	memset(ctx->buf + ctx->used, 0, SHA256_BLOCK - 8 - ctx->used);
+
+	for (i = 0; i < 8; i++) {
+		ctx->buf[SHA256_BLOCK - 1 - i] = bits >> (i * 8);
+	}
+	sha256_block(ctx->h, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4 + 0] = ctx->h[i] >> 24;
+		digest[i * 4 + 1] = ctx->h[i] >> 16;
+		digest[i * 4 + 2] = ctx->h[i] >> 8;
+		digest[i * 4 + 3] = ctx->h[i];
+	}
+}
+
+static inline void sha256(const void *data, size_t len, unsigned char *digest)
+{
+	struct sha256_t ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+}
+
+#endif // SHA256_H
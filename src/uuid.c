@@ -64,6 +64,8 @@ SQLITE_EXTENSION_INIT1
 #include <string.h>
 #include <ctype.h>
 
+#include "uuid.h"
+
 #if !defined(SQLITE_ASCII) && !defined(SQLITE_EBCDIC)
 # define SQLITE_ASCII 1
 #endif
@@ -93,33 +95,25 @@ static void sqlite3UuidBlobToStr(
   const unsigned char *aBlob,  /* Input blob */
   unsigned char *zStr          /* Write the answer here */
 ){
-  static const char zDigits[] = "0123456789abcdef";
-  int i, k;
-  unsigned char x;
-  k = 0;
-  for(i=0, k=0x550; i<16; i++, k=k>>1){
-    if( k&1 ){
-      zStr[0] = '-';
-      zStr++;
-    }
-    x = aBlob[i];
-    zStr[0] = zDigits[x>>4];
-    zStr[1] = zDigits[x&0xf];
-    zStr += 2;
-  }
-  *zStr = 0;
+  uuid_format(aBlob, (char*)zStr);
+  zStr[UUID_STR_LEN] = 0;
 }
 
 /*
 ** Attempt to parse a zero-terminated input string zStr into a binary
 ** UUID.  Return 0 on success, or non-zero if the input string is not
-** parsable.
+** parsable.  The canonical form, which is all that uuid() makes, goes
+** through uuid.h; the other forms a digit at a time.
 */
 static int sqlite3UuidStrToBlob(
   const unsigned char *zStr,   /* Input string */
   unsigned char *aBlob         /* Write results here */
 ){
   int i;
+  if( strnlen((const char*)zStr, UUID_STR_LEN+1)==UUID_STR_LEN
+   && uuid_parse((const char*)zStr, UUID_STR_LEN, aBlob)==0 ){
+    return 0;
+  }
   if( zStr[0]=='{' ) zStr++;
   for(i=0; i<16; i++){
     if( zStr[0]=='-' ) zStr++;
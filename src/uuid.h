@@ -0,0 +1,185 @@
+#if !defined(UUID_H)
+#define UUID_H
+
+/*
+ * Brian Chrzanowski
+ * 2026-10-19 02:20:11
+ *
+ * UUID Codec
+ *
+ * Parses, formats and validates the canonical 36 character form of a uuid,
+ *
+ *     xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+ *
+ * to and from the 16 byte binary form, in network byte order. Parsing takes
+ * hex digits of either case, formatting always writes lower case.
+ *
+ * Both the server and the sqlite extension (uuid.c) use it, and as they're
+ * built into different binaries everything here is static inline; just
+ * include it.
+ *
+ * With SSSE3 (anything built with -march=native in the last fifteen years)
+ * a uuid is handled in a few shuffles, otherwise a byte at a time.
+ *
+ * Define UUID_NO_SIMD to use the scalar code regardless.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSSE3__) && !defined(UUID_NO_SIMD)
+#include <immintrin.h>
+#endif
+
+#define UUID_BLOB_LEN (16)
+#define UUID_STR_LEN  (36)
+
+// uuid_parse: parses the canonical uuid of exactly len chars in s into blob, returns 0 on success
+static inline int uuid_parse(const char *s, size_t len, unsigned char *blob);
+
+// uuid_format: writes blob's uuid into s, UUID_STR_LEN chars with no terminator
+static inline void uuid_format(const unsigned char *blob, char *s);
+
+// uuid_valid: returns true if s is a canonical uuid of exactly len chars
+static inline int uuid_valid(const char *s, size_t len);
+
+// uuid_nibble: the value of hex digit c, -1 if it isn't one
+static inline int uuid_nibble(int c)
+{
+	if ('0' <= c && c <= '9') {
+		return c - '0';
+	}
+
+	c |= 0x20;
+	if ('a' <= c && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	return -1;
+}
+
+static inline int uuid_parse(const char *s, size_t len, unsigned char *blob)
+{
+	if (len != UUID_STR_LEN || s[8] != '-' || s[13] != '-' || s[18] != '-' || s[23] != '-') {
+		return -1;
+	}
+
+#if defined(__SSSE3__) && !defined(UUID_NO_SIMD)
+	// NOTE (Brian) the 32 digits are gathered out of three overlapping loads,
+	// a at 0, b at 16 and c at 20 so nothing is read past the end, into two
+	// registers of 16 digits each; -1 in a shuffle zeroes that byte so the
+	// halves can be or'd together
+	__m128i a = _mm_loadu_si128((__m128i const *)(s + 0));
+	__m128i b = _mm_loadu_si128((__m128i const *)(s + 16));
+	__m128i c = _mm_loadu_si128((__m128i const *)(s + 20));
+
+	__m128i lo = _mm_or_si128(
+		_mm_shuffle_epi8(a, _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 9, 10, 11, 12, 14, 15, -1, -1)),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1)));
+	__m128i hi = _mm_or_si128(
+		_mm_shuffle_epi8(b, _mm_setr_epi8(3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 12, 13, 14, 15)));
+
+	// NOTE (Brian) signed compares, anything over 0x7f is negative and so is
+	// neither a digit nor a letter; letters are folded to lower case first
+	__m128i case20 = _mm_set1_epi8(0x20);
+	__m128i dig0 = _mm_set1_epi8('0' - 1), dig9 = _mm_set1_epi8('9' + 1);
+	__m128i alpa = _mm_set1_epi8('a' - 1), alpf = _mm_set1_epi8('f' + 1);
+
+	__m128i lolower = _mm_or_si128(lo, case20);
+	__m128i hilower = _mm_or_si128(hi, case20);
+	__m128i lodig = _mm_and_si128(_mm_cmpgt_epi8(lo, dig0), _mm_cmpgt_epi8(dig9, lo));
+	__m128i hidig = _mm_and_si128(_mm_cmpgt_epi8(hi, dig0), _mm_cmpgt_epi8(dig9, hi));
+	__m128i loalp = _mm_and_si128(_mm_cmpgt_epi8(lolower, alpa), _mm_cmpgt_epi8(alpf, lolower));
+	__m128i hialp = _mm_and_si128(_mm_cmpgt_epi8(hilower, alpa), _mm_cmpgt_epi8(alpf, hilower));
+
+	if (_mm_movemask_epi8(_mm_and_si128(_mm_or_si128(lodig, loalp), _mm_or_si128(hidig, hialp))) != 0xffff) {
+		return -1;
+	}
+
+	// the low four bits of '0'..'9' are the value, of 'a'..'f' the value - 9
+	__m128i nib = _mm_set1_epi8(0x0f), nine = _mm_set1_epi8(9);
+	lo = _mm_add_epi8(_mm_and_si128(lo, nib), _mm_and_si128(loalp, nine));
+	hi = _mm_add_epi8(_mm_and_si128(hi, nib), _mm_and_si128(hialp, nine));
+
+	// each pair of nibbles to (first << 4) + second, then down to bytes
+	__m128i pair = _mm_set1_epi16(0x0110);
+	lo = _mm_maddubs_epi16(lo, pair);
+	hi = _mm_maddubs_epi16(hi, pair);
+	_mm_storeu_si128((__m128i *)blob, _mm_packus_epi16(lo, hi));
+
+	return 0;
+#else
+	int i, h, l;
+
+	for (i = 0; i < UUID_BLOB_LEN; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) { // past a '-'
+			s++;
+		}
+
+		h = uuid_nibble(s[0]);
+		l = uuid_nibble(s[1]);
+		if (h < 0 || l < 0) {
+			return -1;
+		}
+
+		blob[i] = (h << 4) | l;
+		s += 2;
+	}
+
+	return 0;
+#endif
+}
+
+static inline void uuid_format(const unsigned char *blob, char *s)
+{
+#if defined(__SSSE3__) && !defined(UUID_NO_SIMD)
+	// NOTE (Brian) the nibbles are interleaved high then low and looked up as
+	// hex digits, then shuffled into place around the '-', which are or'd in
+	// where the shuffles leave zeroes
+	__m128i v = _mm_loadu_si128((__m128i const *)blob);
+	__m128i nib = _mm_set1_epi8(0x0f);
+	__m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+
+	__m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+	__m128i l = _mm_and_si128(v, nib);
+	__m128i lo = _mm_shuffle_epi8(digits, _mm_unpacklo_epi8(h, l)); // digits 0..15
+	__m128i hi = _mm_shuffle_epi8(digits, _mm_unpackhi_epi8(h, l)); // digits 16..31
+
+	__m128i out0 = _mm_or_si128(
+		_mm_shuffle_epi8(lo, _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12, 13)),
+		_mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, '-', 0, 0, 0, 0, '-', 0, 0));
+	__m128i out1 = _mm_or_si128(
+		_mm_or_si128(
+			_mm_shuffle_epi8(lo, _mm_setr_epi8(14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, 0, 1, 2, 3, -1, 4, 5, 6, 7, 8, 9, 10, 11))),
+		_mm_setr_epi8(0, 0, '-', 0, 0, 0, 0, '-', 0, 0, 0, 0, 0, 0, 0, 0));
+	int tail = _mm_cvtsi128_si32(_mm_srli_si128(hi, 12));
+
+	_mm_storeu_si128((__m128i *)(s + 0), out0);
+	_mm_storeu_si128((__m128i *)(s + 16), out1);
+	memcpy(s + 32, &tail, 4);
+#else
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < UUID_BLOB_LEN; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) {
+			*s++ = '-';
+		}
+
+		s[0] = digits[blob[i] >> 4];
+		s[1] = digits[blob[i] & 0xf];
+		s += 2;
+	}
+#endif
+}
+
+static inline int uuid_valid(const char *s, size_t len)
+{
+	unsigned char blob[UUID_BLOB_LEN];
+
+	return uuid_parse(s, len, blob) == 0;
+}
+
+#endif // UUID_H